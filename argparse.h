@@ -1,6 +1,7 @@
 #ifndef VOICETRAINER_ARGPARSE
 #define VOICETRAINER_ARGPARSE
 
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -9,11 +10,33 @@
 
 #define FOLDER_NAME "Voice"
 
+typedef enum {
+  VOICE_CMD_RECORD = 0, // Record a take (default)
+  VOICE_CMD_ANALYZE,    // Analyze saved takes
+  VOICE_CMD_COMPARE,    // Compare a take's pitch contour to references
+  VOICE_CMD_BENCH,      // Benchmark the spectral gate engines
+} VoiceCommand;
+
 typedef struct {
+  VoiceCommand command;
+  char **inputs;        // Input files for commands that take them
+  int num_inputs;
   char *output_file;    // Output file path (may be NULL for default)
   char *voice_dir;      // Directory for voice files
+  char *input_file;     // Process this file instead of recording ("-" = stdin)
+  char *raw_format;     // Sample format of raw input: "f32" or "s16"
   float gain;                // Amplification factor (default 2.0)
+  float band_seconds;        // compare's DTW band, in voiced seconds (2.0)
+  float preroll_seconds;     // Audio kept from before the take starts
+  int overlap;               // Spectral gate frame overlap in percent
+  int rt_cpu;                // Core for the audio callback thread, or -1
   bool no_playback : 1;      // Disable playback after recording
+  bool pitch_csv : 1;        // Also write the pitch track as CSV
+  bool timing : 1;           // Print a startup timing breakdown
+  bool session : 1;          // Record several takes in one warm session
+  bool noise_from_take : 1;  // Measure noise from each take, not the room
+  bool realtime : 1;         // Real-time scheduling and locked buffers
+  bool locate : 1;           // compare: find each reference inside the take
   bool help : 1;             // Show help message
 } VoiceTrainerArgs;
 
@@ -30,7 +53,8 @@ static inline char *get_voice_dir(void) {
   return voice_dir;
 }
 
-static inline char *get_save_path(char *output_file, char *voice_dir) {
+static inline char *get_save_path(char *output_file, char *voice_dir,
+                                  bool can_prompt) {
   char *save_path = NULL;
   if (!output_file) {
     time_t now;
@@ -61,6 +85,10 @@ static inline char *get_save_path(char *output_file, char *voice_dir) {
 
   // If the file already exists, prompt the user to overwrite or not
   if (access(save_path, F_OK) == 0) {
+    if (!can_prompt) {
+      fprintf(stderr, "Error: %s already exists\n", save_path);
+      exit(1);
+    }
     char response;
     printf("File %s already exists. Overwrite? (y/N): ", save_path);
     response = getchar();
@@ -77,9 +105,26 @@ static inline char *get_save_path(char *output_file, char *voice_dir) {
 static inline VoiceTrainerArgs voicetrainer_argparse(int argc, char **argv) {
   VoiceTrainerArgs args = {0};
   args.gain = 2.0f; // Default gain is 2x
+  args.band_seconds = 2.0f;
+  args.preroll_seconds = 2.0f;
+  args.overlap = 75;
+  args.rt_cpu = -1;
+
+  int first = 1;
+  if (argc > 1 && !strcmp(argv[1], "analyze")) {
+    args.command = VOICE_CMD_ANALYZE;
+  } else if (argc > 1 && !strcmp(argv[1], "compare")) {
+    args.command = VOICE_CMD_COMPARE;
+  } else if (argc > 1 && !strcmp(argv[1], "bench")) {
+    args.command = VOICE_CMD_BENCH;
+  }
+  if (args.command != VOICE_CMD_RECORD) {
+    args.inputs = (char **)calloc(argc, sizeof(char *));
+    first = 2;
+  }
 
   // Second pass: parse other arguments
-  for (int i = 1; i < argc; i++) {
+  for (int i = first; i < argc; i++) {
     char *arg = argv[i];
     if (!strcmp(arg, "-o") || !strcmp(arg, "--output")) {
       if (i + 1 < argc) {
@@ -101,11 +146,88 @@ static inline VoiceTrainerArgs voicetrainer_argparse(int argc, char **argv) {
         fprintf(stderr, "Error: -g requires a gain value\n");
         exit(1);
       }
+    } else if (!strcmp(arg, "-i") || !strcmp(arg, "--input")) {
+      if (i + 1 < argc) {
+        args.input_file = argv[++i];
+      } else {
+        fprintf(stderr, "Error: --input requires a file name or '-'\n");
+        exit(1);
+      }
+    } else if (!strcmp(arg, "--raw")) {
+      if (i + 1 < argc) {
+        args.raw_format = argv[++i];
+        if (strcmp(args.raw_format, "f32") && strcmp(args.raw_format, "s16")) {
+          fprintf(stderr, "Error: --raw must be f32 or s16\n");
+          exit(1);
+        }
+      } else {
+        fprintf(stderr, "Error: --raw requires a sample format\n");
+        exit(1);
+      }
+    } else if (!strcmp(arg, "--preroll")) {
+      if (i + 1 < argc) {
+        args.preroll_seconds = atof(argv[++i]);
+        if (args.preroll_seconds < 0.0f) {
+          fprintf(stderr, "Error: pre-roll must be non-negative\n");
+          exit(1);
+        }
+      } else {
+        fprintf(stderr, "Error: --preroll requires a value in seconds\n");
+        exit(1);
+      }
+    } else if (!strcmp(arg, "--overlap")) {
+      if (i + 1 < argc) {
+        args.overlap = atoi(argv[++i]);
+        if (args.overlap != 50 && args.overlap != 75) {
+          fprintf(stderr, "Error: overlap must be 50 or 75\n");
+          exit(1);
+        }
+      } else {
+        fprintf(stderr, "Error: --overlap requires a percentage\n");
+        exit(1);
+      }
+    } else if (!strcmp(arg, "--band")) {
+      if (i + 1 < argc) {
+        args.band_seconds = atof(argv[++i]);
+        if (args.band_seconds <= 0.0f) {
+          fprintf(stderr, "Error: band must be positive\n");
+          exit(1);
+        }
+      } else {
+        fprintf(stderr, "Error: --band requires a value in seconds\n");
+        exit(1);
+      }
+    } else if (!strcmp(arg, "--locate")) {
+      args.locate = 1;
+    } else if (!strcmp(arg, "--csv")) {
+      args.pitch_csv = 1;
+    } else if (!strcmp(arg, "--timing")) {
+      args.timing = 1;
+    } else if (!strcmp(arg, "-s") || !strcmp(arg, "--session")) {
+      args.session = 1;
+    } else if (!strcmp(arg, "--noise-from-take")) {
+      args.noise_from_take = 1;
+    } else if (!strcmp(arg, "--rt")) {
+      args.realtime = 1;
+    } else if (!strcmp(arg, "--cpu")) {
+      if (i + 1 < argc) {
+        args.rt_cpu = atoi(argv[++i]);
+        if (args.rt_cpu < 0 || args.rt_cpu >= sysconf(_SC_NPROCESSORS_CONF)) {
+          fprintf(stderr, "Error: no CPU %s\n", argv[i]);
+          exit(1);
+        }
+        args.realtime = 1;
+      } else {
+        fprintf(stderr, "Error: --cpu requires a core number\n");
+        exit(1);
+      }
     } else if (!strcmp(arg, "-h") || !strcmp(arg, "--help")) {
       args.help = 1;
     } else if (arg[0] == '-') {
       fprintf(stderr, "Error: Unknown option '%s'\n", arg);
       exit(1);
+    } else if (args.command != VOICE_CMD_RECORD) {
+      args.inputs[args.num_inputs++] = arg;
     } else {
       // Positional argument (output file)
       if (args.output_file == NULL) {
@@ -120,20 +242,94 @@ static inline VoiceTrainerArgs voicetrainer_argparse(int argc, char **argv) {
   if (args.help) {
     char helpmsg[] =
         "Voice Recorder with Playback\n\n"
-        "Usage: voicetrainer [OPTIONS] [OUTPUT_FILE]\n\n"
+        "Usage: voicetrainer [OPTIONS] [OUTPUT_FILE]\n"
+        "       voicetrainer analyze [--csv] TAKE.wav...\n"
+        "       voicetrainer compare [--band SECONDS] [--locate] TAKE REFERENCE...\n"
+        "       voicetrainer bench [--overlap PCT] [TAKE.wav...]\n\n"
         "Options:\n"
         "  -o, --output FILE    Specify output filename (default: timestamped in ~/Voice)\n"
         "  -g, --gain FACTOR    Audio amplification factor (default: 2.0)\n"
         "  -n, --no-playback    Disable playback after recording\n"
+        "  -i, --input FILE     Process FILE instead of recording from the\n"
+        "                       microphone, as fast as possible and without\n"
+        "                       playback. '-' reads raw PCM from stdin\n"
+        "      --raw FORMAT     Input is headerless mono 44.1 kHz PCM, f32 or\n"
+        "                       s16 (default for '-': f32)\n"
+        "      --csv            Also write the pitch track as CSV\n"
+        "      --preroll SECS   Keep audio from before the take starts, from\n"
+        "                       when the microphone opens (default: 2.0, 0 = off)\n"
+        "  -s, --session        Keep running between takes: Enter starts and stops\n"
+        "                       each take, q quits. Takes are saved as\n"
+        "                       OUTPUT_FILE-01.wav, -02.wav, ...\n"
+        "      --overlap PCT    Noise gate frame overlap, 75 or 50. 50 halves the\n"
+        "                       FFT work with slightly different artifacts\n"
+        "                       (default: 75)\n"
+        "      --noise-from-take\n"
+        "                       Skip the room noise capture and measure the noise\n"
+        "                       from the quietest parts of each take\n"
+        "      --timing         Print a startup timing breakdown\n"
+        "      --rt             Run the audio callback thread SCHED_FIFO with its\n"
+        "                       buffers locked, keep the take buffer faulted in\n"
+        "                       ahead of the recording and flush denormals; the\n"
+        "                       analysis stays at normal priority. What was\n"
+        "                       granted is printed when recording starts\n"
+        "      --cpu N          Also pin the audio callback thread to core N\n"
+        "                       (implies --rt)\n"
         "  -h, --help           Show this help message and exit\n\n"
         "OUTPUT_FILE can be specified positionally, or with the flag, or not at all.\n"
-        "If OUTPUT_FILE doesn't end with .wav, it will be appended.\n";
+        "If OUTPUT_FILE doesn't end with .wav, it will be appended.\n"
+        "A per-hop pitch/confidence/RMS track is saved next to it as .pitch.\n\n"
+        "Commands:\n"
+        "  analyze TAKE.wav...  Write pitch tracks and report formant and voice\n"
+        "                       quality (jitter, shimmer, HNR, CPP) for saved takes\n"
+        "  compare TAKE REF...  Align TAKE's pitch contour to each reference with\n"
+        "                       banded DTW and report per-segment deviation in\n"
+        "                       cents. Takes are .pitch tracks or analyzed .wav\n"
+        "                       files. --band sets the DTW band in seconds of\n"
+        "                       voiced audio, as unvoiced hops are left out of\n"
+        "                       the alignment (default 2 s).\n"
+        "                       --locate first finds where each reference\n"
+        "                       occurs in TAKE (e.g. a phrase in a long session)\n"
+        "                       and compares only that part\n"
+        "  bench [TAKE.wav...]  Time the noise gate with one real FFT per frame\n"
+        "                       against two frames per complex FFT, on the takes\n"
+        "                       or on a minute of synthetic audio\n";
     puts(helpmsg);
     exit(0);
   }
 
+  if (args.command == VOICE_CMD_ANALYZE) {
+    if (args.num_inputs == 0) {
+      fprintf(stderr, "Error: analyze requires at least one input file\n");
+      exit(1);
+    }
+    return args;
+  }
+  if (args.command == VOICE_CMD_COMPARE) {
+    if (args.num_inputs < 2) {
+      fprintf(stderr, "Error: compare requires a take and a reference\n");
+      exit(1);
+    }
+    return args;
+  }
+  if (args.command == VOICE_CMD_BENCH)
+    return args;
+
+  if (args.input_file && args.session) {
+    fprintf(stderr, "Error: --session records from the microphone and can't "
+                    "be combined with --input\n");
+    exit(1);
+  }
+  if (args.input_file && !strcmp(args.input_file, "-") && !args.raw_format)
+    args.raw_format = "f32";
+  if (args.input_file)
+    args.no_playback = 1;
+
   args.voice_dir = get_voice_dir();
-  args.output_file = get_save_path(args.output_file, args.voice_dir);
+  // stdin can't answer the overwrite prompt when it carries the audio
+  bool can_prompt = !args.input_file || strcmp(args.input_file, "-");
+  args.output_file =
+      get_save_path(args.output_file, args.voice_dir, can_prompt);
   return args;
 }
 
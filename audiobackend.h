@@ -0,0 +1,601 @@
+#ifndef VOICETRAINER_AUDIOBACKEND
+#define VOICETRAINER_AUDIOBACKEND
+
+#include <errno.h>
+#include <math.h>
+#include <poll.h>
+#include <portaudio.h>
+#include <sndfile.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <time.h>
+#include <unistd.h>
+
+// Audio I/O for noise_cancel's DSP loop. A backend captures mono float
+// samples and plays back the gated ones; the loop only calls read and write
+// and never knows whether a server, a sound card, a file or nothing is on
+// the other side. Besides PulseAudio (in noise_cancel.c) there are:
+//
+//   portaudio  Default input and output device, blocking I/O
+//   wav        Read --input, write --output (optional); as fast as possible
+//   raw        PCM on stdin and stdout (noise_cancel --pipe)
+//   null       Silence in, output discarded; as fast as possible
+//   loopback   Virtual sound card playing a test signal, for measuring
+//              latency (noise_cancel --measure-latency)
+//
+// The non-device backends make the gate testable and measurable without a
+// sound server.
+
+#define AUDIOBACKEND_END -1    // read: the input is exhausted
+#define AUDIOBACKEND_ERROR -2  // read/write: the device or file failed
+
+enum {
+    AUDIO_FORMAT_F32,  // 32-bit float
+    AUDIO_FORMAT_S16   // Signed 16-bit
+};
+
+typedef struct AudioBackend AudioBackend;
+
+typedef struct {
+    int sample_rate;
+    size_t block_frames;  // Samples the DSP loop moves at a time
+    int latency_ms;       // Buffering to ask of a device
+    const char *input;    // wav: file to read
+    const char *output;   // wav: file to write, or NULL to discard
+    int format;           // raw: AUDIO_FORMAT_* on stdin and stdout
+    int trials;           // loopback: chirps to play
+    double lead_seconds;  // loopback: noise floor before the first chirp
+
+    // PulseAudio only
+    bool direct;          // Write into the pipe source instead of a playback stream
+    int backpressure;     // What direct output does when the pipe is full
+    const char *device;   // Capture device, or NULL for the default
+    const char *source_name;         // Virtual source to create
+    const char *source_description;  // Its name in mixers
+    // Called from any thread when captured audio arrives, the stream fails
+    // or wake() is called. With it set, a read with nothing to return
+    // returns 0 at once, so one thread can serve several backends.
+    void (*notify)(void *userdata);
+    void *notify_userdata;
+} AudioBackendConfig;
+
+typedef struct {
+    const char *name;
+    bool realtime;  // Paced by a device clock rather than by the DSP loop
+    int (*open)(AudioBackend *b, const AudioBackendConfig *config);
+    // Up to count captured samples. Blocks until there are some; returns 0
+    // if woken by wake() first, or AUDIOBACKEND_END/AUDIOBACKEND_ERROR.
+    long (*read)(AudioBackend *b, float *samples, size_t count);
+    // Hand over count gated samples; returns count or AUDIOBACKEND_ERROR.
+    // Samples the backend had no room for are counted in output_dropped.
+    long (*write)(AudioBackend *b, const float *samples, size_t count);
+    // Seconds of buffering the backend adds between capture and output
+    double (*latency)(AudioBackend *b);
+    // Make a blocked read return early. Any thread.
+    void (*wake)(AudioBackend *b);
+    void (*close)(AudioBackend *b);
+} AudioBackendOps;
+
+struct AudioBackend {
+    const AudioBackendOps *ops;
+    void *state;
+    _Atomic size_t capture_dropped;  // Captured audio the DSP loop never saw
+    _Atomic size_t output_dropped;   // Gated audio that never reached the output
+    _Atomic size_t output_underruns; // Times the output ran dry and played silence
+};
+
+static void audiobackend_nop_wake(AudioBackend *b) {
+    (void)b;
+}
+
+static double audiobackend_no_latency(AudioBackend *b) {
+    (void)b;
+    return 0.0;
+}
+
+// null: endless silence, output discarded
+
+static int null_open(AudioBackend *b, const AudioBackendConfig *config) {
+    (void)b;
+    (void)config;
+    return 0;
+}
+
+static long null_read(AudioBackend *b, float *samples, size_t count) {
+    (void)b;
+    memset(samples, 0, count * sizeof(float));
+    return (long)count;
+}
+
+static long null_write(AudioBackend *b, const float *samples, size_t count) {
+    (void)b;
+    (void)samples;
+    return (long)count;
+}
+
+static void null_close(AudioBackend *b) {
+    (void)b;
+}
+
+static const AudioBackendOps null_backend = {
+    "null", false, null_open, null_read, null_write,
+    audiobackend_no_latency, audiobackend_nop_wake, null_close
+};
+
+// raw: PCM in native byte order on stdin and stdout, float32 or signed
+// 16-bit. Both sides go through RAW_IO_BYTES buffers so a pipeline costs a
+// few large reads and writes rather than one per block. stdout is moved to
+// a private descriptor and pointed at stderr, so messages printed while
+// running can't end up in the audio.
+
+#define RAW_IO_BYTES (1 << 16)
+
+typedef struct {
+    int format;       // AUDIO_FORMAT_*
+    size_t sample_bytes;
+    int out_fd;
+    int wake_fd;      // eventfd, polled alongside stdin
+    char *in;         // Read from stdin, not yet converted
+    size_t in_pos;
+    size_t in_len;
+    char *out;        // Converted, not yet written to stdout
+    size_t out_len;
+    bool failed;      // A write to stdout failed
+} RawBackend;
+
+static int raw_open(AudioBackend *b, const AudioBackendConfig *config) {
+    RawBackend *raw = (RawBackend*)calloc(1, sizeof(RawBackend));
+    if (!raw)
+        return -1;
+    raw->format = config->format;
+    raw->sample_bytes = config->format == AUDIO_FORMAT_S16 ? sizeof(int16_t) : sizeof(float);
+    raw->in = (char*)malloc(RAW_IO_BYTES);
+    raw->out = (char*)malloc(RAW_IO_BYTES);
+    raw->out_fd = dup(STDOUT_FILENO);
+    raw->wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (!raw->in || !raw->out || raw->out_fd < 0 || raw->wake_fd < 0 ||
+        dup2(STDERR_FILENO, STDOUT_FILENO) < 0) {
+        fprintf(stderr, "Failed to set up stdin/stdout audio: %s\n", strerror(errno));
+        if (raw->out_fd >= 0)
+            close(raw->out_fd);
+        if (raw->wake_fd >= 0)
+            close(raw->wake_fd);
+        free(raw->in);
+        free(raw->out);
+        free(raw);
+        return -1;
+    }
+    b->state = raw;
+    return 0;
+}
+
+static long raw_read(AudioBackend *b, float *samples, size_t count) {
+    RawBackend *raw = (RawBackend*)b->state;
+    if (raw->in_len - raw->in_pos < raw->sample_bytes) {
+        struct pollfd fds[2] = {{.fd = STDIN_FILENO, .events = POLLIN},
+                                {.fd = raw->wake_fd, .events = POLLIN}};
+        if (poll(fds, 2, -1) < 0)
+            return errno == EINTR ? 0 : AUDIOBACKEND_ERROR;
+        if (fds[1].revents & POLLIN) {
+            eventfd_t value;
+            eventfd_read(raw->wake_fd, &value);
+            return 0;
+        }
+
+        // Keep the start of a sample split across reads
+        size_t partial = raw->in_len - raw->in_pos;
+        memmove(raw->in, raw->in + raw->in_pos, partial);
+        ssize_t n = read(STDIN_FILENO, raw->in + partial, RAW_IO_BYTES - partial);
+        if (n < 0)
+            return errno == EINTR ? 0 : AUDIOBACKEND_ERROR;
+        if (n == 0)
+            return AUDIOBACKEND_END;
+        raw->in_pos = 0;
+        raw->in_len = partial + (size_t)n;
+    }
+
+    size_t available = (raw->in_len - raw->in_pos) / raw->sample_bytes;
+    if (count > available)
+        count = available;
+    const char *src = raw->in + raw->in_pos;
+    if (raw->format == AUDIO_FORMAT_S16) {
+        for (size_t i = 0; i < count; i++) {
+            int16_t v;
+            memcpy(&v, src + i * sizeof(v), sizeof(v));
+            samples[i] = v / 32768.0f;
+        }
+    } else {
+        memcpy(samples, src, count * sizeof(float));
+    }
+    raw->in_pos += count * raw->sample_bytes;
+    return (long)count;
+}
+
+static bool raw_flush(RawBackend *raw) {
+    size_t done = 0;
+    while (done < raw->out_len && !raw->failed) {
+        ssize_t n = write(raw->out_fd, raw->out + done, raw->out_len - done);
+        if (n < 0 && errno != EINTR)
+            raw->failed = true;
+        else if (n > 0)
+            done += (size_t)n;
+    }
+    raw->out_len = 0;
+    return !raw->failed;
+}
+
+static long raw_write(AudioBackend *b, const float *samples, size_t count) {
+    RawBackend *raw = (RawBackend*)b->state;
+    size_t capacity = RAW_IO_BYTES / raw->sample_bytes;
+    size_t total = count;
+    while (count > 0) {
+        size_t space = capacity - raw->out_len / raw->sample_bytes;
+        size_t n = count < space ? count : space;
+        char *dst = raw->out + raw->out_len;
+        if (raw->format == AUDIO_FORMAT_S16) {
+            for (size_t i = 0; i < n; i++) {
+                float v = samples[i] * 32768.0f;
+                int16_t q = v >= 32767.0f ? 32767 : v <= -32768.0f ? -32768 : (int16_t)lrintf(v);
+                memcpy(dst + i * sizeof(q), &q, sizeof(q));
+            }
+        } else {
+            memcpy(dst, samples, n * sizeof(float));
+        }
+        raw->out_len += n * raw->sample_bytes;
+        samples += n;
+        count -= n;
+        if (raw->out_len == capacity * raw->sample_bytes && !raw_flush(raw))
+            return AUDIOBACKEND_ERROR;
+    }
+    return (long)total;
+}
+
+static void raw_wake(AudioBackend *b) {
+    eventfd_write(((RawBackend*)b->state)->wake_fd, 1);
+}
+
+static void raw_close(AudioBackend *b) {
+    RawBackend *raw = (RawBackend*)b->state;
+    if (!raw)
+        return;
+    if (!raw_flush(raw))
+        fprintf(stderr, "Failed to write audio to stdout: %s\n", strerror(errno));
+    close(raw->out_fd);
+    close(raw->wake_fd);
+    free(raw->in);
+    free(raw->out);
+    free(raw);
+    b->state = NULL;
+}
+
+static const AudioBackendOps raw_backend = {
+    "raw", false, raw_open, raw_read, raw_write,
+    audiobackend_no_latency, raw_wake, raw_close
+};
+
+// wav: any mono file libsndfile reads at the gate's sample rate in, a
+// float WAV out
+
+typedef struct {
+    SNDFILE *input;
+    SNDFILE *output;
+} WavBackend;
+
+static void wav_close(AudioBackend *b) {
+    WavBackend *wav = (WavBackend*)b->state;
+    if (!wav)
+        return;
+    if (wav->input)
+        sf_close(wav->input);
+    if (wav->output)
+        sf_close(wav->output);
+    free(wav);
+    b->state = NULL;
+}
+
+static int wav_open(AudioBackend *b, const AudioBackendConfig *config) {
+    if (!config->input) {
+        fprintf(stderr, "The wav backend needs --input FILE\n");
+        return -1;
+    }
+    WavBackend *wav = (WavBackend*)calloc(1, sizeof(WavBackend));
+    if (!wav)
+        return -1;
+    b->state = wav;
+
+    SF_INFO info = {0};
+    wav->input = sf_open(config->input, SFM_READ, &info);
+    if (!wav->input) {
+        fprintf(stderr, "Failed to open %s: %s\n", config->input, sf_strerror(NULL));
+        wav_close(b);
+        return -1;
+    }
+    if (info.channels != 1 || info.samplerate != config->sample_rate) {
+        fprintf(stderr, "%s must be mono at %d Hz\n", config->input, config->sample_rate);
+        wav_close(b);
+        return -1;
+    }
+
+    if (config->output) {
+        SF_INFO out_info = {.samplerate = config->sample_rate,
+                            .channels = 1,
+                            .format = SF_FORMAT_WAV | SF_FORMAT_FLOAT};
+        wav->output = sf_open(config->output, SFM_WRITE, &out_info);
+        if (!wav->output) {
+            fprintf(stderr, "Failed to create %s: %s\n", config->output, sf_strerror(NULL));
+            wav_close(b);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static long wav_read(AudioBackend *b, float *samples, size_t count) {
+    WavBackend *wav = (WavBackend*)b->state;
+    sf_count_t n = sf_readf_float(wav->input, samples, (sf_count_t)count);
+    return n > 0 ? (long)n : AUDIOBACKEND_END;
+}
+
+static long wav_write(AudioBackend *b, const float *samples, size_t count) {
+    WavBackend *wav = (WavBackend*)b->state;
+    if (wav->output &&
+        sf_writef_float(wav->output, samples, (sf_count_t)count) != (sf_count_t)count)
+        return AUDIOBACKEND_ERROR;
+    return (long)count;
+}
+
+static const AudioBackendOps wav_backend = {
+    "wav", false, wav_open, wav_read, wav_write,
+    audiobackend_no_latency, audiobackend_nop_wake, wav_close
+};
+
+// portaudio: default devices through the blocking API. A read waits at most
+// one block, so wake() needs to do nothing.
+
+static int portaudio_open(AudioBackend *b, const AudioBackendConfig *config) {
+    PaError err = Pa_Initialize();
+    if (err != paNoError) {
+        fprintf(stderr, "Failed to initialize PortAudio: %s\n", Pa_GetErrorText(err));
+        return -1;
+    }
+    PaDeviceIndex input = Pa_GetDefaultInputDevice();
+    PaDeviceIndex output = Pa_GetDefaultOutputDevice();
+    if (input == paNoDevice || output == paNoDevice) {
+        fprintf(stderr, "No default audio input or output device\n");
+        Pa_Terminate();
+        return -1;
+    }
+    PaStreamParameters input_params = {.device = input,
+                                       .channelCount = 1,
+                                       .sampleFormat = paFloat32,
+                                       .suggestedLatency = config->latency_ms / 1000.0};
+    PaStreamParameters output_params = {.device = output,
+                                        .channelCount = 1,
+                                        .sampleFormat = paFloat32,
+                                        .suggestedLatency = config->latency_ms / 1000.0};
+    PaStream *stream;
+    err = Pa_OpenStream(&stream, &input_params, &output_params, config->sample_rate,
+                        config->block_frames, paClipOff, NULL, NULL);
+    if (err == paNoError)
+        err = Pa_StartStream(stream);
+    if (err != paNoError) {
+        fprintf(stderr, "Failed to open audio devices: %s\n", Pa_GetErrorText(err));
+        Pa_Terminate();
+        return -1;
+    }
+    b->state = stream;
+    return 0;
+}
+
+static long portaudio_read(AudioBackend *b, float *samples, size_t count) {
+    PaError err = Pa_ReadStream((PaStream*)b->state, samples, count);
+    if (err == paInputOverflowed) {
+        // Some audio was lost before this block, counted as one block; what
+        // was read is still good
+        atomic_fetch_add(&b->capture_dropped, count);
+    } else if (err != paNoError) {
+        return AUDIOBACKEND_ERROR;
+    }
+    return (long)count;
+}
+
+static long portaudio_write(AudioBackend *b, const float *samples, size_t count) {
+    PaError err = Pa_WriteStream((PaStream*)b->state, samples, count);
+    if (err == paOutputUnderflowed)
+        return (long)count;  // The device ran dry before this block arrived
+    return err == paNoError ? (long)count : AUDIOBACKEND_ERROR;
+}
+
+static double portaudio_latency(AudioBackend *b) {
+    const PaStreamInfo *info = Pa_GetStreamInfo((PaStream*)b->state);
+    return info ? info->inputLatency + info->outputLatency : 0.0;
+}
+
+static void portaudio_close(AudioBackend *b) {
+    if (!b->state)
+        return;
+    Pa_StopStream((PaStream*)b->state);
+    Pa_CloseStream((PaStream*)b->state);
+    Pa_Terminate();
+    b->state = NULL;
+}
+
+static const AudioBackendOps portaudio_backend = {
+    "portaudio", true, portaudio_open, portaudio_read, portaudio_write,
+    portaudio_latency, audiobackend_nop_wake, portaudio_close
+};
+
+// loopback: a virtual sound card running on the clock. Capture delivers a
+// test signal a block at a time as it would have been recorded: a faint
+// noise floor, then one chirp every LOOPBACK_TRIAL_SECONDS. Playback goes
+// into a buffer of --latency ms that drains at the sample rate, restarting
+// (and counting an underrun) if it runs dry. Everything played is kept with
+// the time it would reach the speaker, so the latency of each chirp can be
+// measured once the run is over.
+
+#define LOOPBACK_TRIAL_SECONDS 0.5   // Chirp spacing; output lags must be less
+#define LOOPBACK_CHIRP_SECONDS 0.02
+#define LOOPBACK_CHIRP_LOW 300.0     // Hz
+#define LOOPBACK_CHIRP_HIGH 5000.0   // Hz
+#define LOOPBACK_CHIRP_LEVEL 0.5f
+#define LOOPBACK_NOISE_LEVEL 0.01f
+
+typedef struct {
+    int sample_rate;
+    double buffer_seconds;   // Playback buffering
+    double block_seconds;    // Capture buffering: a block is whole before it is read
+    float *input;            // The whole test signal
+    size_t input_frames;
+    size_t chirp_frames;
+    size_t first_chirp;      // Sample where the first chirp starts
+    size_t trial_frames;     // Samples from one chirp to the next
+    int trials;
+    double start;            // When input sample 0 was captured (CLOCK_MONOTONIC, s)
+    size_t captured;         // Samples handed to the loop
+    float *output;           // Everything written, in order
+    double *play_time;       // When each output sample reaches the speaker
+    size_t written;
+    double play_start;       // When output sample 0 plays, moved by underruns
+    size_t underruns;
+    int wake_fd;
+} LoopbackBackend;
+
+static double loopback_clock(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Hann-windowed linear sweep, sample k of the chirp
+static float loopback_chirp(const LoopbackBackend *lb, size_t k) {
+    double duration = (double)lb->chirp_frames / lb->sample_rate;
+    double t = (double)k / lb->sample_rate;
+    double phase = 2.0 * M_PI * (LOOPBACK_CHIRP_LOW * t +
+        (LOOPBACK_CHIRP_HIGH - LOOPBACK_CHIRP_LOW) * t * t / (2.0 * duration));
+    double window = 0.5 - 0.5 * cos(2.0 * M_PI * k / (lb->chirp_frames - 1));
+    return LOOPBACK_CHIRP_LEVEL * (float)(window * sin(phase));
+}
+
+static void loopback_close(AudioBackend *b) {
+    LoopbackBackend *lb = (LoopbackBackend*)b->state;
+    if (!lb)
+        return;
+    if (lb->wake_fd >= 0)
+        close(lb->wake_fd);
+    free(lb->input);
+    free(lb->output);
+    free(lb->play_time);
+    free(lb);
+    b->state = NULL;
+}
+
+static int loopback_open(AudioBackend *b, const AudioBackendConfig *config) {
+    LoopbackBackend *lb = (LoopbackBackend*)calloc(1, sizeof(LoopbackBackend));
+    if (!lb)
+        return -1;
+    b->state = lb;
+    lb->sample_rate = config->sample_rate;
+    lb->buffer_seconds = config->latency_ms / 1000.0;
+    lb->block_seconds = (double)config->block_frames / config->sample_rate;
+    lb->trials = config->trials;
+    lb->chirp_frames = (size_t)(LOOPBACK_CHIRP_SECONDS * config->sample_rate);
+    lb->trial_frames = (size_t)(LOOPBACK_TRIAL_SECONDS * config->sample_rate);
+    lb->first_chirp = (size_t)(config->lead_seconds * config->sample_rate);
+    // One more trial's worth of noise so the last chirp makes it out
+    lb->input_frames = lb->first_chirp + (config->trials + 1) * lb->trial_frames;
+    lb->input = (float*)malloc(lb->input_frames * sizeof(float));
+    lb->output = (float*)malloc(lb->input_frames * sizeof(float));
+    lb->play_time = (double*)malloc(lb->input_frames * sizeof(double));
+    lb->wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (!lb->input || !lb->output || !lb->play_time || lb->wake_fd < 0) {
+        fprintf(stderr, "Cannot allocate the loopback device\n");
+        loopback_close(b);
+        return -1;
+    }
+
+    uint32_t seed = 0x9e3779b9;
+    for (size_t i = 0; i < lb->input_frames; i++) {
+        seed ^= seed << 13;
+        seed ^= seed >> 17;
+        seed ^= seed << 5;
+        lb->input[i] = LOOPBACK_NOISE_LEVEL * ((float)seed / 2147483648.0f - 1.0f);
+    }
+    for (int t = 0; t < lb->trials; t++) {
+        float *chirp = lb->input + lb->first_chirp + t * lb->trial_frames;
+        for (size_t k = 0; k < lb->chirp_frames; k++)
+            chirp[k] += loopback_chirp(lb, k);
+    }
+    return 0;
+}
+
+// Sleeps until the block has been "recorded", as a sound card would
+static long loopback_read(AudioBackend *b, float *samples, size_t count) {
+    LoopbackBackend *lb = (LoopbackBackend*)b->state;
+    if (lb->captured == lb->input_frames)
+        return AUDIOBACKEND_END;
+    if (count > lb->input_frames - lb->captured)
+        count = lb->input_frames - lb->captured;
+    if (!lb->captured)
+        lb->start = loopback_clock();
+
+    double due = lb->start + (double)(lb->captured + count) / lb->sample_rate;
+    double wait = due - loopback_clock();
+    if (wait > 0) {
+        struct pollfd fd = {.fd = lb->wake_fd, .events = POLLIN};
+        struct timespec timeout = {(time_t)wait, (long)((wait - (time_t)wait) * 1e9)};
+        int ready = ppoll(&fd, 1, &timeout, NULL);
+        if (ready < 0)
+            return errno == EINTR ? 0 : AUDIOBACKEND_ERROR;
+        if (ready > 0) {
+            eventfd_t value;
+            eventfd_read(lb->wake_fd, &value);
+            return 0;
+        }
+    }
+    memcpy(samples, lb->input + lb->captured, count * sizeof(float));
+    lb->captured += count;
+    return (long)count;
+}
+
+static long loopback_write(AudioBackend *b, const float *samples, size_t count) {
+    LoopbackBackend *lb = (LoopbackBackend*)b->state;
+    size_t total = count;
+    if (count > lb->input_frames - lb->written)
+        count = lb->input_frames - lb->written;
+    double now = loopback_clock();
+    double due = lb->play_start + (double)lb->written / lb->sample_rate;
+    if (!lb->written || due < now) {
+        // Playback starts, or restarts after running dry, once the buffer
+        // has filled
+        if (lb->written)
+            lb->underruns++;
+        lb->play_start = now + lb->buffer_seconds - (double)lb->written / lb->sample_rate;
+    }
+    memcpy(lb->output + lb->written, samples, count * sizeof(float));
+    for (size_t i = 0; i < count; i++)
+        lb->play_time[lb->written + i] =
+            lb->play_start + (double)(lb->written + i) / lb->sample_rate;
+    lb->written += count;
+    return (long)total;
+}
+
+static double loopback_latency(AudioBackend *b) {
+    LoopbackBackend *lb = (LoopbackBackend*)b->state;
+    return lb->block_seconds + lb->buffer_seconds;
+}
+
+static void loopback_wake(AudioBackend *b) {
+    eventfd_write(((LoopbackBackend*)b->state)->wake_fd, 1);
+}
+
+static const AudioBackendOps loopback_backend = {
+    "loopback", true, loopback_open, loopback_read, loopback_write,
+    loopback_latency, loopback_wake, loopback_close
+};
+
+#endif /* VOICETRAINER_AUDIOBACKEND */
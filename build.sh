@@ -6,7 +6,7 @@ ARCH_PACKAGES="portaudio aubio libsndfile fftw"
 
 CFLAGS="-O3 -march=native"
 DEBUG_FLAGS="-fsanitize=address -g -fsanitize=undefined -fno-omit-frame-pointer"
-LIBS="-lportaudio -laubio -lsndfile -lfftw3f -lm"
+LIBS="-lportaudio -laubio -lsndfile -lfftw3f -lm -pthread"
 
 # Detect package manager and install dependencies
 if command -v pacman >/dev/null 2>&1; then
@@ -1,3 +1,3 @@
 
-sudo apt-get install -y libpulse-dev libfftw3-dev
-gcc -o noise_cancel noise_cancel.c -lpulse-simple -lpulse -lfftw3f -lm
+sudo apt-get install -y libpulse-dev libfftw3-dev portaudio19-dev libsndfile1-dev
+gcc -o noise_cancel noise_cancel.c -lpulse -lportaudio -lsndfile -lfftw3f -lm -pthread
@@ -0,0 +1,249 @@
+#ifndef VOICETRAINER_CONTROLSOCKET
+#define VOICETRAINER_CONTROLSOCKET
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+// Unix-domain control socket for a running program. Clients send one
+// command per line and get back any output, then a last line of "ok" or
+// "error: reason". It is served from the main thread's poll loop, so
+// commands are handled one at a time and a slow client only holds up the
+// commands behind it, never the audio. Anything that can talk to a Unix
+// socket works as a client, e.g. socat - UNIX-CONNECT:PATH, besides
+// control_send below.
+
+#define CONTROL_CLIENTS 8     // Connections served at once
+#define CONTROL_LINE 256      // Longest command
+#define CONTROL_REPLY 1024    // Longest reply
+
+typedef struct {
+    int fd;                   // -1 when the slot is free
+    char line[CONTROL_LINE];  // Command being received
+    size_t length;
+} ControlClient;
+
+typedef struct {
+    char path[sizeof(((struct sockaddr_un*)0)->sun_path)];
+    int listen_fd;
+    ControlClient clients[CONTROL_CLIENTS];
+} ControlSocket;
+
+// Run one command. Writes any output, or the reason for failing, to reply.
+typedef bool (*ControlHandler)(void *userdata, char *command, char *reply, size_t size);
+
+// $XDG_RUNTIME_DIR/name.sock, or /tmp/name-UID.sock without one
+static void control_default_path(const char *name, char *path, size_t size) {
+    const char *dir = getenv("XDG_RUNTIME_DIR");
+    if (dir && *dir)
+        snprintf(path, size, "%s/%s.sock", dir, name);
+    else
+        snprintf(path, size, "/tmp/%s-%u.sock", name, (unsigned)getuid());
+}
+
+static bool control_address(const char *path, struct sockaddr_un *addr) {
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr->sun_path)) {
+        fprintf(stderr, "Control socket path too long: %s\n", path);
+        return false;
+    }
+    strcpy(addr->sun_path, path);
+    return true;
+}
+
+// Listen at path, only for this user. A socket left behind by a process
+// that died is replaced; one that still answers means another instance is
+// running.
+static bool control_listen(ControlSocket *cs, const char *path) {
+    struct sockaddr_un addr;
+    cs->listen_fd = -1;
+    for (int i = 0; i < CONTROL_CLIENTS; i++)
+        cs->clients[i].fd = -1;
+    if (!control_address(path, &addr))
+        return false;
+    snprintf(cs->path, sizeof(cs->path), "%s", path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        fprintf(stderr, "Failed to create control socket: %s\n", strerror(errno));
+        return false;
+    }
+    mode_t old_mask = umask(0077);
+    int result = bind(fd, (struct sockaddr*)&addr, sizeof(addr));
+    if (result < 0 && errno == EADDRINUSE) {
+        int probe = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        bool alive = probe >= 0 && connect(probe, (struct sockaddr*)&addr, sizeof(addr)) == 0;
+        if (probe >= 0)
+            close(probe);
+        if (alive) {
+            fprintf(stderr, "Another instance is listening on %s\n", path);
+            umask(old_mask);
+            close(fd);
+            return false;
+        }
+        unlink(path);
+        result = bind(fd, (struct sockaddr*)&addr, sizeof(addr));
+    }
+    umask(old_mask);
+    if (result < 0 || listen(fd, CONTROL_CLIENTS) < 0) {
+        fprintf(stderr, "Failed to listen on %s: %s\n", path, strerror(errno));
+        close(fd);
+        return false;
+    }
+    cs->listen_fd = fd;
+    return true;
+}
+
+// Fill fds with the listening socket and every client. Returns how many.
+static int control_pollfds(const ControlSocket *cs, struct pollfd *fds) {
+    int n = 0;
+    fds[n++] = (struct pollfd){.fd = cs->listen_fd, .events = POLLIN};
+    for (int i = 0; i < CONTROL_CLIENTS; i++)
+        fds[n++] = (struct pollfd){.fd = cs->clients[i].fd, .events = POLLIN};
+    return n;
+}
+
+static void control_drop(ControlClient *client) {
+    close(client->fd);
+    client->fd = -1;
+    client->length = 0;
+}
+
+static void control_reply(ControlClient *client, bool ok, const char *text) {
+    char message[CONTROL_REPLY + 16];
+    int n;
+    if (ok)
+        n = snprintf(message, sizeof(message), "%s%sok\n", text,
+                     *text && text[strlen(text) - 1] != '\n' ? "\n" : "");
+    else
+        n = snprintf(message, sizeof(message), "error: %s\n", text);
+    if (n > (int)sizeof(message) - 1)
+        n = sizeof(message) - 1;
+    // Replies are small and the client is waiting for them
+    int flags = fcntl(client->fd, F_GETFL);
+    fcntl(client->fd, F_SETFL, flags & ~O_NONBLOCK);
+    bool sent = send(client->fd, message, n, MSG_NOSIGNAL) == n;
+    fcntl(client->fd, F_SETFL, flags);
+    if (!sent)
+        control_drop(client);
+}
+
+// Accept new clients and run every complete command, after a poll on the
+// descriptors from control_pollfds
+static void control_service(ControlSocket *cs, const struct pollfd *fds,
+                            ControlHandler handler, void *userdata) {
+    if (fds[0].revents & POLLIN) {
+        int fd;
+        while ((fd = accept4(cs->listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+            int slot = 0;
+            while (slot < CONTROL_CLIENTS && cs->clients[slot].fd >= 0)
+                slot++;
+            if (slot == CONTROL_CLIENTS) {
+                close(fd);  // Busy; the client sees the connection close
+                continue;
+            }
+            cs->clients[slot].fd = fd;
+            cs->clients[slot].length = 0;
+        }
+    }
+
+    for (int i = 0; i < CONTROL_CLIENTS; i++) {
+        ControlClient *client = &cs->clients[i];
+        // Only clients that were polled; new ones have no revents yet
+        if (client->fd < 0 || fds[1 + i].fd != client->fd || !fds[1 + i].revents)
+            continue;
+        ssize_t n = recv(client->fd, client->line + client->length,
+                         sizeof(client->line) - 1 - client->length, 0);
+        if (n <= 0) {
+            if (n == 0 || (errno != EAGAIN && errno != EINTR))
+                control_drop(client);
+            continue;
+        }
+        client->length += n;
+
+        char *start = client->line, *end;
+        while (client->fd >= 0 &&
+               (end = memchr(start, '\n', client->line + client->length - start))) {
+            *end = '\0';
+            if (end > start && end[-1] == '\r')
+                end[-1] = '\0';
+            char reply[CONTROL_REPLY] = "";
+            if (*start)
+                control_reply(client, handler(userdata, start, reply, sizeof(reply)), reply);
+            start = end + 1;
+        }
+        if (client->fd < 0)
+            continue;
+        client->length -= start - client->line;
+        memmove(client->line, start, client->length);
+        if (client->length == sizeof(client->line) - 1) {
+            control_reply(client, false, "command too long");
+            if (client->fd >= 0)
+                control_drop(client);
+        }
+    }
+}
+
+static void control_close(ControlSocket *cs) {
+    if (cs->listen_fd < 0)
+        return;
+    for (int i = 0; i < CONTROL_CLIENTS; i++) {
+        if (cs->clients[i].fd >= 0)
+            control_drop(&cs->clients[i]);
+    }
+    close(cs->listen_fd);
+    cs->listen_fd = -1;
+    unlink(cs->path);
+}
+
+// Send one command to a running instance and print the reply. Returns the
+// exit status: 0 if the command succeeded.
+static int control_send(const char *path, const char *command) {
+    struct sockaddr_un addr;
+    if (!control_address(path, &addr))
+        return 1;
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        fprintf(stderr, "Cannot reach %s: %s\n", path, strerror(errno));
+        if (fd >= 0)
+            close(fd);
+        return 1;
+    }
+    char line[CONTROL_LINE];
+    int n = snprintf(line, sizeof(line), "%s\n", command);
+    if (n >= (int)sizeof(line) || send(fd, line, n, MSG_NOSIGNAL) != n) {
+        fprintf(stderr, "Failed to send the command\n");
+        close(fd);
+        return 1;
+    }
+    shutdown(fd, SHUT_WR);
+
+    char reply[CONTROL_REPLY + 16];
+    size_t length = 0;
+    ssize_t got;
+    while (length < sizeof(reply) - 1 &&
+           (got = recv(fd, reply + length, sizeof(reply) - 1 - length, 0)) > 0)
+        length += got;
+    close(fd);
+    reply[length] = '\0';
+    fputs(reply, stdout);
+
+    // The reply ends with its status line
+    char *last = length ? reply + length - 1 : reply;
+    if (last > reply && *last == '\n')
+        last--;
+    while (last > reply && last[-1] != '\n')
+        last--;
+    return strncmp(last, "ok", 2) == 0 ? 0 : 1;
+}
+
+#endif /* VOICETRAINER_CONTROLSOCKET */
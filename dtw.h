@@ -0,0 +1,294 @@
+#ifndef VOICETRAINER_DTW
+#define VOICETRAINER_DTW
+
+#include <math.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Sakoe-Chiba banded dynamic time warping between two sequences, with the
+// band centered on the straight line from (0, 0) to (n-1, m-1).
+//
+// Cells are evaluated one anti-diagonal (i + j = d) at a time. Every cell on
+// an anti-diagonal depends only on the two previous anti-diagonals, so the
+// inner loop has no loop-carried dependency and runs SIMD-wide. Costs live in
+// three rolling O(n) rows; only the step into each in-band cell is kept for the
+// backtrace, one byte per cell, which is O(n * band) memory.
+
+#define DTW_STEP_DIAG 0 // From (i-1, j-1)
+#define DTW_STEP_UP 1   // From (i-1, j)
+#define DTW_STEP_LEFT 2 // From (i, j-1)
+
+#define DTW_LANES 8
+typedef float dtw_vf __attribute__((vector_size(DTW_LANES * sizeof(float))));
+typedef int32_t dtw_vi
+    __attribute__((vector_size(DTW_LANES * sizeof(int32_t))));
+
+typedef struct {
+  size_t *take_index; // Path, from the start of both sequences
+  size_t *ref_index;
+  size_t length;
+  float cost; // Sum of |a[i] - b[j]| along the path
+} DtwPath;
+
+static inline void dtw_path_free(DtwPath *path) {
+  free(path->take_index);
+  free(path->ref_index);
+  memset(path, 0, sizeof(*path));
+}
+
+// Row range [lo, hi] of anti-diagonal d that lies inside the band
+static inline void dtw_diagonal_range(size_t n, size_t m, double slope,
+                                      double band, size_t d, size_t *lo,
+                                      size_t *hi) {
+  // j = d - i and |j - slope * i| <= band
+  //   =>  (d - band) / (1 + slope) <= i <= (d + band) / (1 + slope)
+  // (with a little slack so cells exactly on the edge are kept)
+  double first = ceil((d - band) / (1.0 + slope) - 1e-9);
+  double last = floor((d + band) / (1.0 + slope) + 1e-9);
+  size_t min_i = d >= m ? d - m + 1 : 0;
+  size_t max_i = d < n ? d : n - 1;
+  *lo = first > (double)min_i ? (size_t)first : min_i;
+  *hi = last < (double)max_i ? (size_t)last : max_i;
+}
+
+// cur[i] = |a[i] - b[d-i]| + min(prev2[i-1], prev[i-1], prev[i]) for
+// i in [lo, hi]. The rows are offset by one so that index i-1 is valid at
+// i = 0. brev is b reversed, making b[d-i] contiguous in i.
+static inline void dtw_diagonal(const float *a, const float *brev, size_t m,
+                                size_t d, size_t lo, size_t hi, float *cur,
+                                const float *prev, const float *prev2,
+                                uint8_t *steps) {
+  const float *bd = brev + (lo + m - 1 - d); // bd[i - lo] == b[d - i]
+  size_t i = lo;
+  for (; i + DTW_LANES <= hi + 1; i += DTW_LANES) {
+    dtw_vf va, vb, diag, up, left;
+    memcpy(&va, a + i, sizeof(va));
+    memcpy(&vb, bd + (i - lo), sizeof(vb));
+    memcpy(&diag, prev2 + i, sizeof(diag)); // prev2[(i-1) + 1]
+    memcpy(&up, prev + i, sizeof(up));      // prev[(i-1) + 1]
+    memcpy(&left, prev + i + 1, sizeof(left));
+
+    dtw_vf diff = va - vb;
+    dtw_vi abs_bits = (dtw_vi)diff & 0x7fffffff;
+    dtw_vf cost = (dtw_vf)abs_bits;
+
+    // Branch-free argmin, preferring the diagonal on ties
+    dtw_vi take_up = up < diag;
+    dtw_vi best = ((dtw_vi)up & take_up) | ((dtw_vi)diag & ~take_up);
+    dtw_vi step = take_up & DTW_STEP_UP;
+    dtw_vi take_left = left < (dtw_vf)best;
+    best = ((dtw_vi)left & take_left) | (best & ~take_left);
+    step = (take_left & DTW_STEP_LEFT) | (step & ~take_left);
+
+    dtw_vf result = cost + (dtw_vf)best;
+    memcpy(cur + i + 1, &result, sizeof(result));
+    for (int k = 0; k < DTW_LANES; k++)
+      steps[i - lo + k] = (uint8_t)step[k];
+  }
+  for (; i <= hi; i++) {
+    float diag = prev2[i], up = prev[i], left = prev[i + 1];
+    float best = diag;
+    uint8_t step = DTW_STEP_DIAG;
+    if (up < best) {
+      best = up;
+      step = DTW_STEP_UP;
+    }
+    if (left < best) {
+      best = left;
+      step = DTW_STEP_LEFT;
+    }
+    cur[i + 1] = fabsf(a[i] - bd[i - lo]) + best;
+    steps[i - lo] = step;
+  }
+}
+
+// Align a (length n) against b (length m) within +-band cells of the
+// diagonal. Returns 0 on success and fills path.
+static inline int dtw_banded(const float *a, size_t n, const float *b,
+                             size_t m, size_t band, DtwPath *path) {
+  memset(path, 0, sizeof(*path));
+  if (n == 0 || m == 0)
+    return -1;
+
+  double slope = n > 1 ? (double)(m - 1) / (n - 1) : 0.0;
+  // Narrower bands can leave anti-diagonals with no cells when the
+  // sequences differ a lot in length
+  size_t min_band = (size_t)ceil(slope) + 1;
+  if (band < min_band)
+    band = min_band;
+  if (n == 1 || m == 1)
+    band = n + m; // No diagonal to speak of; use the full matrix
+  size_t diagonals = n + m - 1;
+
+  size_t *lo = malloc(diagonals * sizeof(size_t));
+  size_t *offset = malloc((diagonals + 1) * sizeof(size_t));
+  float *brev = malloc(m * sizeof(float));
+  float *rows = malloc(3 * (n + 1) * sizeof(float));
+  if (!lo || !offset || !brev || !rows) {
+    free(lo);
+    free(offset);
+    free(brev);
+    free(rows);
+    return -1;
+  }
+
+  offset[0] = 0;
+  for (size_t d = 0; d < diagonals; d++) {
+    size_t hi;
+    dtw_diagonal_range(n, m, slope, (double)band, d, &lo[d], &hi);
+    offset[d + 1] = offset[d] + (hi >= lo[d] ? hi - lo[d] + 1 : 0);
+  }
+  uint8_t *steps = malloc(offset[diagonals] ? offset[diagonals] : 1);
+  if (!steps) {
+    free(lo);
+    free(offset);
+    free(brev);
+    free(rows);
+    return -1;
+  }
+
+  for (size_t j = 0; j < m; j++)
+    brev[j] = b[m - 1 - j];
+  for (size_t k = 0; k < 3 * (n + 1); k++)
+    rows[k] = INFINITY;
+
+  // Cell (0, 0) has no predecessor; seed it through the diagonal
+  // predecessor slot, which d = 1 clears again
+  float *row[3] = {rows, rows + (n + 1), rows + 2 * (n + 1)};
+  row[0][0] = 0.0f;
+
+  for (size_t d = 0; d < diagonals; d++) {
+    float *cur = row[(d + 2) % 3];
+    const float *prev = row[(d + 1) % 3];
+    const float *prev2 = row[d % 3];
+
+    // Clear what this row held three diagonals ago
+    if (d >= 3) {
+      size_t old = d - 3;
+      size_t count = offset[old + 1] - offset[old];
+      for (size_t k = 0; k < count; k++)
+        cur[lo[old] + k + 1] = INFINITY;
+    } else {
+      for (size_t k = 0; k <= n; k++)
+        cur[k] = INFINITY;
+    }
+
+    size_t count = offset[d + 1] - offset[d];
+    if (count)
+      dtw_diagonal(a, brev, m, d, lo[d], lo[d] + count - 1, cur, prev, prev2,
+                   steps + offset[d]);
+  }
+  path->cost = row[(diagonals - 1 + 2) % 3][n];
+
+  // Backtrace from (n-1, m-1)
+  size_t capacity = n + m;
+  path->take_index = malloc(capacity * sizeof(size_t));
+  path->ref_index = malloc(capacity * sizeof(size_t));
+  if (!path->take_index || !path->ref_index) {
+    dtw_path_free(path);
+    free(steps);
+    free(lo);
+    free(offset);
+    free(brev);
+    free(rows);
+    return -1;
+  }
+
+  size_t i = n - 1, j = m - 1, len = 0;
+  for (;;) {
+    path->take_index[len] = i;
+    path->ref_index[len] = j;
+    len++;
+    if (i == 0 && j == 0)
+      break;
+    size_t d = i + j;
+    uint8_t step = steps[offset[d] + (i - lo[d])];
+    if (step == DTW_STEP_DIAG) {
+      i--;
+      j--;
+    } else if (step == DTW_STEP_UP) {
+      i--;
+    } else {
+      j--;
+    }
+  }
+
+  // Reverse into forward order
+  for (size_t k = 0; k < len / 2; k++) {
+    size_t t = path->take_index[k];
+    path->take_index[k] = path->take_index[len - 1 - k];
+    path->take_index[len - 1 - k] = t;
+    t = path->ref_index[k];
+    path->ref_index[k] = path->ref_index[len - 1 - k];
+    path->ref_index[len - 1 - k] = t;
+  }
+  path->length = len;
+
+  free(steps);
+  free(lo);
+  free(offset);
+  free(brev);
+  free(rows);
+  return 0;
+}
+
+// Open-begin/open-end (subsequence) DTW: find the stretch a[*start..*end]
+// that aligns best against all of b, e.g. a reference phrase inside a long
+// session. Starting at any a[i] against b[0] is free, and the best cell in
+// the last column of b ends the match. Each cell carries the start of its
+// best path, so no backtrace is needed: O(n * m) time and O(m) memory.
+// Align a[*start..*end] against b with dtw_banded to get the path.
+static inline int dtw_subsequence(const float *a, size_t n, const float *b,
+                                  size_t m, size_t *start, size_t *end,
+                                  float *cost) {
+  if (n == 0 || m == 0)
+    return -1;
+  float *cols = malloc(2 * m * sizeof(float));
+  size_t *starts = malloc(2 * m * sizeof(size_t));
+  if (!cols || !starts) {
+    free(cols);
+    free(starts);
+    return -1;
+  }
+
+  float *prev = cols, *cur = cols + m;
+  size_t *prev_start = starts, *cur_start = starts + m;
+  *cost = INFINITY;
+  for (size_t i = 0; i < n; i++) {
+    cur[0] = fabsf(a[i] - b[0]);
+    cur_start[0] = i;
+    for (size_t j = 1; j < m; j++) {
+      // Same predecessors as dtw_banded, preferring the diagonal on ties
+      float best = i ? prev[j - 1] : INFINITY;
+      size_t from = i ? prev_start[j - 1] : 0;
+      if (i && prev[j] < best) {
+        best = prev[j];
+        from = prev_start[j];
+      }
+      if (cur[j - 1] < best) {
+        best = cur[j - 1];
+        from = cur_start[j - 1];
+      }
+      cur[j] = fabsf(a[i] - b[j]) + best;
+      cur_start[j] = from;
+    }
+    if (cur[m - 1] < *cost) {
+      *cost = cur[m - 1];
+      *start = cur_start[m - 1];
+      *end = i;
+    }
+    float *t = prev;
+    prev = cur;
+    cur = t;
+    size_t *ts = prev_start;
+    prev_start = cur_start;
+    cur_start = ts;
+  }
+
+  free(cols);
+  free(starts);
+  return 0;
+}
+
+#endif /* VOICETRAINER_DTW */
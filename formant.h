@@ -0,0 +1,242 @@
+#ifndef VOICETRAINER_FORMANT
+#define VOICETRAINER_FORMANT
+
+#include <math.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// LPC formant tracker. Each hop is low-pass filtered and decimated, and the
+// most recent FORMANT_FRAME decimated samples are analyzed with the
+// autocorrelation method (Levinson-Durbin). Formants are picked as peaks of
+// the LPC envelope sampled on a fixed grid, so the work per analyzed hop is
+// constant. The time spent is measured; when a hop runs over the budget the
+// tracker analyzes every other hop (and so on) until it fits again.
+
+#define FORMANT_DECIMATION 4       // 44100 Hz -> 11025 Hz
+#define FORMANT_FIR_TAPS 32        // Anti-aliasing filter length
+#define FORMANT_FRAME 256          // Decimated samples per analysis (~23 ms)
+#define FORMANT_LPC_ORDER 12       // ~2 + rate/1000 at the decimated rate
+#define FORMANT_ENVELOPE_POINTS 256 // Peak-picking grid over 0..Nyquist
+#define FORMANT_COUNT 3
+#define FORMANT_MIN_HZ 90.0f
+#define FORMANT_DEFAULT_BUDGET_US 500.0
+#define FORMANT_MAX_STRIDE 8
+
+typedef struct {
+  int sample_rate;
+  int hop_size;
+  float decimated_rate;
+
+  float fir[FORMANT_FIR_TAPS];
+  float *fir_input; // Previous FIR_TAPS-1 samples followed by the current hop
+  float frame[FORMANT_FRAME]; // Most recent decimated samples
+  float window[FORMANT_FRAME];
+  float envelope_cos[FORMANT_ENVELOPE_POINTS][FORMANT_LPC_ORDER + 1];
+  float envelope_sin[FORMANT_ENVELOPE_POINTS][FORMANT_LPC_ORDER + 1];
+
+  float formants[FORMANT_COUNT]; // Last estimate in Hz (0 if none)
+
+  // Per-hop cost accounting
+  double budget_us;
+  double last_us;
+  double max_us;
+  double total_us;
+  size_t hops;
+  size_t analyzed;
+  int stride;
+  int under_budget_run;
+} FormantTracker;
+
+static inline FormantTracker *formant_tracker_create(int sample_rate,
+                                                     int hop_size) {
+  FormantTracker *ft = (FormantTracker *)calloc(1, sizeof(FormantTracker));
+  if (!ft)
+    return NULL;
+  ft->sample_rate = sample_rate;
+  ft->hop_size = hop_size;
+  ft->decimated_rate = (float)sample_rate / FORMANT_DECIMATION;
+  ft->budget_us = FORMANT_DEFAULT_BUDGET_US;
+  ft->stride = 1;
+
+  ft->fir_input =
+      (float *)calloc(FORMANT_FIR_TAPS - 1 + hop_size, sizeof(float));
+  if (!ft->fir_input) {
+    free(ft);
+    return NULL;
+  }
+
+  // Windowed-sinc low-pass just below the decimated Nyquist frequency
+  float cutoff = 0.45f / FORMANT_DECIMATION;
+  float sum = 0.0f;
+  for (int i = 0; i < FORMANT_FIR_TAPS; i++) {
+    float m = i - (FORMANT_FIR_TAPS - 1) / 2.0f;
+    float sinc = m == 0.0f ? 2.0f * cutoff
+                           : sinf(2.0f * M_PI * cutoff * m) / (M_PI * m);
+    float w = 0.54f - 0.46f * cosf(2.0f * M_PI * i / (FORMANT_FIR_TAPS - 1));
+    ft->fir[i] = sinc * w;
+    sum += ft->fir[i];
+  }
+  for (int i = 0; i < FORMANT_FIR_TAPS; i++)
+    ft->fir[i] /= sum;
+
+  for (int i = 0; i < FORMANT_FRAME; i++)
+    ft->window[i] = 0.54f - 0.46f * cosf(2.0f * M_PI * i / (FORMANT_FRAME - 1));
+
+  for (int k = 0; k < FORMANT_ENVELOPE_POINTS; k++) {
+    float w = M_PI * k / (FORMANT_ENVELOPE_POINTS - 1);
+    for (int j = 0; j <= FORMANT_LPC_ORDER; j++) {
+      ft->envelope_cos[k][j] = cosf(w * j);
+      ft->envelope_sin[k][j] = sinf(w * j);
+    }
+  }
+  return ft;
+}
+
+static inline void formant_tracker_destroy(FormantTracker *ft) {
+  if (!ft)
+    return;
+  free(ft->fir_input);
+  free(ft);
+}
+
+// Forget the signal history and cost statistics, e.g. between takes. The
+// budget is kept; the stride adapts again from 1.
+static inline void formant_tracker_reset(FormantTracker *ft) {
+  memset(ft->fir_input, 0,
+         (FORMANT_FIR_TAPS - 1 + ft->hop_size) * sizeof(float));
+  memset(ft->frame, 0, sizeof(ft->frame));
+  memset(ft->formants, 0, sizeof(ft->formants));
+  ft->last_us = ft->max_us = ft->total_us = 0.0;
+  ft->hops = ft->analyzed = 0;
+  ft->stride = 1;
+  ft->under_budget_run = 0;
+}
+
+// Levinson-Durbin recursion. Fills a[0..order] with the prediction polynomial
+// A(z) = 1 + a[1] z^-1 + ... and returns the residual energy.
+static inline float formant_levinson(const float *r, float *a, int order) {
+  float tmp[FORMANT_LPC_ORDER + 1];
+  float err = r[0];
+  memset(a, 0, (order + 1) * sizeof(float));
+  a[0] = 1.0f;
+  for (int i = 1; i <= order; i++) {
+    float acc = r[i];
+    for (int j = 1; j < i; j++)
+      acc += a[j] * r[i - j];
+    float k = -acc / err;
+    memcpy(tmp, a, (i + 1) * sizeof(float));
+    for (int j = 1; j < i; j++)
+      a[j] = tmp[j] + k * tmp[i - j];
+    a[i] = k;
+    err *= 1.0f - k * k;
+    if (err <= 0.0f)
+      break;
+  }
+  return err;
+}
+
+static inline void formant_analyze(FormantTracker *ft) {
+  float x[FORMANT_FRAME];
+  float r[FORMANT_LPC_ORDER + 1];
+  float a[FORMANT_LPC_ORDER + 1];
+  float env[FORMANT_ENVELOPE_POINTS];
+
+  // Pre-emphasis and window
+  x[0] = ft->frame[0] * ft->window[0];
+  for (int i = 1; i < FORMANT_FRAME; i++)
+    x[i] = (ft->frame[i] - 0.97f * ft->frame[i - 1]) * ft->window[i];
+
+  for (int lag = 0; lag <= FORMANT_LPC_ORDER; lag++) {
+    float acc = 0.0f;
+    for (int i = lag; i < FORMANT_FRAME; i++)
+      acc += x[i] * x[i - lag];
+    r[lag] = acc;
+  }
+
+  memset(ft->formants, 0, sizeof(ft->formants));
+  if (r[0] < 1e-9f)
+    return; // Silence
+  r[0] *= 1.0001f; // Slight white-noise correction for stability
+  formant_levinson(r, a, FORMANT_LPC_ORDER);
+
+  // Envelope 1/|A(e^jw)|^2 on a fixed grid
+  for (int k = 0; k < FORMANT_ENVELOPE_POINTS; k++) {
+    float re = 0.0f, im = 0.0f;
+    for (int j = 0; j <= FORMANT_LPC_ORDER; j++) {
+      re += a[j] * ft->envelope_cos[k][j];
+      im -= a[j] * ft->envelope_sin[k][j];
+    }
+    env[k] = 1.0f / (re * re + im * im + 1e-12f);
+  }
+
+  // First peaks above FORMANT_MIN_HZ, refined by parabolic interpolation
+  float bin_hz = ft->decimated_rate / 2.0f / (FORMANT_ENVELOPE_POINTS - 1);
+  int found = 0;
+  for (int k = 1; k < FORMANT_ENVELOPE_POINTS - 1 && found < FORMANT_COUNT;
+       k++) {
+    if (env[k] <= env[k - 1] || env[k] < env[k + 1])
+      continue;
+    float l = logf(env[k - 1]), c = logf(env[k]), rr = logf(env[k + 1]);
+    float denom = l - 2.0f * c + rr;
+    float offset = denom != 0.0f ? 0.5f * (l - rr) / denom : 0.0f;
+    float hz = (k + offset) * bin_hz;
+    if (hz >= FORMANT_MIN_HZ)
+      ft->formants[found++] = hz;
+  }
+}
+
+static inline double formant_now_us(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+// Feed one hop of hop_size samples. Returns true if formants were updated.
+static inline bool formant_tracker_do(FormantTracker *ft, const float *hop) {
+  double start = formant_now_us();
+
+  // Decimate the hop into the tail of the analysis frame
+  int keep = FORMANT_FIR_TAPS - 1;
+  int produced = ft->hop_size / FORMANT_DECIMATION;
+  memcpy(ft->fir_input + keep, hop, ft->hop_size * sizeof(float));
+  memmove(ft->frame, ft->frame + produced,
+          (FORMANT_FRAME - produced) * sizeof(float));
+  float *dst = ft->frame + FORMANT_FRAME - produced;
+  for (int n = 0; n < produced; n++) {
+    const float *src = ft->fir_input + n * FORMANT_DECIMATION;
+    float acc = 0.0f;
+    for (int t = 0; t < FORMANT_FIR_TAPS; t++)
+      acc += src[t] * ft->fir[FORMANT_FIR_TAPS - 1 - t];
+    dst[n] = acc;
+  }
+  memmove(ft->fir_input, ft->fir_input + ft->hop_size, keep * sizeof(float));
+
+  bool analyzed = ft->hops++ % ft->stride == 0;
+  if (analyzed) {
+    formant_analyze(ft);
+    ft->analyzed++;
+  }
+
+  double elapsed = formant_now_us() - start;
+  ft->last_us = elapsed;
+  ft->total_us += elapsed;
+  if (elapsed > ft->max_us)
+    ft->max_us = elapsed;
+
+  // Back off when over budget, recover after a run of comfortable hops
+  if (analyzed && elapsed > ft->budget_us) {
+    if (ft->stride < FORMANT_MAX_STRIDE)
+      ft->stride *= 2;
+    ft->under_budget_run = 0;
+  } else if (analyzed && elapsed < ft->budget_us / 4 && ft->stride > 1) {
+    if (++ft->under_budget_run >= 32) {
+      ft->stride /= 2;
+      ft->under_budget_run = 0;
+    }
+  }
+  return analyzed;
+}
+
+#endif /* VOICETRAINER_FORMANT */
@@ -1,189 +1,2085 @@
+#define _GNU_SOURCE  // F_SETPIPE_SZ, CPU_SET
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <pulse/simple.h>
-#include <pulse/error.h>
+#include <pulse/pulseaudio.h>
+#include <errno.h>
+#include <math.h>
+#include <poll.h>
+#include <pthread.h>
+#include <semaphore.h>
 #include <signal.h>
+#include <stdatomic.h>
+#include <limits.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+#include <sys/stat.h>
+#include <time.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include "spectralgate.h"
-
-static volatile int running = 1;
-static audio_context *global_ctx = NULL;
-
-static void signal_handler(int signum) {
-    running = 0;
-    if (global_ctx) {
-        cleanup_audio(global_ctx);
-    }
-    exit(0);
-}
+#include "noiseprofile.h"
+#include "ringbuf.h"
+#include "audiobackend.h"
+#include "realtime.h"
+#include "controlsocket.h"
 
 #define SAMPLE_RATE 44100
 #define CHANNELS 1
 #define NOISE_SECONDS 2  // Seconds of noise to sample for profile
+#define PROFILE_FILE ".noise_cancel_profile"  // In $HOME
+#define DEFAULT_LATENCY_MS 20  // Buffering asked of each PulseAudio stream
+#define RING_SECONDS 1         // Capacity of the capture and output rings
+#define STATS_BUCKETS 20000    // Block timing histogram, 1 us per bucket
+#define DEFAULT_TRIALS 20      // Chirps played by --measure-latency
+#define ADAPT_WINDOW_SECONDS 0.5   // Blocks judged together
+#define ADAPT_BUSY 0.5             // Share of a block's period past which it is overloaded
+#define ADAPT_OVERLOADED 0.1       // Share of overloaded blocks that steps down
+#define ADAPT_RESTORE_SECONDS 2.0  // Calm before stepping back up, doubled when undone
+#define ADAPT_MAX_RESTORE_SECONDS 60.0
+#define ADAPT_DRIFT 1e-3           // Device clock error tolerated, as a rate
+#define MAX_BLOCK_HOPS 8           // Largest block the loop moves, in hops
+#define MIN_N_FFT 256              // FFT sizes the control socket accepts
+#define MAX_N_FFT 8192
+#define CROSSFADE_SAMPLES 1024     // Handover between gates of different FFT sizes
+#define LATENCY_SPLICE_SAMPLES 256 // Moves a device's output to the new gate's latency
+#define MAX_SOURCES 8              // Capture devices one process serves
+#define DSP_REGIONS 5              // Memory regions of a source locked for --rt
+#define SOURCE_NAME "noise_cancelled"  // Default virtual source, numbered with several
+#define SOURCE_DESCRIPTION "NoiseCancel"
+#define MAX_NAME_LENGTH 48
+#define PIPE_SOURCE_ARGS "source_name=%s file=%s format=float32le rate=44100 " \
+    "channels=1 source_properties=device.description=%s"
+
+// What direct output does with audio the pipe source isn't ready to read
+enum {
+    BACKPRESSURE_DROP,     // Discard it, keeping latency at the pipe size
+    BACKPRESSURE_STRETCH   // Queue it, letting latency grow by up to --latency
+};
 
+// PulseAudio backend. Capture, gating and playback run concurrently:
+// PulseAudio's mainloop thread runs the stream callbacks, which only move
+// audio between the server and two lock-free rings, and the DSP loop reads
+// and writes the rings from its own thread. A stalled playback stream
+// therefore never holds up capture: the output ring fills and drops instead.
+// Once playback runs again it skips the oldest audio, so no more than
+// latency_ms stays queued behind what the server asks for.
+//
+// With direct output there is no playback stream: gated audio is written
+// straight into the pipe source's FIFO, without blocking, and the output
+// ring only holds what is queued under the stretch policy.
 typedef struct {
-    pa_simple *capture;
-    pa_simple *playback;
-    float *buffer;
-    float *output_buffer;
-    SpectralGate *sg;
-    size_t buffer_frames;
-    bool noise_profile_computed;
-} audio_context;
+    AudioBackend *backend;
+    pa_threaded_mainloop *mainloop;
+    pa_context *context;
+    pa_stream *capture;
+    pa_stream *playback;
+    pa_sample_spec spec;
+    int latency_ms;
+    const char *device;       // Capture device, or NULL for the default
+    const char *source_name;  // Our virtual source
+    const char *source_description;
+    char fifo_path[PATH_MAX]; // Its pipe
+    uint32_t source_module;   // Our module-pipe-source, or PA_INVALID_INDEX
+    bool source_taken;        // The server already has a source by our name
+    bool direct;              // Write into the pipe source instead of a playback stream
+    int backpressure;         // BACKPRESSURE_*, for direct output
+    int fifo_fd;              // Non-blocking write end of the pipe source, when direct
+    size_t pipe_bytes;        // Pipe capacity granted by the kernel
+    double buffering;         // Seconds of server and pipe buffering granted
 
-static int setup_audio(audio_context *ctx) {
-    int error;
-    
-    // Initialize SpectralGate
-    ctx->sg = spectralgate_create(SAMPLE_RATE);
-    ctx->buffer_frames = ctx->sg->n_fft;  // Use FFT size as buffer size
-    ctx->buffer = (float*)malloc(ctx->buffer_frames * sizeof(float));
-    ctx->output_buffer = (float*)malloc(ctx->buffer_frames * sizeof(float));
-    ctx->noise_profile_computed = false;
+    RingBuf captured;         // Mainloop -> DSP thread
+    RingBuf processed;        // DSP thread -> mainloop
+    sem_t capture_ready;      // Posted by the read callback and by wake
+    void (*notify)(void *userdata);  // Called instead, when reads don't block
+    void *notify_userdata;
+    bool playing;             // Playback has had gated audio, so gaps are underruns
+    atomic_bool failed;       // The server or a stream failed
+} pulse_backend;
+
+// Let the DSP loop know there is something to read, or a flag to look at
+static void pulse_signal(pulse_backend *pb) {
+    if (pb->notify)
+        pb->notify(pb->notify_userdata);
+    else
+        sem_post(&pb->capture_ready);
+}
+
+// Stop the DSP loop: its next read reports the failure
+static void pulse_fail(pulse_backend *pb) {
+    atomic_store(&pb->failed, true);
+    pulse_signal(pb);
+}
+
+static void context_state_callback(pa_context *c, void *userdata) {
+    pulse_backend *pb = (pulse_backend*)userdata;
+    pa_context_state_t state = pa_context_get_state(c);
+    if (state == PA_CONTEXT_FAILED)
+        pulse_fail(pb);
+    pa_threaded_mainloop_signal(pb->mainloop, 0);
+}
+
+static void stream_state_callback(pa_stream *s, void *userdata) {
+    pulse_backend *pb = (pulse_backend*)userdata;
+    if (pa_stream_get_state(s) == PA_STREAM_FAILED)
+        pulse_fail(pb);
+    pa_threaded_mainloop_signal(pb->mainloop, 0);
+}
+
+static void module_loaded_callback(pa_context *c, uint32_t idx, void *userdata) {
+    pulse_backend *pb = (pulse_backend*)userdata;
+    pb->source_module = idx;
+    pa_threaded_mainloop_signal(pb->mainloop, 0);
+}
+
+static void module_unloaded_callback(pa_context *c, int success, void *userdata) {
+    pulse_backend *pb = (pulse_backend*)userdata;
+    pa_threaded_mainloop_signal(pb->mainloop, 0);
+}
+
+static void source_exists_callback(pa_context *c, const pa_source_info *info,
+                                   int eol, void *userdata) {
+    pulse_backend *pb = (pulse_backend*)userdata;
+    if (info)
+        pb->source_taken = true;
+    if (eol)
+        pa_threaded_mainloop_signal(pb->mainloop, 0);
+}
+
+// Each source's FIFO lives in $XDG_RUNTIME_DIR, which only this user can
+// write to, or else in a directory of our own under /tmp that is checked to
+// be private. The process id in the name keeps another instance from
+// opening this one's pipe.
+static bool pipe_source_path(const char *source_name, char *path, size_t size) {
+    const char *dir = getenv("XDG_RUNTIME_DIR");
+    char fallback[64];
+    if (!dir || !*dir) {
+        snprintf(fallback, sizeof(fallback), "/tmp/noise_cancel-%u", (unsigned)getuid());
+        struct stat st;
+        if (mkdir(fallback, 0700) < 0 && errno != EEXIST) {
+            fprintf(stderr, "Cannot create %s: %s\n", fallback, strerror(errno));
+            return false;
+        }
+        if (lstat(fallback, &st) < 0 || !S_ISDIR(st.st_mode) ||
+            st.st_uid != getuid() || (st.st_mode & 077)) {
+            fprintf(stderr, "%s is not a private directory of ours; set "
+                    "XDG_RUNTIME_DIR or remove it\n", fallback);
+            return false;
+        }
+        dir = fallback;
+    }
+    int n = snprintf(path, size, "%s/noise_cancel-%d-%s", dir, (int)getpid(), source_name);
+    if (n < 0 || (size_t)n >= size) {
+        fprintf(stderr, "Pipe source path too long in %s\n", dir);
+        return false;
+    }
+    return true;
+}
+
+// Wait with the mainloop locked until a server operation has completed
+static bool wait_operation(pulse_backend *pb, pa_operation *op) {
+    if (!op)
+        return false;
+    while (pa_operation_get_state(op) == PA_OPERATION_RUNNING)
+        pa_threaded_mainloop_wait(pb->mainloop);
+    bool done = pa_operation_get_state(op) == PA_OPERATION_DONE;
+    pa_operation_unref(op);
+    return done;
+}
+
+// Mainloop thread: move everything the server captured into the ring
+static void capture_read_callback(pa_stream *s, size_t nbytes, void *userdata) {
+    pulse_backend *pb = (pulse_backend*)userdata;
+    const void *data;
+    size_t bytes;
+    while (pa_stream_readable_size(s) > 0) {
+        if (pa_stream_peek(s, &data, &bytes) < 0 || bytes == 0)
+            break;
+        if (data) {  // NULL data is a hole in the stream; just drop it
+            size_t samples = bytes / sizeof(float);
+            size_t written = ringbuf_write(&pb->captured, (const float*)data, samples);
+            if (written < samples)
+                atomic_fetch_add(&pb->backend->capture_dropped, samples - written);
+        }
+        pa_stream_drop(s);
+    }
+    pulse_signal(pb);
+}
+
+// Mainloop thread: fill what the server asks for from the output ring, with
+// silence for whatever the gate hasn't produced yet. Audio queued beyond
+// latency_ms past this request is dropped, oldest first, so latency can't
+// creep up to the ring's capacity after a stall.
+static void playback_write_callback(pa_stream *s, size_t nbytes, void *userdata) {
+    pulse_backend *pb = (pulse_backend*)userdata;
+    size_t limit = (size_t)SAMPLE_RATE * pb->latency_ms / 1000 +
+                   nbytes / sizeof(float);
+    size_t queued = ringbuf_available(&pb->processed);
+    if (queued > limit) {
+        ringbuf_consume(&pb->processed, queued - limit);
+        atomic_fetch_add(&pb->backend->output_dropped, queued - limit);
+    }
+    while (nbytes >= sizeof(float)) {
+        void *data;
+        size_t bytes = nbytes;
+        if (pa_stream_begin_write(s, &data, &bytes) < 0 || !data)
+            break;
+        if (bytes > nbytes)
+            bytes = nbytes;
+        size_t samples = bytes / sizeof(float);
+        size_t got = ringbuf_read(&pb->processed, (float*)data, samples);
+        if (got)
+            pb->playing = true;
+        if (got < samples) {
+            memset((float*)data + got, 0, (samples - got) * sizeof(float));
+            if (pb->playing)
+                atomic_fetch_add(&pb->backend->output_underruns, 1);
+        }
+        pa_stream_write(s, data, samples * sizeof(float), NULL, 0, PA_SEEK_RELATIVE);
+        nbytes -= samples * sizeof(float);
+    }
+}
+
+// DSP thread: hand audio to the pipe source without waiting for it. Writes
+// of at most PIPE_BUF bytes to a non-blocking pipe either go in whole or
+// fail with EAGAIN, so samples are never split.
+static bool fifo_output(pulse_backend *pb, const float *samples, size_t count) {
+    const size_t chunk = PIPE_BUF / sizeof(float);
+    if (pb->backpressure == BACKPRESSURE_DROP) {
+        while (count > 0) {
+            size_t n = count < chunk ? count : chunk;
+            if (write(pb->fifo_fd, samples, n * sizeof(float)) < 0)
+                break;
+            samples += n;
+            count -= n;
+        }
+        if (count > 0 && errno != EAGAIN)
+            goto failed;
+        atomic_fetch_add(&pb->backend->output_dropped, count);
+        return true;
+    }
+
+    // Stretch: queue behind what is still waiting, keep at most latency_ms
+    // of it by dropping the oldest, then write as much as the pipe takes
+    size_t written = ringbuf_write(&pb->processed, samples, count);
+    atomic_fetch_add(&pb->backend->output_dropped, count - written);
+    size_t limit = (size_t)SAMPLE_RATE * pb->latency_ms / 1000;
+    size_t queued = ringbuf_available(&pb->processed);
+    if (queued > limit) {
+        ringbuf_consume(&pb->processed, queued - limit);
+        atomic_fetch_add(&pb->backend->output_dropped, queued - limit);
+    }
+    const float *data;
+    size_t n;
+    while ((n = ringbuf_peek(&pb->processed, &data)) > 0) {
+        if (n > chunk)
+            n = chunk;
+        if (write(pb->fifo_fd, data, n * sizeof(float)) < 0) {
+            if (errno != EAGAIN)
+                goto failed;
+            break;
+        }
+        ringbuf_consume(&pb->processed, n);
+    }
+    return true;
+
+failed:
+    fprintf(stderr, "Failed to write to pipe source: %s\n", strerror(errno));
+    return false;
+}
+
+// Connect to the server, wait until the context is ready and create the
+// virtual source
+static int pulse_connect(pulse_backend *pb) {
+    pb->mainloop = pa_threaded_mainloop_new();
+    if (!pb->mainloop) {
+        fprintf(stderr, "Failed to create PulseAudio mainloop\n");
+        return -1;
+    }
+    pb->context = pa_context_new(pa_threaded_mainloop_get_api(pb->mainloop), "NoiseCancel");
+    if (!pb->context) {
+        fprintf(stderr, "Failed to create PulseAudio context\n");
+        return -1;
+    }
+    pa_context_set_state_callback(pb->context, context_state_callback, pb);
+
+    pa_threaded_mainloop_lock(pb->mainloop);
+    int result = -1;
+    if (pa_context_connect(pb->context, NULL, PA_CONTEXT_NOFLAGS, NULL) < 0 ||
+        pa_threaded_mainloop_start(pb->mainloop) < 0) {
+        fprintf(stderr, "Failed to connect to PulseAudio: %s\n",
+                pa_strerror(pa_context_errno(pb->context)));
+    } else {
+        pa_context_state_t state;
+        while ((state = pa_context_get_state(pb->context)) != PA_CONTEXT_READY &&
+               PA_CONTEXT_IS_GOOD(state))
+            pa_threaded_mainloop_wait(pb->mainloop);
+        // Create virtual source using module-pipe-source. Its index is kept
+        // so exactly this module is unloaded again, even with other
+        // instances running. A name already in use is refused rather than
+        // shadowed: the server would number ours and clients would keep
+        // reading the other one.
+        char args[PATH_MAX + 256];
+        snprintf(args, sizeof(args), PIPE_SOURCE_ARGS, pb->source_name, pb->fifo_path,
+                 pb->source_description);
+        if (state != PA_CONTEXT_READY) {
+            fprintf(stderr, "Failed to connect to PulseAudio: %s\n",
+                    pa_strerror(pa_context_errno(pb->context)));
+        } else if (wait_operation(pb, pa_context_get_source_info_by_name(
+                       pb->context, pb->source_name, source_exists_callback, pb)) &&
+                   pb->source_taken) {
+            fprintf(stderr, "A source named '%s' already exists; is another "
+                    "noise_cancel running? Pick another name with --name\n",
+                    pb->source_name);
+        } else if (!wait_operation(pb, pa_context_load_module(pb->context,
+                       "module-pipe-source", args,
+                       module_loaded_callback, pb)) ||
+                   pb->source_module == PA_INVALID_INDEX) {
+            fprintf(stderr, "Failed to load module-pipe-source: %s\n",
+                    pa_strerror(pa_context_errno(pb->context)));
+        } else {
+            result = 0;
+        }
+    }
+    pa_threaded_mainloop_unlock(pb->mainloop);
+    if (result < 0)
+        return result;
+
+    // Open pipe for writing
+    int fd = open(pb->fifo_path, O_WRONLY | O_CLOEXEC);
+    if (fd < 0) {
+        fprintf(stderr, "Failed to open pipe for writing\n");
+        return -1;
+    }
+    if (!pb->direct) {
+        close(fd);  // We'll let PulseAudio handle the actual writing
+        return 0;
+    }
+
+    // Direct output: the pipe is the only buffer between the gate and the
+    // source, so size it for the target latency. The kernel rounds up to
+    // whole pages.
+    pb->fifo_fd = fd;
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    fcntl(fd, F_SETPIPE_SZ,
+          (int)pa_usec_to_bytes((pa_usec_t)pb->latency_ms * 1000, &pb->spec));
+    int pipe_size = fcntl(fd, F_GETPIPE_SZ);
+    pb->pipe_bytes = pipe_size > 0 ? (size_t)pipe_size : 0;
+    return 0;
+}
+
+// Open the capture and playback streams with buffering sized for the
+// target latency
+static int pulse_start_streams(pulse_backend *pb) {
+    // The server delivers capture in latency-sized fragments and keeps about
+    // as much queued for playback. Everything else is left to the server.
+    uint32_t latency_bytes =
+        (uint32_t)pa_usec_to_bytes((pa_usec_t)pb->latency_ms * 1000, &pb->spec);
+    pa_buffer_attr capture_attr = {
+        .maxlength = (uint32_t)-1,
+        .tlength = (uint32_t)-1,
+        .prebuf = (uint32_t)-1,
+        .minreq = (uint32_t)-1,
+        .fragsize = latency_bytes
+    };
+    pa_buffer_attr playback_attr = {
+        .maxlength = (uint32_t)-1,
+        .tlength = latency_bytes,
+        .prebuf = (uint32_t)-1,
+        .minreq = (uint32_t)-1,
+        .fragsize = (uint32_t)-1
+    };
+    pa_stream_flags_t flags = PA_STREAM_ADJUST_LATENCY | PA_STREAM_INTERPOLATE_TIMING |
+                              PA_STREAM_AUTO_TIMING_UPDATE;
+
+    pa_threaded_mainloop_lock(pb->mainloop);
+    pb->capture = pa_stream_new(pb->context, "Input", &pb->spec, NULL);
+    if (!pb->direct)
+        pb->playback = pa_stream_new(pb->context, "Output", &pb->spec, NULL);
+    int result = -1;
+    if (!pb->capture || (!pb->direct && !pb->playback)) {
+        fprintf(stderr, "Failed to create streams: %s\n",
+                pa_strerror(pa_context_errno(pb->context)));
+        goto done;
+    }
+    pa_stream_set_state_callback(pb->capture, stream_state_callback, pb);
+    pa_stream_set_read_callback(pb->capture, capture_read_callback, pb);
+    if (pb->playback) {
+        pa_stream_set_state_callback(pb->playback, stream_state_callback, pb);
+        pa_stream_set_write_callback(pb->playback, playback_write_callback, pb);
+    }
+
+    // Open capture stream (the chosen or default input device) and playback
+    // stream to the pipe source
+    if (pa_stream_connect_record(pb->capture, pb->device, &capture_attr, flags) < 0 ||
+        (pb->playback &&
+         pa_stream_connect_playback(pb->playback, pb->source_name, &playback_attr,
+                                    flags, NULL, NULL) < 0)) {
+        fprintf(stderr, "Failed to connect streams: %s\n",
+                pa_strerror(pa_context_errno(pb->context)));
+        goto done;
+    }
+
+    pa_stream_state_t capture_state, playback_state;
+    for (;;) {
+        capture_state = pa_stream_get_state(pb->capture);
+        playback_state = pb->playback ? pa_stream_get_state(pb->playback)
+                                      : PA_STREAM_READY;
+        if (!PA_STREAM_IS_GOOD(capture_state) || !PA_STREAM_IS_GOOD(playback_state) ||
+            (capture_state == PA_STREAM_READY && playback_state == PA_STREAM_READY))
+            break;
+        pa_threaded_mainloop_wait(pb->mainloop);
+    }
+    if (capture_state != PA_STREAM_READY || playback_state != PA_STREAM_READY) {
+        fprintf(stderr, "Failed to open streams: %s\n",
+                pa_strerror(pa_context_errno(pb->context)));
+        goto done;
+    }
+
+    // The server may not grant exactly what was asked for
+    const pa_buffer_attr *granted_capture = pa_stream_get_buffer_attr(pb->capture);
+    double capture_ms = pa_bytes_to_usec(granted_capture->fragsize, &pb->spec) / 1000.0;
+    if (pb->playback) {
+        const pa_buffer_attr *granted_playback = pa_stream_get_buffer_attr(pb->playback);
+        double playback_ms = pa_bytes_to_usec(granted_playback->tlength, &pb->spec) / 1000.0;
+        printf("Stream buffering: capture %.1f ms, playback %.1f ms\n",
+               capture_ms, playback_ms);
+        pb->buffering = (capture_ms + playback_ms) / 1000.0;
+    } else {
+        double pipe_ms = pa_bytes_to_usec(pb->pipe_bytes, &pb->spec) / 1000.0;
+        printf("Stream buffering: capture %.1f ms, pipe %.1f ms%s\n",
+               capture_ms, pipe_ms,
+               pb->backpressure == BACKPRESSURE_STRETCH ? " (+ up to latency when behind)" : "");
+        pb->buffering = (capture_ms + pipe_ms) / 1000.0;
+    }
+    result = 0;
+
+done:
+    pa_threaded_mainloop_unlock(pb->mainloop);
+    return result;
+}
 
-    if (!ctx->buffer || !ctx->output_buffer) {
+static int pulse_open(AudioBackend *b, const AudioBackendConfig *config) {
+    pulse_backend *pb = (pulse_backend*)calloc(1, sizeof(pulse_backend));
+    if (!pb)
+        return -1;
+    b->state = pb;
+    pb->backend = b;
+    pb->latency_ms = config->latency_ms;
+    pb->direct = config->direct;
+    pb->backpressure = config->backpressure;
+    pb->device = config->device;
+    pb->source_name = config->source_name ? config->source_name : SOURCE_NAME;
+    pb->source_description = config->source_description ? config->source_description
+                                                        : SOURCE_DESCRIPTION;
+    pb->notify = config->notify;
+    pb->notify_userdata = config->notify_userdata;
+    pb->source_module = PA_INVALID_INDEX;
+    pb->fifo_fd = -1;
+    sem_init(&pb->capture_ready, 0, 0);
+    if (!pipe_source_path(pb->source_name, pb->fifo_path, sizeof(pb->fifo_path)))
+        return -1;
+    if (!ringbuf_init(&pb->captured, SAMPLE_RATE * RING_SECONDS) ||
+        !ringbuf_init(&pb->processed, SAMPLE_RATE * RING_SECONDS)) {
         fprintf(stderr, "Cannot allocate buffers\n");
         return -1;
     }
 
     // Set up audio format
-    pa_sample_spec ss = {
+    pb->spec = (pa_sample_spec){
         .format = PA_SAMPLE_FLOAT32,
         .rate = SAMPLE_RATE,
         .channels = CHANNELS
     };
-
-    // Create virtual source using module-pipe-source
-    system("pactl load-module module-pipe-source source_name=noise_cancelled "
-           "file=/tmp/noise_cancelled format=float32le rate=44100 channels=1 "
-           "source_properties=device.description=NoiseCancel");
-
-    // Open capture stream (default input device)
-    ctx->capture = pa_simple_new(NULL, "NoiseCancel", PA_STREAM_RECORD,
-                                NULL, "Input", &ss, NULL, NULL, &error);
-    if (!ctx->capture) {
-        fprintf(stderr, "Failed to create capture stream: %s\n",
-                pa_strerror(error));
+    if (pulse_connect(pb) < 0 || pulse_start_streams(pb) < 0)
         return -1;
+
+    printf("Virtual device '%s' created.\n", pb->source_name);
+    printf("To use it, select 'Null Output (%s)' as your input source.\n", pb->source_name);
+    return 0;
+}
+
+static long pulse_read(AudioBackend *b, float *samples, size_t count) {
+    pulse_backend *pb = (pulse_backend*)b->state;
+    size_t n = ringbuf_read(&pb->captured, samples, count);
+    if (n == 0 && !atomic_load(&pb->failed) && !pb->notify) {
+        sem_wait(&pb->capture_ready);
+        n = ringbuf_read(&pb->captured, samples, count);
+    }
+    if (n == 0 && atomic_load(&pb->failed)) {
+        fprintf(stderr, "PulseAudio stream failed: %s\n",
+                pa_strerror(pa_context_errno(pb->context)));
+        return AUDIOBACKEND_ERROR;
     }
+    return (long)n;
+}
 
-    // Open pipe for writing
-    int fd = open("/tmp/noise_cancelled", O_WRONLY);
-    if (fd < 0) {
-        fprintf(stderr, "Failed to open pipe for writing\n");
-        return -1;
+static long pulse_write(AudioBackend *b, const float *samples, size_t count) {
+    pulse_backend *pb = (pulse_backend*)b->state;
+    if (pb->direct)
+        return fifo_output(pb, samples, count) ? (long)count : AUDIOBACKEND_ERROR;
+    size_t written = ringbuf_write(&pb->processed, samples, count);
+    if (written < count)
+        atomic_fetch_add(&b->output_dropped, count - written);
+    return (long)count;
+}
+
+static double pulse_latency(AudioBackend *b) {
+    return ((pulse_backend*)b->state)->buffering;
+}
+
+static void pulse_wake(AudioBackend *b) {
+    pulse_signal((pulse_backend*)b->state);
+}
+
+static void pulse_close(AudioBackend *b) {
+    pulse_backend *pb = (pulse_backend*)b->state;
+    if (!pb)
+        return;
+    if (pb->mainloop) {
+        pa_threaded_mainloop_lock(pb->mainloop);
+        if (pb->capture) {
+            pa_stream_disconnect(pb->capture);
+            pa_stream_unref(pb->capture);
+        }
+        if (pb->playback) {
+            pa_stream_disconnect(pb->playback);
+            pa_stream_unref(pb->playback);
+        }
+        // Remove the pipe-source module this instance loaded
+        if (pb->source_module != PA_INVALID_INDEX)
+            wait_operation(pb, pa_context_unload_module(pb->context, pb->source_module,
+                                                        module_unloaded_callback, pb));
+        if (pb->context) {
+            pa_context_disconnect(pb->context);
+            pa_context_unref(pb->context);
+        }
+        pa_threaded_mainloop_unlock(pb->mainloop);
+        pa_threaded_mainloop_stop(pb->mainloop);
+        pa_threaded_mainloop_free(pb->mainloop);
     }
-    close(fd);  // We'll let PulseAudio handle the actual writing
+    if (pb->fifo_fd >= 0)
+        close(pb->fifo_fd);
+    sem_destroy(&pb->capture_ready);
+    ringbuf_free(&pb->captured);
+    ringbuf_free(&pb->processed);
+    free(pb);
+    b->state = NULL;
+}
 
-    // Open playback stream to the pipe source
-    ctx->playback = pa_simple_new(NULL, "NoiseCancel", PA_STREAM_PLAYBACK,
-                                 "noise_cancelled", "Output", &ss,
-                                 NULL, NULL, &error);
-    if (!ctx->playback) {
-        fprintf(stderr, "Failed to create playback stream: %s\n",
-                pa_strerror(error));
-        return -1;
+static const AudioBackendOps pulse_backend_ops = {
+    "pulse", true, pulse_open, pulse_read, pulse_write,
+    pulse_latency, pulse_wake, pulse_close
+};
+
+static const AudioBackendOps *const backends[] = {
+    &pulse_backend_ops, &portaudio_backend, &wav_backend, &raw_backend, &null_backend,
+    &loopback_backend
+};
+
+// Time spent gating each block, to see whether the gate keeps up and how
+// evenly. 1 us histogram buckets give the percentiles; the last bucket
+// holds everything slower.
+typedef struct {
+    size_t blocks;
+    size_t samples;
+    double total_us;
+    double total_sq_us;
+    double max_us;
+    unsigned histogram[STATS_BUCKETS];
+} block_stats;
+
+// What the loop gives up, in order, while blocks keep missing their deadline
+enum {
+    QUALITY_FULL,    // Gate at the configured overlap
+    QUALITY_HOP,     // Gate at 50% overlap: half the FFTs
+    QUALITY_BYPASS   // Pass audio through ungated: no FFTs
+};
+
+// Deadline tracking and graceful degradation for device backends (DSP
+// thread). A block is overloaded if processing it, from the end of its read
+// to the end of its write, took more than ADAPT_BUSY of the time it covers,
+// or if it missed its deadline: it finished later, relative to the stream's
+// own clock, than the backend's buffering can hide. When too many blocks in
+// a window are overloaded, the loop steps down a ladder: moving more base
+// blocks per read, which saves per-block overhead at the cost of latency;
+// then the cheaper qualities. After a calm spell it steps back up, quality
+// first, and waits twice as long next time if a step up is soon undone.
+typedef struct {
+    int block_scale;  // Base blocks per read
+    int quality;
+} adapt_step;
+
+typedef struct {
+    bool enabled;
+    adapt_step ladder[8];
+    int steps;
+    int level;                // Current rung, 0 = full quality, one base block
+    int target;               // Rung to switch to once the gate allows it
+    size_t window_samples;
+    size_t window_blocks;
+    size_t window_busy;       // Overloaded blocks in this window
+    double calm_seconds;      // Since the last overloaded window
+    double restore_seconds;
+    double since_step_up;     // Seconds since the last step up
+    size_t stream_samples;    // Read since the loop started
+    double anchor_us;         // Earliest a block has finished after its audio
+    size_t blocks;
+    size_t deadline_misses;   // Blocks finished too late for the buffering
+    size_t changes;
+    size_t degraded_samples;  // Processed below full quality
+} adapt_state;
+
+// Gate parameters the control socket can change (main thread)
+typedef struct {
+    int n_fft;
+    float n_std_thresh;
+    float prop_decrease;
+    bool clip_noise;
+} gate_settings;
+
+typedef struct dsp_pool dsp_pool;
+
+// One source: a backend, its gate and the DSP state between them. "DSP
+// thread" below means whichever thread is running the source's blocks.
+typedef struct {
+    SpectralGate *sg;         // DSP thread once it has started
+    int overlap;              // Gate frame overlap in percent
+    size_t noise_needed;      // Samples left to capture for the profile (DSP thread)
+    atomic_bool recapture;    // Set on SIGUSR1, taken by the DSP thread
+    char profile_path[4096];  // Saved noise statistics and their geometry
+    bool save_profile;        // Store what is measured at profile_path
+
+    AudioBackend backend;
+    float *buffer;            // DSP thread work buffers, one hop each
+    float *output_buffer;
+    size_t buffer_frames;
+    size_t max_samples;       // Stop after this much input, if nonzero
+    bool align;               // Trim the gate's delay so output lines up with input
+    size_t delay_left;        // Output samples still to trim (DSP thread)
+    float *lead_in;           // Input held back while its noise is measured,
+    size_t lead_len;          // for backends that aren't devices
+
+    pthread_t dsp_thread;
+    bool dsp_started;
+    atomic_bool dsp_stop;
+    atomic_bool dsp_failed;
+    int done_fd;              // eventfd, signalled when the DSP loop ends
+    block_stats stats;        // DSP thread until it has ended
+    double wall_seconds;      // From the first gated block to the end
+    bool realtime;            // Protect the DSP thread (--rt)
+    int rt_cpu;               // Core to pin it to, or -1
+    size_t block_frames;      // Samples read at a time, grown under overload
+    adapt_state adapt;        // DSP thread
+
+    // Live reconfiguration. The main thread builds a whole replacement gate
+    // and leaves it in next_gate; the DSP thread takes it between frames,
+    // hands over the noise statistics and either the stream itself or,
+    // for another FFT size, a crossfade from the old gate, and passes the
+    // old gate back through retired_gate to be destroyed. FFTW plans are
+    // only ever made and destroyed on the main thread.
+    gate_settings settings;
+    _Atomic(SpectralGate*) next_gate;
+    _Atomic(SpectralGate*) retired_gate;
+    int retired_fd;           // eventfd, signalled when retired_gate is filled
+    SpectralGate *fading;     // Previous gate during a crossfade (DSP thread)
+    size_t fade_pos;
+    float *fade_buffer;
+    long fade_shift;          // New gate's n_fft minus the old's until the latency has moved
+    float *align_line;        // The last MAX_N_FFT samples put out or, while
+    size_t align_pos;         // fading, the faster gate's output
+
+    const char *device;       // Capture device, or NULL for the default
+    char source_name[64];     // Virtual source it feeds
+    char label[96];           // Prefix for messages, empty with one source
+    size_t total_samples;     // Read so far (DSP thread)
+    double start_us;          // When the first block was gated
+    // With several sources, blocks run on a shared pool of workers instead
+    // of a thread of their own. The rest is guarded by the pool's lock.
+    dsp_pool *pool;
+    bool queued;              // Waiting for a worker
+    bool running;             // On a worker
+    bool pending;             // Notified while running
+    bool finished;            // Ended or failed; never queued again
+    bool closed;              // Ended before the others and closed (main thread)
+    double due_us;            // When its next block should be done
+} audio_context;
+
+// Workers shared by several sources. A backend's notify queues its source,
+// and an idle worker takes the queued source whose block is due first
+// (earliest deadline first) and runs one block of it, so a source with a
+// backlog can't hold up the others' deadlines. Workers sleep when no source
+// has audio, so CPU use follows the audio rather than the number of
+// sources or workers.
+struct dsp_pool {
+    pthread_mutex_t lock;
+    pthread_cond_t work;
+    audio_context *queue[MAX_SOURCES];
+    int queued;
+    bool stop;
+    audio_context *sources;
+    int num_sources;
+    pthread_t threads[MAX_SOURCES];
+    int workers;              // Started
+    int numbered;             // Workers that have taken their number
+    bool started;
+    bool realtime;
+    int rt_cpu;               // First core to pin workers to, or -1
+};
+
+static double now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static void block_stats_add(block_stats *stats, double us, size_t samples) {
+    stats->blocks++;
+    stats->samples += samples;
+    stats->total_us += us;
+    stats->total_sq_us += us * us;
+    if (us > stats->max_us)
+        stats->max_us = us;
+    size_t bucket = (size_t)us;
+    stats->histogram[bucket < STATS_BUCKETS ? bucket : STATS_BUCKETS - 1]++;
+}
+
+static double block_stats_percentile(const block_stats *stats, double fraction) {
+    size_t target = (size_t)ceil(fraction * stats->blocks), seen = 0;
+    for (size_t i = 0; i < STATS_BUCKETS; i++) {
+        seen += stats->histogram[i];
+        if (seen >= target && seen > 0)
+            return i + 1.0;
+    }
+    return STATS_BUCKETS;
+}
+
+static void report_stats(audio_context *ctx) {
+    const block_stats *stats = &ctx->stats;
+    if (!stats->blocks)
+        return;
+    double audio_seconds = (double)stats->samples / SAMPLE_RATE;
+    double mean = stats->total_us / stats->blocks;
+    double variance = stats->total_sq_us / stats->blocks - mean * mean;
+    // A device paces the loop, so only the gate's own speed says anything
+    if (ctx->backend.ops->realtime)
+        printf("Gated %.1f s of audio (gate alone %.1fx real time)\n",
+               audio_seconds, audio_seconds / (stats->total_us / 1e6));
+    else
+        printf("Gated %.1f s of audio in %.2f s (%.1fx real time, gate alone %.1fx)\n",
+               audio_seconds, ctx->wall_seconds,
+               ctx->wall_seconds > 0 ? audio_seconds / ctx->wall_seconds : 0.0,
+               audio_seconds / (stats->total_us / 1e6));
+    size_t block = (stats->samples + stats->blocks / 2) / stats->blocks;  // Varies when adapting
+    printf("Per %zu-sample block: mean %.1f us, p50 %.0f us, p99 %.0f us, max %.1f us, "
+           "jitter %.1f us (period %.0f us)\n",
+           block, mean, block_stats_percentile(stats, 0.5),
+           block_stats_percentile(stats, 0.99), stats->max_us,
+           variance > 0 ? sqrt(variance) : 0.0, 1e6 * block / SAMPLE_RATE);
+    if (ctx->backend.ops->realtime) {
+        const adapt_state *a = &ctx->adapt;
+        printf("Deadline: %zu of %zu blocks finished too late for the buffering; "
+               "%zu quality changes, %.1f s below full quality\n",
+               a->deadline_misses, a->blocks, a->changes,
+               (double)a->degraded_samples / SAMPLE_RATE);
+    }
+    printf("Latency: %.1f ms backend buffering, %.1f ms gate\n",
+           1000.0 * ctx->backend.ops->latency(&ctx->backend),
+           1000.0 * ctx->sg->n_fft / SAMPLE_RATE);
+}
+
+static int compare_doubles(const void *a, const void *b) {
+    double x = *(const double*)a, y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+// values must be sorted
+static double sorted_percentile(const double *values, int count, double fraction) {
+    int i = (int)ceil(fraction * count) - 1;
+    return values[i < 0 ? 0 : i];
+}
+
+static void print_latency_row(const char *label, double *values, int count) {
+    qsort(values, count, sizeof(double), compare_doubles);
+    printf("  %-12s %7.1f %7.1f %7.1f %7.1f\n", label, 1000.0 * values[0],
+           1000.0 * sorted_percentile(values, count, 0.5),
+           1000.0 * sorted_percentile(values, count, 0.95),
+           1000.0 * values[count - 1]);
+}
+
+// Find each of the loopback device's chirps in what was played by
+// cross-correlation. The lag in samples is the gate's algorithmic latency;
+// the rest of the time from capture to speaker is buffering, scheduling and
+// processing. Returns nonzero if no chirp made it through.
+static int report_latency(audio_context *ctx) {
+    LoopbackBackend *lb = (LoopbackBackend*)ctx->backend.state;
+    size_t search = lb->trial_frames / 2;
+    double *algorithmic = (double*)malloc(3 * lb->trials * sizeof(double));
+    if (!algorithmic)
+        return 1;
+    double *buffering = algorithmic + lb->trials, *total = buffering + lb->trials;
+
+    int played = 0, found = 0;
+    for (int t = 0; t < lb->trials; t++) {
+        size_t at = lb->first_chirp + t * lb->trial_frames;
+        if (at + search + lb->chirp_frames > lb->written)
+            break;  // Stopped early
+        played++;
+        const float *chirp = lb->input + at;
+        double energy = 0.0, best = 0.0;
+        size_t lag = 0;
+        for (size_t k = 0; k < lb->chirp_frames; k++)
+            energy += chirp[k] * chirp[k];
+        for (size_t l = 0; l < search; l++) {
+            const float *out = lb->output + at + l;
+            double sum = 0.0;
+            for (size_t k = 0; k < lb->chirp_frames; k++)
+                sum += out[k] * chirp[k];
+            if (sum > best) {
+                best = sum;
+                lag = l;
+            }
+        }
+        if (best < 0.25 * energy)
+            continue;  // Gated away or dropped
+
+        algorithmic[found] = (double)lag / SAMPLE_RATE;
+        total[found] = lb->play_time[at + lag] - (lb->start + (double)at / SAMPLE_RATE);
+        buffering[found] = total[found] - algorithmic[found];
+        found++;
+    }
+
+    if (found) {
+        printf("Latency over %d of %d chirps, ms:   min     p50     p95     max\n",
+               found, played);
+        print_latency_row("algorithmic", algorithmic, found);
+        print_latency_row("buffering", buffering, found);
+        print_latency_row("total", total, found);
+        printf("Configured buffering: %.1f ms capture block, %.1f ms playback; "
+               "%zu playback underruns\n", 1000.0 * lb->block_seconds,
+               1000.0 * lb->buffer_seconds, lb->underruns);
+    } else if (played) {
+        fprintf(stderr, "No chirp made it through the gate\n");
+    } else {
+        fprintf(stderr, "Stopped before the first chirp\n");
+    }
+    free(algorithmic);
+    return found ? 0 : 1;
+}
+
+// Ladder from full quality down: more base blocks per read, then 50%
+// overlap unless that is already the setting, then passthrough
+static void adapt_init(audio_context *ctx) {
+    adapt_state *a = &ctx->adapt;
+    a->steps = 0;
+    for (int scale = 1; scale <= MAX_BLOCK_HOPS; scale *= 2)
+        a->ladder[a->steps++] = (adapt_step){scale, QUALITY_FULL};
+    if (ctx->overlap != 50)
+        a->ladder[a->steps++] = (adapt_step){MAX_BLOCK_HOPS, QUALITY_HOP};
+    a->ladder[a->steps++] = (adapt_step){MAX_BLOCK_HOPS, QUALITY_BYPASS};
+    a->level = a->target = 0;
+    a->restore_seconds = ADAPT_RESTORE_SECONDS;
+    a->since_step_up = INFINITY;
+    a->anchor_us = INFINITY;
+    ctx->block_frames = ctx->buffer_frames;
+}
+
+// Switch to a rung. Fails, to be retried after the next block, while the
+// gate is part way through a frame.
+static bool adapt_apply(audio_context *ctx, int level) {
+    static const char *const qualities[] = {
+        "full quality", "50% overlap", "ungated passthrough"
+    };
+    adapt_state *a = &ctx->adapt;
+    const adapt_step *step = &a->ladder[level];
+    if (!spectralgate_stream_set_overlap(ctx->sg, step->quality == QUALITY_FULL ? ctx->overlap : 50))
+        return false;
+    ctx->sg->bypass = step->quality == QUALITY_BYPASS;
+    ctx->block_frames = ctx->buffer_frames * step->block_scale;
+    printf("%s%s: %zu-sample blocks, %s\n", ctx->label,
+           level > a->level ? "Overloaded" : "Headroom back",
+           ctx->block_frames, qualities[step->quality]);
+    a->level = level;
+    a->changes++;
+    return true;
+}
+
+// Judge one processed block against its deadline and move along the ladder
+// at the end of each window
+static void adapt_block(audio_context *ctx, size_t n, double busy_us) {
+    adapt_state *a = &ctx->adapt;
+    double period_us = 1e6 * n / SAMPLE_RATE;
+    double now = now_us();
+    a->blocks++;
+    a->stream_samples += n;
+    // The anchor creeps forward so a device clock slightly slower than
+    // this one doesn't look like the loop falling behind
+    double lag_us = now - 1e6 * a->stream_samples / SAMPLE_RATE;
+    a->anchor_us += ADAPT_DRIFT * period_us;
+    if (lag_us < a->anchor_us)
+        a->anchor_us = lag_us;
+    double slack_us = period_us + 1e6 * ctx->backend.ops->latency(&ctx->backend);
+    bool late = lag_us - a->anchor_us > slack_us;
+    if (late)
+        a->deadline_misses++;
+    if (ctx->noise_needed)
+        return;  // Nothing is gated, so nothing to adapt
+    if (a->ladder[a->level].quality != QUALITY_FULL)
+        a->degraded_samples += n;
+    if (!a->enabled)
+        return;
+    if (a->target != a->level)
+        adapt_apply(ctx, a->target);
+
+    a->window_samples += n;
+    a->window_blocks++;
+    if (late || busy_us > ADAPT_BUSY * period_us)
+        a->window_busy++;
+    if (a->window_samples < ADAPT_WINDOW_SECONDS * SAMPLE_RATE)
+        return;
+
+    double seconds = (double)a->window_samples / SAMPLE_RATE;
+    bool overloaded = a->window_busy > ADAPT_OVERLOADED * a->window_blocks;
+    a->window_samples = a->window_blocks = a->window_busy = 0;
+    a->since_step_up += seconds;
+    if (overloaded) {
+        a->calm_seconds = 0.0;
+        if (a->target < a->steps - 1) {
+            if (a->since_step_up < a->restore_seconds &&
+                a->restore_seconds < ADAPT_MAX_RESTORE_SECONDS)
+                a->restore_seconds *= 2;  // The last step up didn't hold
+            a->target++;
+        }
+    } else {
+        a->calm_seconds += seconds;
+        if (a->target > 0 && a->calm_seconds >= a->restore_seconds) {
+            a->target--;
+            a->calm_seconds = 0.0;
+            a->since_step_up = 0.0;
+        }
+    }
+    if (a->target != a->level)
+        adapt_apply(ctx, a->target);
+}
+
+static void retire_gate(audio_context *ctx, SpectralGate *sg) {
+    atomic_store(&ctx->retired_gate, sg);
+    eventfd_write(ctx->retired_fd, 1);
+}
+
+// Switch to a gate built by the main thread, if there is one and this is a
+// frame boundary. The last gate's noise statistics carry over. With the same
+// geometry the stream carries over too and the change is seamless; with
+// another, both gates run until the new one's history is full and the
+// output crossfades between them. DSP thread.
+static void adopt_next_gate(audio_context *ctx) {
+    if (ctx->noise_needed || ctx->fading || ctx->fade_shift || ctx->sg->stream_fill ||
+        atomic_load(&ctx->retired_gate))
+        return;
+    SpectralGate *next = atomic_exchange(&ctx->next_gate, NULL);
+    if (!next)
+        return;
+    SpectralGate *last = ctx->sg;
+    spectralgate_noise_copy(next, last);
+    if (next->n_fft == last->n_fft && next->hop_length == last->hop_length) {
+        spectralgate_stream_copy(next, last);
+        retire_gate(ctx, last);
+    } else {
+        ctx->fading = last;
+        ctx->fade_pos = 0;
+        ctx->fade_shift = (long)next->n_fft - last->n_fft;
+        if (ctx->align && ctx->fade_shift > 0)
+            ctx->delay_left += ctx->fade_shift;  // What the later gate repeats
+    }
+    ctx->sg = next;
+    adapt_init(ctx);  // The new gate starts at full quality
+}
+
+// Remember what was put out, for a fade to a larger FFT to replay
+static void remember_output(audio_context *ctx, const float *samples, size_t count) {
+    for (size_t i = 0; i < count; i++)
+        ctx->align_line[ctx->align_pos++ % MAX_N_FFT] = samples[i];
+}
+
+// Gate a block, fading over from the previous gate after an FFT size change.
+// Each gate's output lags the input by its n_fft, so for the crossfade the
+// faster gate runs through the align line, delayed by the difference. The
+// latency then still has to move to the new gate's. From a device it moves
+// in a short splice between the delayed and undelayed output: at the start
+// for a larger FFT, which replays the difference, and after the crossfade
+// for a smaller one, which skips it. From a file or pipe nothing is replayed
+// or skipped; the difference is trimmed from the output or written out in
+// addition, so the output stays aligned with the input. Returns the samples
+// put in output, which can be up to MAX_N_FFT more than n.
+static size_t gate_block(audio_context *ctx, const float *input, float *output, size_t n) {
+    spectralgate_stream(ctx->sg, input, output, n);
+    if (!ctx->fading && !ctx->fade_shift) {
+        remember_output(ctx, output, n);
+        return n;
+    }
+    if (ctx->fading)
+        spectralgate_stream(ctx->fading, input, ctx->fade_buffer, n);
+    size_t shift = ctx->fade_shift < 0 ? -ctx->fade_shift : ctx->fade_shift;
+    size_t primed = ctx->sg->n_fft + (ctx->fade_shift < 0 ? shift : 0);
+    size_t faded = primed + CROSSFADE_SAMPLES;
+    size_t end = faded;  // Until the latency has moved
+    if (ctx->fade_shift < 0)
+        end += ctx->align ? 1 : LATENCY_SPLICE_SAMPLES;
+    for (size_t i = 0; i < n; i++, ctx->fade_pos++) {
+        size_t pos = ctx->fade_pos;
+        if (ctx->fade_shift < 0 && ctx->align && pos == faded) {
+            // What the line holds comes before the new gate's own output
+            memmove(output + i + shift, output + i, (n - i) * sizeof(float));
+            for (size_t k = 0; k < shift; k++)
+                output[i + k] = ctx->align_line[(ctx->align_pos - shift + k) % MAX_N_FFT];
+            remember_output(ctx, output + i + shift, n - i);
+            n += shift;
+            ctx->fade_pos = end;
+            break;
+        }
+        if (pos >= end) {
+            remember_output(ctx, output + i, n - i);
+            break;
+        }
+        float old = pos < faded ? ctx->fade_buffer[i] : 0.0f;
+        float *slot = &ctx->align_line[ctx->align_pos++ % MAX_N_FFT];
+        float delayed = ctx->align_line[(ctx->align_pos - 1 - shift) % MAX_N_FFT];
+        // The two gates' output, lined up
+        float from = ctx->fade_shift > 0 ? delayed : old;
+        float to = ctx->fade_shift < 0 ? delayed : output[i];
+        float faster = ctx->fade_shift > 0 ? old : output[i];
+        if (pos < primed) {
+            output[i] = from;
+            if (ctx->fade_shift > 0 && !ctx->align && pos < LATENCY_SPLICE_SAMPLES) {
+                float w = (float)pos / LATENCY_SPLICE_SAMPLES;
+                output[i] = w * from + (1.0f - w) * old;
+            }
+        } else if (pos < faded) {
+            float w = (float)(pos - primed) / CROSSFADE_SAMPLES;
+            output[i] = w * to + (1.0f - w) * from;
+        } else {
+            float w = (float)(pos - faded) / LATENCY_SPLICE_SAMPLES;
+            output[i] = w * output[i] + (1.0f - w) * delayed;
+        }
+        *slot = shift ? faster : output[i];
+    }
+    if (ctx->fading && ctx->fade_pos >= faded) {
+        retire_gate(ctx, ctx->fading);
+        ctx->fading = NULL;
+    }
+    if (ctx->fade_pos >= end)
+        ctx->fade_shift = 0;
+    return n;
+}
+
+// Measure a new noise profile from the incoming audio. From a device,
+// output is silent until it is done; from a file or pipe, the input is held
+// back and gated once the profile is known. DSP thread, or before it starts.
+static void start_noise_capture(audio_context *ctx) {
+    if (ctx->lead_in)
+        printf("%sComputing noise profile from the first %d seconds of the input...\n",
+               ctx->label, NOISE_SECONDS);
+    else
+        printf("%sComputing noise profile... Please be quiet for %d seconds.\n",
+               ctx->label, NOISE_SECONDS);
+    if (ctx->fading) {
+        retire_gate(ctx, ctx->fading);
+        ctx->fading = NULL;
+    }
+    ctx->fade_shift = 0;
+    if (ctx->adapt.level) {
+        // Measure, and save, at the configured geometry
+        spectralgate_set_overlap(ctx->sg, ctx->overlap);
+        ctx->sg->bypass = false;
+        adapt_init(ctx);
+    }
+    spectralgate_noise_reset(ctx->sg);
+    ctx->noise_needed = SAMPLE_RATE * NOISE_SECONDS;
+}
+
+static void finish_noise_capture(audio_context *ctx) {
+    ctx->noise_needed = 0;
+    spectralgate_noise_finish(ctx->sg);
+    spectralgate_stream_reset(ctx->sg);
+    ctx->delay_left = ctx->align ? ctx->sg->n_fft : 0;
+    if (ctx->save_profile && !noiseprofile_save(ctx->profile_path, ctx->sg)) {
+        fprintf(stderr, "%sWarning: Failed to save noise profile to %s\n",
+                ctx->label, ctx->profile_path);
+    }
+    printf("%sNoise profile computed. Starting noise cancellation...\n", ctx->label);
+}
+
+// Returns how many of the samples went into the profile
+static size_t capture_noise(audio_context *ctx, const float *samples, size_t count) {
+    if (count > ctx->noise_needed)
+        count = ctx->noise_needed;
+    spectralgate_noise_push(ctx->sg, samples, count);
+    if (ctx->lead_in) {
+        memcpy(ctx->lead_in + ctx->lead_len, samples, count * sizeof(float));
+        ctx->lead_len += count;
+    }
+    ctx->noise_needed -= count;
+    if (!ctx->noise_needed)
+        finish_noise_capture(ctx);
+    return count;
+}
+
+// Hand gated audio to the backend, minus what is left of the gate's delay
+static bool write_output(audio_context *ctx, const float *samples, size_t count) {
+    size_t trim = ctx->delay_left < count ? ctx->delay_left : count;
+    ctx->delay_left -= trim;
+    if (trim == count)
+        return true;
+    return ctx->backend.ops->write(&ctx->backend, samples + trim, count - trim) >= 0;
+}
+
+// Gate the input held back while the profile was measured
+static bool gate_lead_in(audio_context *ctx) {
+    size_t chunk = MAX_BLOCK_HOPS * ctx->buffer_frames;
+    for (size_t pos = 0; pos < ctx->lead_len; pos += chunk) {
+        size_t n = ctx->lead_len - pos < chunk ? ctx->lead_len - pos : chunk;
+        size_t out = gate_block(ctx, ctx->lead_in + pos, ctx->output_buffer, n);
+        if (!write_output(ctx, ctx->output_buffer, out))
+            return false;
+    }
+    ctx->lead_len = 0;
+    return true;
+}
+
+// At the end of the input, push what is still in the gate out with silence,
+// so aligned output is exactly as long as the input. Until a smaller FFT's
+// fade is over, the output still lags by the old gate's n_fft.
+static bool flush_gate(audio_context *ctx) {
+    memset(ctx->buffer, 0, ctx->buffer_frames * sizeof(float));
+    size_t left = ctx->sg->n_fft + (ctx->fade_shift < 0 ? -ctx->fade_shift : 0);
+    while (left > 0) {
+        size_t n = left < ctx->buffer_frames ? left : ctx->buffer_frames;
+        size_t out = gate_block(ctx, ctx->buffer, ctx->output_buffer, n);
+        if (out > left)
+            out = left;
+        if (!write_output(ctx, ctx->output_buffer, out))
+            return false;
+        left -= out;
+    }
+    return true;
+}
+
+// What the DSP thread touches for every block, to lock for --rt
+static int dsp_regions(audio_context *ctx, RealtimeRegion *regions) {
+    size_t bytes = MAX_BLOCK_HOPS * ctx->buffer_frames * sizeof(float);
+    regions[0] = (RealtimeRegion){ctx->buffer, bytes};
+    regions[1] = (RealtimeRegion){ctx->output_buffer, bytes + MAX_N_FFT * sizeof(float)};
+    regions[2] = (RealtimeRegion){ctx->fade_buffer, bytes};
+    regions[3] = (RealtimeRegion){ctx->align_line, MAX_N_FFT * sizeof(float)};
+    regions[4] = (RealtimeRegion){&ctx->stats, sizeof(ctx->stats)};
+    return DSP_REGIONS;
+}
+
+// Before the first block
+static void dsp_begin(audio_context *ctx) {
+    if (!ctx->noise_needed)
+        ctx->delay_left = ctx->align ? ctx->sg->n_fft : 0;
+}
+
+// Move one block from the backend through the gate and back. Returns the
+// samples moved, 0 if there were none yet, or AUDIOBACKEND_END or
+// AUDIOBACKEND_ERROR when the source is done.
+static long dsp_block(audio_context *ctx) {
+    AudioBackend *b = &ctx->backend;
+    if (atomic_exchange(&ctx->recapture, false))
+        start_noise_capture(ctx);
+
+    long got = b->ops->read(b, ctx->buffer, ctx->block_frames);
+    if (got <= 0)
+        return got;  // Ended, failed or woken to look at the flags
+    size_t n = (size_t)got;
+
+    double block_start = now_us();
+    const float *input = ctx->buffer;
+    size_t gated = n;
+    if (ctx->noise_needed && !ctx->lead_in) {
+        capture_noise(ctx, ctx->buffer, n);
+        memset(ctx->output_buffer, 0, n * sizeof(float));
+        gated = 0;
+        if (!write_output(ctx, ctx->output_buffer, n))
+            return AUDIOBACKEND_ERROR;
+    } else if (ctx->noise_needed) {
+        size_t taken = capture_noise(ctx, ctx->buffer, n);
+        if (!ctx->noise_needed && !gate_lead_in(ctx))
+            return AUDIOBACKEND_ERROR;
+        input += taken;
+        gated -= taken;
+    }
+    if (gated) {
+        // Apply spectral gate. Frames overlap across blocks, so the
+        // output lags the input by one FFT size.
+        if (!ctx->stats.blocks)
+            ctx->start_us = block_start;
+        size_t out = gate_block(ctx, input, ctx->output_buffer, gated);
+        block_stats_add(&ctx->stats, now_us() - block_start, gated);
+        if (!write_output(ctx, ctx->output_buffer, out))
+            return AUDIOBACKEND_ERROR;
+    }
+    adapt_block(ctx, n, now_us() - block_start);
+    adopt_next_gate(ctx);
+    ctx->total_samples += n;
+    if (ctx->max_samples && ctx->total_samples >= ctx->max_samples)
+        return AUDIOBACKEND_END;
+    return got;
+}
+
+// After the last block, given what dsp_block last returned: push out what
+// an ended input left in the gate and tell the main thread
+static void dsp_end(audio_context *ctx, long result) {
+    // An input shorter than the noise sample is measured as far as it goes
+    if (result == AUDIOBACKEND_END && ctx->noise_needed && ctx->lead_in) {
+        fprintf(stderr, "%sWarning: Input ended within the %d s noise sample\n",
+                ctx->label, NOISE_SECONDS);
+        finish_noise_capture(ctx);
+        if (!gate_lead_in(ctx))
+            result = AUDIOBACKEND_ERROR;
+    }
+    if (result == AUDIOBACKEND_ERROR ||
+        (result == AUDIOBACKEND_END && ctx->align && !ctx->noise_needed && !flush_gate(ctx)))
+        atomic_store(&ctx->dsp_failed, true);
+    if (ctx->stats.blocks)
+        ctx->wall_seconds = (now_us() - ctx->start_us) / 1e6;
+    eventfd_write(ctx->done_fd, 1);
+}
+
+// Move audio from the backend through the gate and back, until stopped or
+// the input ends
+static void *dsp_thread_main(void *userdata) {
+    audio_context *ctx = (audio_context*)userdata;
+    if (ctx->realtime) {
+        RealtimeRegion regions[DSP_REGIONS];
+        RealtimeConfig config = {REALTIME_PRIORITY, ctx->rt_cpu, true};
+        RealtimeStatus status;
+        realtime_enter(&config, regions, dsp_regions(ctx, regions), &status);
+        realtime_print("DSP thread", &status);
+    }
+    dsp_begin(ctx);
+    long result = 0;
+    while (!atomic_load(&ctx->dsp_stop) && (result = dsp_block(ctx)) >= 0)
+        ;
+    dsp_end(ctx, result);
+    return NULL;
+}
+
+// Queue a source for the next free worker. Pool lock held.
+static void dsp_pool_queue(dsp_pool *pool, audio_context *ctx) {
+    ctx->queued = true;
+    pool->queue[pool->queued++] = ctx;
+    pthread_cond_signal(&pool->work);
+}
+
+// Backend notify: the source has audio, a failure or a flag to look at.
+// Any thread.
+static void dsp_pool_notify(void *userdata) {
+    audio_context *ctx = (audio_context*)userdata;
+    dsp_pool *pool = ctx->pool;
+    pthread_mutex_lock(&pool->lock);
+    if (ctx->running) {
+        ctx->pending = true;
+    } else if (!ctx->queued && !ctx->finished) {
+        // Audio that has just arrived is due within one block period
+        ctx->due_us = now_us() + 1e6 * ctx->block_frames / SAMPLE_RATE;
+        dsp_pool_queue(pool, ctx);
+    }
+    pthread_mutex_unlock(&pool->lock);
+}
+
+static void *dsp_worker_main(void *userdata) {
+    dsp_pool *pool = (dsp_pool*)userdata;
+    pthread_mutex_lock(&pool->lock);
+    int worker = pool->numbered++;
+    pthread_mutex_unlock(&pool->lock);
+    if (pool->realtime) {
+        RealtimeRegion regions[DSP_REGIONS * MAX_SOURCES];
+        int n = 0;
+        for (int i = 0; i < pool->num_sources; i++)
+            n += dsp_regions(&pool->sources[i], regions + n);
+        // Consecutive cores from --cpu
+        int cpu = pool->rt_cpu < 0 ? -1
+                  : (pool->rt_cpu + worker) % (int)sysconf(_SC_NPROCESSORS_CONF);
+        RealtimeConfig config = {REALTIME_PRIORITY, cpu, true};
+        RealtimeStatus status;
+        char what[32];
+        snprintf(what, sizeof(what), "DSP worker %d", worker + 1);
+        realtime_enter(&config, regions, n, &status);
+        realtime_print(what, &status);
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    for (;;) {
+        while (!pool->stop && !pool->queued)
+            pthread_cond_wait(&pool->work, &pool->lock);
+        if (pool->stop)
+            break;
+        int first = 0;
+        for (int i = 1; i < pool->queued; i++) {
+            if (pool->queue[i]->due_us < pool->queue[first]->due_us)
+                first = i;
+        }
+        audio_context *ctx = pool->queue[first];
+        pool->queue[first] = pool->queue[--pool->queued];
+        ctx->queued = false;
+        ctx->running = true;
+        ctx->pending = false;
+        pthread_mutex_unlock(&pool->lock);
+
+        long result = dsp_block(ctx);
+        if (result < 0)
+            dsp_end(ctx, result);
+
+        pthread_mutex_lock(&pool->lock);
+        ctx->running = false;
+        if (result < 0) {
+            ctx->finished = true;
+        } else if (result > 0 || ctx->pending) {
+            // There may be more: the next block is due one period later.
+            // A source behind on its audio thereby stays ahead of ones
+            // whose audio has only just arrived.
+            ctx->due_us += 1e6 * (result > 0 ? result : 0) / SAMPLE_RATE;
+            dsp_pool_queue(pool, ctx);
+        }
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+// Before any of the sources' backends is opened, since they notify it
+static void dsp_pool_init(dsp_pool *pool, audio_context *sources, int num_sources) {
+    // Backends' mainloops take the lock too; they mustn't hold up a worker
+    // that has been made real-time
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setprotocol(&attr, PTHREAD_PRIO_INHERIT);
+    pthread_mutex_init(&pool->lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+    pthread_cond_init(&pool->work, NULL);
+    pool->sources = sources;
+    pool->num_sources = num_sources;
+    for (int i = 0; i < num_sources; i++)
+        sources[i].pool = pool;
+}
+
+// Start the given number of workers. Returns false if not all of them
+// started; dsp_pool_stop stops those that did.
+static bool dsp_pool_start(dsp_pool *pool, int workers) {
+    for (int i = 0; i < pool->num_sources; i++)
+        dsp_begin(&pool->sources[i]);
+    pthread_mutex_lock(&pool->lock);
+    pool->started = true;
+    for (int i = 0; i < workers; i++) {
+        if (pthread_create(&pool->threads[i], NULL, dsp_worker_main, pool) != 0)
+            break;
+        pool->workers++;
+    }
+    // Look at every source once, for the flags and whatever arrived before
+    // the workers were ready
+    for (int i = 0; i < pool->num_sources; i++) {
+        audio_context *ctx = &pool->sources[i];
+        if (!ctx->queued) {
+            ctx->due_us = now_us();
+            dsp_pool_queue(pool, ctx);
+        }
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return pool->workers == workers;
+}
+
+// Stop the workers, then end every source still running
+static void dsp_pool_stop(dsp_pool *pool) {
+    if (!pool->started)
+        return;
+    pthread_mutex_lock(&pool->lock);
+    pool->stop = true;
+    pthread_cond_broadcast(&pool->work);
+    pthread_mutex_unlock(&pool->lock);
+    for (int i = 0; i < pool->workers; i++)
+        pthread_join(pool->threads[i], NULL);
+    pool->workers = 0;
+    pool->started = false;
+    for (int i = 0; i < pool->num_sources; i++) {
+        if (!pool->sources[i].finished)
+            dsp_end(&pool->sources[i], 0);
     }
+}
+
+// Once no backend can notify it any more
+static void dsp_pool_destroy(dsp_pool *pool) {
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->work);
+}
 
+static int setup_gate(audio_context *ctx) {
+    // Initialize SpectralGate
+    ctx->sg = spectralgate_create(SAMPLE_RATE);
+    if (!ctx->sg)
+        return -1;
+    spectralgate_set_overlap(ctx->sg, ctx->overlap);
+    ctx->buffer_frames = ctx->sg->hop_length;  // One gate frame per block
+    adapt_init(ctx);
+    // Room for the largest block overload can call for
+    ctx->buffer = (float*)malloc(MAX_BLOCK_HOPS * ctx->buffer_frames * sizeof(float));
+    // plus what a fade to a smaller FFT can add to a block
+    ctx->output_buffer = (float*)malloc((MAX_BLOCK_HOPS * ctx->buffer_frames + MAX_N_FFT) *
+                                        sizeof(float));
+    ctx->fade_buffer = (float*)malloc(MAX_BLOCK_HOPS * ctx->buffer_frames * sizeof(float));
+    ctx->align_line = (float*)calloc(MAX_N_FFT, sizeof(float));
+    if (!ctx->backend.ops->realtime)
+        ctx->lead_in = (float*)malloc(SAMPLE_RATE * NOISE_SECONDS * sizeof(float));
+    ctx->done_fd = eventfd(0, EFD_CLOEXEC);
+    ctx->retired_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    ctx->settings = (gate_settings){ctx->sg->n_fft, ctx->sg->n_std_thresh,
+                                    ctx->sg->prop_decrease, ctx->sg->clip_noise};
+    if (!ctx->buffer || !ctx->output_buffer || !ctx->fade_buffer || !ctx->align_line ||
+        (!ctx->backend.ops->realtime && !ctx->lead_in) ||
+        ctx->done_fd < 0 || ctx->retired_fd < 0) {
+        fprintf(stderr, "Cannot allocate buffers\n");
+        return -1;
+    }
     return 0;
 }
 
 static void cleanup_audio(audio_context *ctx) {
-    if (ctx->capture)
-        pa_simple_free(ctx->capture);
-    if (ctx->playback)
-        pa_simple_free(ctx->playback);
-    if (ctx->buffer)
-        free(ctx->buffer);
-    if (ctx->output_buffer)
-        free(ctx->output_buffer);
-    if (ctx->sg)
-        spectralgate_destroy(ctx->sg);
-    
-    // Find and remove the pipe-source module
-    FILE *fp = popen("pactl list modules | grep -B 2 noise_cancelled | grep Module | cut -d '#' -f 2", "r");
-    if (fp) {
-        char module_id[32];
-        if (fgets(module_id, sizeof(module_id), fp)) {
-            char cmd[64];
-            snprintf(cmd, sizeof(cmd), "pactl unload-module %s", module_id);
-            system(cmd);
-        }
-        pclose(fp);
-    }
-}
-
-static int compute_noise_profile(audio_context *ctx) {
-    printf("Computing noise profile... Please be quiet for %d seconds.\n", NOISE_SECONDS);
-    
-    size_t noise_samples = SAMPLE_RATE * NOISE_SECONDS;
-    float *noise_buffer = (float*)malloc(noise_samples * sizeof(float));
-    if (!noise_buffer) {
-        fprintf(stderr, "Cannot allocate noise buffer\n");
-        return -1;
+    if (ctx->dsp_started) {
+        atomic_store(&ctx->dsp_stop, true);
+        ctx->backend.ops->wake(&ctx->backend);
+        pthread_join(ctx->dsp_thread, NULL);
     }
+    if (ctx->backend.ops && !ctx->closed)
+        ctx->backend.ops->close(&ctx->backend);
+    if (ctx->done_fd >= 0)
+        close(ctx->done_fd);
+    if (ctx->retired_fd >= 0)
+        close(ctx->retired_fd);
+    free(ctx->buffer);
+    free(ctx->output_buffer);
+    free(ctx->fade_buffer);
+    free(ctx->align_line);
+    free(ctx->lead_in);
+    SpectralGate *gates[] = {ctx->sg, ctx->fading, atomic_load(&ctx->next_gate),
+                             atomic_load(&ctx->retired_gate)};
+    for (size_t i = 0; i < sizeof(gates) / sizeof(gates[0]); i++) {
+        if (gates[i])
+            spectralgate_destroy(gates[i]);
+    }
+}
+
+// What a source did, once its DSP loop has ended. Main thread.
+static void report_source(audio_context *ctx, bool several) {
+    if (several)
+        printf("%s from %s:\n", ctx->source_name, ctx->device);
+    report_stats(ctx);
+    size_t capture_dropped = atomic_load(&ctx->backend.capture_dropped);
+    size_t output_dropped = atomic_load(&ctx->backend.output_dropped);
+    size_t underruns = atomic_load(&ctx->backend.output_underruns);
+    if (capture_dropped || output_dropped)
+        fprintf(stderr, "%sDropped %.2f s of capture and %.2f s of output\n",
+                ctx->label, (double)capture_dropped / SAMPLE_RATE,
+                (double)output_dropped / SAMPLE_RATE);
+    if (underruns)
+        fprintf(stderr, "%sOutput ran dry %zu times\n", ctx->label, underruns);
+}
+
+// One of several sources has ended or failed while others still run:
+// report it and close its backend, which removes its virtual source.
+// Each source has its own connection to the sound server, so the others
+// are unaffected. Main thread.
+static void close_source(audio_context *ctx, int running) {
+    report_source(ctx, true);
+    ctx->backend.ops->close(&ctx->backend);
+    ctx->closed = true;
+    printf("%s%d source%s still running\n", ctx->label, running, running > 1 ? "s" : "");
+}
+
+// Every source the process serves (main thread)
+typedef struct {
+    audio_context *sources;
+    int count;
+} source_list;
+
+// Stop and free every source, whatever state it got to
+static void cleanup_sources(source_list *list, dsp_pool *pool) {
+    if (pool)
+        dsp_pool_stop(pool);
+    for (int i = 0; i < list->count; i++)
+        cleanup_audio(&list->sources[i]);
+    if (pool)
+        dsp_pool_destroy(pool);
+}
+
+// A gate with the given settings at the configured overlap. Main thread.
+static SpectralGate *build_gate(audio_context *ctx, const gate_settings *settings) {
+    SpectralGate *sg = spectralgate_create_sized(SAMPLE_RATE, settings->n_fft);
+    if (!sg)
+        return NULL;
+    spectralgate_set_overlap(sg, ctx->overlap);
+    sg->n_std_thresh = settings->n_std_thresh;
+    sg->prop_decrease = settings->prop_decrease;
+    sg->clip_noise = settings->clip_noise;
+    return sg;
+}
+
+static void free_retired_gate(audio_context *ctx) {
+    eventfd_t value;
+    eventfd_read(ctx->retired_fd, &value);
+    SpectralGate *sg = atomic_exchange(&ctx->retired_gate, NULL);
+    if (sg)
+        spectralgate_destroy(sg);
+}
+
+// A command from the control socket, for every source. Parameter changes
+// build a new gate here and leave it for the DSP thread, replacing one it
+// hasn't taken yet.
+static bool control_command(void *userdata, char *command, char *reply, size_t size) {
+    const source_list *list = (const source_list*)userdata;
+    audio_context *ctx = &list->sources[0];
+    char *name = strtok(command, " \t");
+    char *value = strtok(NULL, " \t");
+    if (!name)
+        name = "";
+    gate_settings settings = ctx->settings;
+    if (!strcmp(name, "status") && !value) {
+        int n = snprintf(reply, size, "n_std_thresh %g\nprop_decrease %g%s\nn_fft %d\noverlap %d\n",
+                         settings.n_std_thresh, settings.prop_decrease,
+                         settings.clip_noise ? " (clipped to 0)" : "", settings.n_fft, ctx->overlap);
+        for (int i = 0; list->count > 1 && i < list->count && n < (int)size; i++)
+            n += snprintf(reply + n, size - n, "source %s from %s%s\n",
+                          list->sources[i].source_name, list->sources[i].device,
+                          list->sources[i].closed ? " (ended)" : "");
+        return true;
+    }
+    if (!strcmp(name, "recapture") && !value) {
+        for (int i = 0; i < list->count; i++) {
+            if (list->sources[i].closed)
+                continue;
+            atomic_store(&list->sources[i].recapture, true);
+            list->sources[i].backend.ops->wake(&list->sources[i].backend);
+        }
+        return true;
+    }
+
+    char *end = NULL;
+    double number = value ? strtod(value, &end) : 0.0;
+    if (!value || *end || strtok(NULL, " \t")) {
+        snprintf(reply, size, "unknown command; try status, recapture, "
+                 "n_std_thresh X, prop_decrease X or n_fft N");
+        return false;
+    }
+    if (!strcmp(name, "n_std_thresh")) {
+        if (!(number >= 0.0 && number <= 10.0)) {
+            snprintf(reply, size, "n_std_thresh must be between 0 and 10");
+            return false;
+        }
+        settings.n_std_thresh = (float)number;
+    } else if (!strcmp(name, "prop_decrease")) {
+        if (!(number >= 0.0 && number <= 1.0)) {
+            snprintf(reply, size, "prop_decrease must be between 0 and 1");
+            return false;
+        }
+        // The gain left on noise bins, so they are no longer clipped to 0
+        settings.prop_decrease = (float)number;
+        settings.clip_noise = false;
+    } else if (!strcmp(name, "n_fft")) {
+        int n_fft = (int)number;
+        if (n_fft != number || n_fft < MIN_N_FFT || n_fft > MAX_N_FFT || (n_fft & (n_fft - 1))) {
+            snprintf(reply, size, "n_fft must be a power of two from %d to %d",
+                     MIN_N_FFT, MAX_N_FFT);
+            return false;
+        }
+        settings.n_fft = n_fft;
+    } else {
+        snprintf(reply, size, "unknown setting '%s'", name);
+        return false;
+    }
+
+    // Every gate is built before any is handed over, so a failure leaves
+    // all sources on their old settings
+    SpectralGate *next[MAX_SOURCES] = {NULL};
+    for (int i = 0; i < list->count; i++) {
+        if (list->sources[i].closed)
+            continue;
+        next[i] = build_gate(&list->sources[i], &settings);
+        if (!next[i]) {
+            for (int j = 0; j < i; j++)
+                spectralgate_destroy(next[j]);
+            snprintf(reply, size, "cannot allocate the gate");
+            return false;
+        }
+    }
+    for (int i = 0; i < list->count; i++) {
+        ctx = &list->sources[i];
+        if (next[i]) {
+            SpectralGate *superseded = atomic_exchange(&ctx->next_gate, next[i]);
+            if (superseded)
+                spectralgate_destroy(superseded);
+        }
+        ctx->settings = settings;
+    }
+    return true;
+}
 
-    int error;
-    if (pa_simple_read(ctx->capture, noise_buffer, 
-                       noise_samples * sizeof(float), &error) < 0) {
-        fprintf(stderr, "Failed to read noise profile: %s\n",
-                pa_strerror(error));
-        free(noise_buffer);
+// Warm start: rebuild the threshold from the saved statistics. Fails if there
+// are none or they were measured with a different FFT geometry or rate.
+static int load_noise_profile(audio_context *ctx) {
+    NoiseProfile profile;
+    if (!noiseprofile_load(ctx->profile_path, &profile)) {
         return -1;
     }
 
-    spectralgate_compute_noise_thresh(ctx->sg, noise_buffer, noise_samples);
-    free(noise_buffer);
-    
-    printf("Noise profile computed. Starting noise cancellation...\n");
-    return 0;
+    int result = -1;
+    if (noiseprofile_matches(&profile, ctx->sg)) {
+        noiseprofile_apply(&profile, ctx->sg);
+        printf("%sLoaded noise profile from %s\n", ctx->label, ctx->profile_path);
+        result = 0;
+    } else {
+        printf("%sSaved noise profile doesn't match the current settings.\n", ctx->label);
+    }
+    noiseprofile_free(&profile);
+    return result;
 }
 
-int main() {
-    audio_context ctx = {0};
-    int error;
-    
-    // Set up signal handling
-    global_ctx = &ctx;
-    signal(SIGINT, signal_handler);
-    signal(SIGTERM, signal_handler);
+static void usage(const char *prog) {
+    printf("Usage: %s [-r] [-p PROFILE] [--overlap PCT] [--latency MS]\n"
+           "       [--direct [--backpressure drop|stretch]]\n"
+           "       [-b BACKEND] [-i FILE] [-o FILE] [--seconds S]\n"
+           "       [--pipe [--format f32|s16]] [--rt] [--cpu N]\n"
+           "       [--measure-latency [--trials N]] [--no-adapt]\n"
+           "       [--daemon] [--socket PATH] [--send CMD]\n"
+           "       [-s DEVICE]... [--workers N]\n\n"
+           "  -r, --recapture      Capture a new noise profile even if one is saved\n"
+           "  -p, --profile PATH   Noise profile file (default: ~/" PROFILE_FILE ")\n"
+           "      --overlap PCT    Gate frame overlap, 75 or 50. 50 halves the FFT\n"
+           "                       work with slightly different artifacts (default: 75)\n"
+           "      --latency MS     Buffering asked of each audio stream (default: %d)\n"
+           "      --direct         Write straight into the virtual source's pipe\n"
+           "                       instead of through a playback stream\n"
+           "      --backpressure P When the pipe is full, drop new audio or\n"
+           "                       stretch latency by up to --latency (default: drop)\n"
+           "  -b, --backend NAME   Audio I/O: pulse (virtual source, the default),\n"
+           "                       portaudio (default devices), wav (-i to -o),\n"
+           "                       raw (PCM stdin to stdout), null (silence) or\n"
+           "                       loopback (test signal, see --measure-latency)\n"
+           "  -i, --input FILE     Input file for the wav backend\n"
+           "  -o, --output FILE    Output file for the wav backend (default: none)\n"
+           "      --seconds S      Stop after S seconds of input\n"
+           "      --pipe           Gate mono 44.1 kHz PCM from stdin to stdout, e.g.\n"
+           "                       between ffmpeg or sox; same as -b raw\n"
+           "      --format FMT     Raw sample format, f32 or s16 (default: f32)\n"
+           "      --rt             Run the DSP thread SCHED_FIFO with its memory\n"
+           "                       locked and denormals flushed; what was granted\n"
+           "                       is printed at startup\n"
+           "      --cpu N          Also pin the DSP thread to core N, or the workers\n"
+           "                       to cores from N (implies --rt)\n"
+           "      --measure-latency\n"
+           "                       Run chirps through the gate on a virtual sound\n"
+           "                       card and report algorithmic, buffering and total\n"
+           "                       latency; same as -b loopback. Needs no devices\n"
+           "      --trials N       Chirps to measure (default: %d)\n"
+           "      --no-adapt       With a device, keep block size and quality fixed\n"
+           "                       instead of moving larger blocks, then gating at\n"
+           "                       50%% overlap, then passing audio through while\n"
+           "                       blocks keep missing their deadline\n"
+           "      --daemon         Take commands on a control socket while running\n"
+           "      --socket PATH    Control socket (default: $XDG_RUNTIME_DIR/\n"
+           "                       noise_cancel.sock)\n"
+           "      --send CMD       Send a command to a running daemon and print\n"
+           "                       the reply: status, recapture, n_std_thresh X,\n"
+           "                       prop_decrease X (0-1) or n_fft N (%d-%d).\n"
+           "                       The gate delays audio by n_fft samples, so a\n"
+           "                       new n_fft changes the latency. The old and new\n"
+           "                       gates are lined up for the crossfade, then a\n"
+           "                       device's output replays or skips the difference;\n"
+           "                       a file or pipe stays aligned with its input\n"
+           "  -s, --source DEVICE  Capture from this PulseAudio source instead of\n"
+           "                       the default. Repeat for up to %d devices, each\n"
+           "                       with its own gate, virtual source (NAME_1,\n"
+           "                       _2, ...) and profile (PROFILE-DEVICE). A device\n"
+           "                       that fails is closed alone; the run ends with\n"
+           "                       the last one\n"
+           "      --name NAME      Name of the virtual source (default: " SOURCE_NAME ").\n"
+           "                       Each running instance needs its own\n"
+           "      --workers N      DSP threads shared by several sources (default:\n"
+           "                       one per source, up to the number of cores)\n"
+           "  -h, --help           Show this help message and exit\n\n"
+           "Send SIGUSR1 to capture a new noise profile while running.\n"
+           "Changes sent to the daemon apply between frames without\n"
+           "reopening any stream.\n"
+           "Block timing and throughput are printed on exit.\n",
+           prog, DEFAULT_LATENCY_MS, DEFAULT_TRIALS, MIN_N_FFT, MAX_N_FFT, MAX_SOURCES);
+}
 
-    if (setup_audio(&ctx) < 0) {
-        cleanup_audio(&ctx);
-        return 1;
+int main(int argc, char **argv) {
+    // The timing histograms are large for the stack
+    static audio_context sources[MAX_SOURCES];
+    static dsp_pool pool;
+    audio_context *ctx = &sources[0];  // Options, copied to every source
+    const char *devices[MAX_SOURCES];
+    int num_sources = 0;
+    int workers = 0;
+    const char *name = NULL;  // --name, for the virtual sources
+    bool recapture = false;
+    const char *backend_name = "pulse";
+    AudioBackendConfig config = {
+        .sample_rate = SAMPLE_RATE,
+        .latency_ms = DEFAULT_LATENCY_MS,
+        .trials = DEFAULT_TRIALS,
+        .lead_seconds = NOISE_SECONDS + 1
+    };
+    ctx->overlap = 75;
+    ctx->done_fd = -1;
+    ctx->retired_fd = -1;
+    ctx->rt_cpu = -1;
+
+    const char *home = getenv("HOME");
+    snprintf(ctx->profile_path, sizeof(ctx->profile_path), "%s/" PROFILE_FILE,
+             home ? home : ".");
+    bool profile_given = false;
+    bool adapt = true;
+    bool daemon = false;
+    char socket_path[sizeof(((struct sockaddr_un*)0)->sun_path)];
+    control_default_path("noise_cancel", socket_path, sizeof(socket_path));
+    const char *send_command = NULL;
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "-r") || !strcmp(argv[i], "--recapture")) {
+            recapture = true;
+        } else if ((!strcmp(argv[i], "-p") || !strcmp(argv[i], "--profile")) && i + 1 < argc) {
+            snprintf(ctx->profile_path, sizeof(ctx->profile_path), "%s", argv[++i]);
+            profile_given = true;
+        } else if (!strcmp(argv[i], "--overlap") && i + 1 < argc) {
+            ctx->overlap = atoi(argv[++i]);
+            if (ctx->overlap != 50 && ctx->overlap != 75) {
+                fprintf(stderr, "Overlap must be 50 or 75\n");
+                return 1;
+            }
+        } else if (!strcmp(argv[i], "--latency") && i + 1 < argc) {
+            config.latency_ms = atoi(argv[++i]);
+            if (config.latency_ms <= 0) {
+                fprintf(stderr, "Latency must be positive\n");
+                return 1;
+            }
+        } else if (!strcmp(argv[i], "--direct")) {
+            config.direct = true;
+        } else if (!strcmp(argv[i], "--backpressure") && i + 1 < argc) {
+            const char *policy = argv[++i];
+            if (!strcmp(policy, "drop")) {
+                config.backpressure = BACKPRESSURE_DROP;
+            } else if (!strcmp(policy, "stretch")) {
+                config.backpressure = BACKPRESSURE_STRETCH;
+            } else {
+                fprintf(stderr, "Backpressure policy must be drop or stretch\n");
+                return 1;
+            }
+        } else if (!strcmp(argv[i], "--pipe")) {
+            backend_name = "raw";
+        } else if (!strcmp(argv[i], "--format") && i + 1 < argc) {
+            const char *format = argv[++i];
+            if (!strcmp(format, "f32")) {
+                config.format = AUDIO_FORMAT_F32;
+            } else if (!strcmp(format, "s16")) {
+                config.format = AUDIO_FORMAT_S16;
+            } else {
+                fprintf(stderr, "Format must be f32 or s16\n");
+                return 1;
+            }
+        } else if ((!strcmp(argv[i], "-b") || !strcmp(argv[i], "--backend")) && i + 1 < argc) {
+            backend_name = argv[++i];
+        } else if ((!strcmp(argv[i], "-i") || !strcmp(argv[i], "--input")) && i + 1 < argc) {
+            config.input = argv[++i];
+        } else if ((!strcmp(argv[i], "-o") || !strcmp(argv[i], "--output")) && i + 1 < argc) {
+            config.output = argv[++i];
+        } else if (!strcmp(argv[i], "--seconds") && i + 1 < argc) {
+            double seconds = atof(argv[++i]);
+            if (seconds <= 0) {
+                fprintf(stderr, "Seconds must be positive\n");
+                return 1;
+            }
+            ctx->max_samples = (size_t)(seconds * SAMPLE_RATE);
+        } else if (!strcmp(argv[i], "--measure-latency")) {
+            backend_name = "loopback";
+        } else if (!strcmp(argv[i], "--trials") && i + 1 < argc) {
+            config.trials = atoi(argv[++i]);
+            if (config.trials <= 0) {
+                fprintf(stderr, "Trials must be positive\n");
+                return 1;
+            }
+        } else if (!strcmp(argv[i], "--no-adapt")) {
+            adapt = false;
+        } else if (!strcmp(argv[i], "--rt")) {
+            ctx->realtime = true;
+        } else if (!strcmp(argv[i], "--cpu") && i + 1 < argc) {
+            ctx->realtime = true;
+            ctx->rt_cpu = atoi(argv[++i]);
+            if (ctx->rt_cpu < 0 || ctx->rt_cpu >= sysconf(_SC_NPROCESSORS_CONF)) {
+                fprintf(stderr, "No CPU %s\n", argv[i]);
+                return 1;
+            }
+        } else if ((!strcmp(argv[i], "-s") || !strcmp(argv[i], "--source")) && i + 1 < argc) {
+            if (num_sources == MAX_SOURCES) {
+                fprintf(stderr, "At most %d sources\n", MAX_SOURCES);
+                return 1;
+            }
+            devices[num_sources++] = argv[++i];
+        } else if (!strcmp(argv[i], "--name") && i + 1 < argc) {
+            // It goes into module arguments and the FIFO's file name as is
+            name = argv[++i];
+            size_t length = strlen(name);
+            if (length == 0 || length > MAX_NAME_LENGTH ||
+                strspn(name, "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ"
+                       "0123456789_.-") != length) {
+                fprintf(stderr, "Name must be 1 to %d letters, digits, '_', '.' "
+                        "or '-'\n", MAX_NAME_LENGTH);
+                return 1;
+            }
+        } else if (!strcmp(argv[i], "--workers") && i + 1 < argc) {
+            workers = atoi(argv[++i]);
+            if (workers <= 0 || workers > MAX_SOURCES) {
+                fprintf(stderr, "Workers must be from 1 to %d\n", MAX_SOURCES);
+                return 1;
+            }
+        } else if (!strcmp(argv[i], "--daemon")) {
+            daemon = true;
+        } else if (!strcmp(argv[i], "--socket") && i + 1 < argc) {
+            snprintf(socket_path, sizeof(socket_path), "%s", argv[++i]);
+        } else if (!strcmp(argv[i], "--send") && i + 1 < argc) {
+            send_command = argv[++i];
+        } else if (!strcmp(argv[i], "-h") || !strcmp(argv[i], "--help")) {
+            usage(argv[0]);
+            return 0;
+        } else {
+            fprintf(stderr, "Unknown option '%s'\n", argv[i]);
+            usage(argv[0]);
+            return 1;
+        }
     }
 
-    // Compute initial noise profile
-    if (compute_noise_profile(&ctx) < 0) {
-        cleanup_audio(&ctx);
+    // Client mode: talk to the daemon and leave the audio alone
+    if (send_command)
+        return control_send(socket_path, send_command);
+
+    for (size_t i = 0; i < sizeof(backends) / sizeof(backends[0]); i++) {
+        if (!strcmp(backends[i]->name, backend_name))
+            ctx->backend.ops = backends[i];
+    }
+    if (!ctx->backend.ops) {
+        fprintf(stderr, "Unknown backend '%s'\n", backend_name);
+        return 1;
+    }
+    if (num_sources && ctx->backend.ops != &pulse_backend_ops) {
+        fprintf(stderr, "Sources are only chosen with the pulse backend\n");
         return 1;
     }
-    ctx.noise_profile_computed = true;
+    if (!num_sources)
+        devices[num_sources++] = NULL;  // The default one
+    // A profile measured from a file or from silence would replace the one
+    // for the microphone, so those are only kept when asked for. Files are
+    // for other tools, which expect output lined up with the input.
+    ctx->save_profile = ctx->backend.ops->realtime || profile_given;
+    ctx->align = !ctx->backend.ops->realtime;
+    // Only a device gives blocks a deadline
+    ctx->adapt.enabled = adapt && ctx->backend.ops->realtime;
+    // The loopback device's profile is of its own noise floor, which is
+    // where its signal starts
+    bool loopback = ctx->backend.ops == &loopback_backend;
+    if (loopback) {
+        recapture = true;
+        ctx->save_profile = false;
+    }
 
-    printf("Virtual device 'noise_cancelled' created.\n");
-    printf("To use it, select 'Null Output (noise_cancelled)' as your input source.\n");
+    // Signals are only seen through signal_fd, so the threads started below
+    // never get interrupted and cleanup runs on this thread
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    sigaddset(&signals, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
+    signal(SIGPIPE, SIG_IGN);  // A vanished pipe reader shows up as EPIPE
+    int signal_fd = signalfd(-1, &signals, SFD_CLOEXEC);
 
-    while (running) {
-        // Read from capture device
-        if (pa_simple_read(ctx.capture, ctx.buffer,
-                          ctx.buffer_frames * sizeof(float), &error) < 0) {
-            fprintf(stderr, "Read failed: %s\n", pa_strerror(error));
-            break;
+    // Every source gets the options, its own virtual source and, with
+    // several, its own profile and a label on its messages
+    for (int i = 1; i < num_sources; i++)
+        sources[i] = *ctx;
+    for (int i = 0; i < num_sources; i++) {
+        audio_context *source = &sources[i];
+        source->device = devices[i];
+        if (num_sources == 1) {
+            snprintf(source->source_name, sizeof(source->source_name), "%s",
+                     name ? name : SOURCE_NAME);
+            continue;
+        }
+        snprintf(source->source_name, sizeof(source->source_name), "%s_%d",
+                 name ? name : SOURCE_NAME, i + 1);
+        snprintf(source->label, sizeof(source->label), "[%s] ", source->source_name);
+        size_t length = strlen(source->profile_path);
+        snprintf(source->profile_path + length, sizeof(source->profile_path) - length,
+                 "-%s", devices[i]);
+        for (char *c = source->profile_path + length; *c; c++) {
+            if (*c == '/')
+                *c = '_';
+        }
+    }
+    source_list list = {sources, num_sources};
+    // One source keeps a DSP thread to itself; several share workers
+    dsp_pool *shared = NULL;
+    if (num_sources > 1) {
+        shared = &pool;
+        dsp_pool_init(shared, sources, num_sources);
+        shared->realtime = ctx->realtime;
+        shared->rt_cpu = ctx->rt_cpu;
+        if (!workers) {
+            long cores = sysconf(_SC_NPROCESSORS_ONLN);
+            workers = cores < num_sources ? (cores > 0 ? (int)cores : 1) : num_sources;
+        }
+    }
+
+    for (int i = 0; i < num_sources; i++) {
+        if (setup_gate(&sources[i]) < 0) {
+            cleanup_sources(&list, shared);
+            return 1;
+        }
+    }
+    ControlSocket control = {.listen_fd = -1};
+    if (daemon) {
+        if (!control_listen(&control, socket_path)) {
+            cleanup_sources(&list, shared);
+            return 1;
+        }
+        printf("Listening for commands on %s\n", socket_path);
+    }
+
+    for (int i = 0; i < num_sources; i++) {
+        audio_context *source = &sources[i];
+        AudioBackendConfig source_config = config;
+        char description[64];
+        source_config.block_frames = source->buffer_frames;
+        source_config.device = source->device;
+        source_config.source_name = source->source_name;
+        // A chosen name also tells the sources of several instances apart
+        if (name)
+            source_config.source_description = source->source_name;
+        if (num_sources > 1) {
+            if (!name) {
+                snprintf(description, sizeof(description), SOURCE_DESCRIPTION "-%d", i + 1);
+                source_config.source_description = description;
+            }
+            source_config.notify = dsp_pool_notify;
+            source_config.notify_userdata = source;
+        }
+        if (source->backend.ops->open(&source->backend, &source_config) < 0) {
+            control_close(&control);
+            cleanup_sources(&list, shared);
+            return 1;
         }
+    }
 
-        // Apply spectral gate
-        spectralgate_process(ctx.sg, ctx.buffer, ctx.output_buffer, ctx.buffer_frames);
+    // Reuse the saved noise profiles when possible, so audio flows at once.
+    // A file or pipe is measured from its own start unless -p names one.
+    bool measure = recapture || (!ctx->backend.ops->realtime && !profile_given);
+    for (int i = 0; i < num_sources; i++) {
+        if (measure || load_noise_profile(&sources[i]) < 0)
+            start_noise_capture(&sources[i]);
+    }
+    if (shared) {
+        if (!dsp_pool_start(shared, workers)) {
+            fprintf(stderr, "Failed to start DSP workers\n");
+            control_close(&control);
+            cleanup_sources(&list, shared);
+            return 1;
+        }
+        printf("%d sources on %d DSP worker%s\n", num_sources, workers,
+               workers > 1 ? "s" : "");
+    } else {
+        if (pthread_create(&ctx->dsp_thread, NULL, dsp_thread_main, ctx) != 0) {
+            fprintf(stderr, "Failed to start DSP thread\n");
+            control_close(&control);
+            cleanup_sources(&list, shared);
+            return 1;
+        }
+        ctx->dsp_started = true;
+    }
 
-        // Write to virtual device
-        if (pa_simple_write(ctx.playback, ctx.output_buffer,
-                           ctx.buffer_frames * sizeof(float), &error) < 0) {
-            fprintf(stderr, "Write failed: %s\n", pa_strerror(error));
+    // Signals, then each source's end and retired gates, then the control
+    // socket
+    struct pollfd fds[1 + 2 * MAX_SOURCES + 1 + CONTROL_CLIENTS];
+    fds[0] = (struct pollfd){.fd = signal_fd, .events = POLLIN};
+    for (int i = 0; i < num_sources; i++) {
+        fds[1 + i] = (struct pollfd){.fd = sources[i].done_fd, .events = POLLIN};
+        fds[1 + num_sources + i] =
+            (struct pollfd){.fd = sources[i].retired_fd, .events = POLLIN};
+    }
+    int control_fds = 1 + 2 * num_sources;
+    int running = num_sources;
+    int status = 0;
+    bool done = false;
+    while (!done) {
+        int nfds = control_fds;
+        if (daemon)
+            nfds += control_pollfds(&control, fds + control_fds);
+        if (poll(fds, nfds, -1) < 0) {
+            if (errno == EINTR)
+                continue;
             break;
         }
+        // A source that ends or fails is reported and closed on its own;
+        // the last one to go ends the run
+        for (int i = 0; i < num_sources; i++) {
+            if (!(fds[1 + i].revents & POLLIN))
+                continue;
+            fds[1 + i].fd = -1;  // Ignored by poll from now on
+            if (atomic_load(&sources[i].dsp_failed)) {
+                fprintf(stderr, "%sAudio stream failed\n", sources[i].label);
+                status = 1;
+            }
+            if (--running == 0)
+                done = true;
+            else
+                close_source(&sources[i], running);
+        }
+        if (done)
+            break;
+        struct signalfd_siginfo info;
+        if ((fds[0].revents & POLLIN) &&
+            read(signal_fd, &info, sizeof(info)) == sizeof(info)) {
+            if (info.ssi_signo != SIGUSR1)
+                break;
+            for (int i = 0; i < num_sources; i++) {
+                if (sources[i].closed)
+                    continue;
+                atomic_store(&sources[i].recapture, true);
+                sources[i].backend.ops->wake(&sources[i].backend);
+            }
+        }
+        for (int i = 0; i < num_sources; i++) {
+            if (fds[1 + num_sources + i].revents & POLLIN)
+                free_retired_gate(&sources[i]);
+        }
+        if (daemon)
+            control_service(&control, fds + control_fds, control_command, &list);
     }
+    control_close(&control);
 
-    cleanup_audio(&ctx);
-    return 0;
-}
\ No newline at end of file
+    // Stop the DSP loops before reading what they measured
+    if (shared) {
+        dsp_pool_stop(shared);
+    } else {
+        atomic_store(&ctx->dsp_stop, true);
+        ctx->backend.ops->wake(&ctx->backend);
+        pthread_join(ctx->dsp_thread, NULL);
+        ctx->dsp_started = false;
+    }
+
+    for (int i = 0; i < num_sources; i++) {
+        if (!sources[i].closed)
+            report_source(&sources[i], num_sources > 1);
+    }
+    if (loopback && !status)
+        status = report_latency(ctx);
+    cleanup_sources(&list, shared);
+    close(signal_fd);
+    return status;
+}
@@ -0,0 +1,246 @@
+#ifndef VOICETRAINER_NOISEPROFILE
+#define VOICETRAINER_NOISEPROFILE
+
+#include <fcntl.h>
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#include "spectralgate.h"
+
+// Saved noise profile: the spectral gate's per-bin Welford statistics and
+// the analysis geometry they were measured with, so the threshold can be
+// rebuilt without any FFTs. Profiles from older versions hold the raw
+// captured samples instead; those still load and are re-analyzed.
+//
+// Profiles are kept in a store under voice_dir, keyed by input device and
+// sample rate, with a few slots per key for different rooms. At startup a
+// short ambient snapshot is compared against every profile for the device
+// and the nearest one is used if it is close enough.
+
+#define NOISEPROFILE_MAGIC "VTNP"
+#define NOISEPROFILE_VERSION 1
+#define NOISESTORE_DIR ".noise_profiles"
+#define NOISESTORE_SLOTS 8      // Profiles kept per device
+#define NOISESTORE_MATCH_DB 3.0 // Max mean spectral distance for a match
+
+typedef struct {
+  char magic[4];
+  uint32_t version;
+  uint32_t sample_rate;
+  uint32_t n_fft;
+  uint32_t hop_length;
+  uint32_t win_length;
+  uint64_t frames; // Noise frames the statistics were accumulated over
+} NoiseProfileHeader;
+
+typedef struct {
+  NoiseProfileHeader header;
+  double *mean; // n_fft / 2 + 1 bins each
+  double *m2;
+  float *samples; // Legacy raw profile instead of statistics
+  size_t num_samples;
+} NoiseProfile;
+
+static inline void noiseprofile_free(NoiseProfile *np) {
+  free(np->mean);
+  free(np->m2);
+  free(np->samples);
+  memset(np, 0, sizeof(*np));
+}
+
+static inline bool noiseprofile_save(const char *path, const SpectralGate *sg) {
+  FILE *f = fopen(path, "wb");
+  if (!f)
+    return false;
+
+  NoiseProfileHeader header = {.version = NOISEPROFILE_VERSION,
+                               .sample_rate = (uint32_t)sg->sample_rate,
+                               .n_fft = (uint32_t)sg->n_fft,
+                               .hop_length = (uint32_t)sg->hop_length,
+                               .win_length = (uint32_t)sg->win_length,
+                               .frames = sg->noise_frames};
+  memcpy(header.magic, NOISEPROFILE_MAGIC, 4);
+  size_t bins = sg->n_fft / 2 + 1;
+  bool ok = fwrite(&header, sizeof(header), 1, f) == 1 &&
+            fwrite(sg->noise_mean, sizeof(double), bins, f) == bins &&
+            fwrite(sg->noise_m2, sizeof(double), bins, f) == bins;
+  return fclose(f) == 0 && ok;
+}
+
+static inline bool noiseprofile_load(const char *path, NoiseProfile *np) {
+  memset(np, 0, sizeof(*np));
+  FILE *f = fopen(path, "rb");
+  if (!f)
+    return false;
+
+  fseek(f, 0, SEEK_END);
+  long size = ftell(f);
+  fseek(f, 0, SEEK_SET);
+
+  bool ok = false;
+  if (size >= (long)sizeof(NoiseProfileHeader) &&
+      fread(&np->header, sizeof(np->header), 1, f) == 1 &&
+      !memcmp(np->header.magic, NOISEPROFILE_MAGIC, 4) &&
+      np->header.n_fft > 0 && np->header.n_fft <= 65536) {
+    size_t bins = np->header.n_fft / 2 + 1;
+    np->mean = (double *)malloc(bins * sizeof(double));
+    np->m2 = (double *)malloc(bins * sizeof(double));
+    ok = np->header.version == NOISEPROFILE_VERSION && np->mean && np->m2 &&
+         fread(np->mean, sizeof(double), bins, f) == bins &&
+         fread(np->m2, sizeof(double), bins, f) == bins;
+  } else if (size > (long)sizeof(size_t)) {
+    // Legacy profile: a frame count followed by the captured samples
+    fseek(f, 0, SEEK_SET);
+    size_t count;
+    if (fread(&count, sizeof(count), 1, f) == 1 &&
+        count == (size - sizeof(size_t)) / sizeof(float)) {
+      np->num_samples = count;
+      np->samples = (float *)malloc(count * sizeof(float));
+      ok = np->samples && fread(np->samples, sizeof(float), count, f) == count;
+    }
+  }
+
+  fclose(f);
+  if (!ok)
+    noiseprofile_free(np);
+  return ok;
+}
+
+// True if the profile can be used with this gate. Statistics only apply to
+// the geometry they were measured with.
+static inline bool noiseprofile_matches(const NoiseProfile *np,
+                                        const SpectralGate *sg) {
+  if (np->samples)
+    return true;
+  return np->header.sample_rate == (uint32_t)sg->sample_rate &&
+         np->header.n_fft == (uint32_t)sg->n_fft &&
+         np->header.hop_length == (uint32_t)sg->hop_length &&
+         np->header.win_length == (uint32_t)sg->win_length &&
+         np->header.frames > 0;
+}
+
+// Copy the gate's current statistics into np, replacing what it held
+static inline bool noiseprofile_from_gate(NoiseProfile *np,
+                                          const SpectralGate *sg) {
+  size_t bins = sg->n_fft / 2 + 1;
+  noiseprofile_free(np);
+  np->mean = (double *)malloc(bins * sizeof(double));
+  np->m2 = (double *)malloc(bins * sizeof(double));
+  if (!np->mean || !np->m2) {
+    noiseprofile_free(np);
+    return false;
+  }
+  memcpy(np->header.magic, NOISEPROFILE_MAGIC, 4);
+  np->header.version = NOISEPROFILE_VERSION;
+  np->header.sample_rate = (uint32_t)sg->sample_rate;
+  np->header.n_fft = (uint32_t)sg->n_fft;
+  np->header.hop_length = (uint32_t)sg->hop_length;
+  np->header.win_length = (uint32_t)sg->win_length;
+  np->header.frames = sg->noise_frames;
+  memcpy(np->mean, sg->noise_mean, bins * sizeof(double));
+  memcpy(np->m2, sg->noise_m2, bins * sizeof(double));
+  return true;
+}
+
+// Mean absolute difference in dB between the profile's mean noise spectrum
+// and the gate's current one. Both must have the gate's geometry.
+static inline double noiseprofile_distance(const NoiseProfile *np,
+                                           const SpectralGate *sg) {
+  int bins = sg->n_fft / 2 + 1;
+  double sum = 0.0;
+  for (int i = 0; i < bins; i++)
+    sum += fabs(20.0 * log10((np->mean[i] + 1e-9) /
+                             (sg->noise_mean[i] + 1e-9)));
+  return sum / bins;
+}
+
+// Load the profile's statistics into the gate and compute its threshold
+static inline void noiseprofile_apply(const NoiseProfile *np,
+                                      SpectralGate *sg) {
+  spectralgate_noise_reset(sg);
+  if (np->samples) {
+    spectralgate_noise_push(sg, np->samples, np->num_samples);
+  } else {
+    size_t bins = sg->n_fft / 2 + 1;
+    memcpy(sg->noise_mean, np->mean, bins * sizeof(double));
+    memcpy(sg->noise_m2, np->m2, bins * sizeof(double));
+    sg->noise_frames = np->header.frames;
+  }
+  spectralgate_noise_finish(sg);
+}
+
+// Store key for a device: its name with anything but [A-Za-z0-9-] replaced,
+// followed by the sample rate
+static inline void noisestore_key(const char *device, int sample_rate,
+                                  char *key, size_t size) {
+  size_t n = 0;
+  for (const char *c = device; *c && n + 1 < size; c++) {
+    bool plain = (*c >= 'a' && *c <= 'z') || (*c >= 'A' && *c <= 'Z') ||
+                 (*c >= '0' && *c <= '9') || *c == '-';
+    key[n++] = plain ? *c : '_';
+  }
+  key[n] = '\0';
+  snprintf(key + n, size - n, "-%d", sample_rate);
+}
+
+static inline void noisestore_path(const char *voice_dir, const char *key,
+                                   int slot, char *path, size_t size) {
+  snprintf(path, size, "%s/" NOISESTORE_DIR "/%s.%d.dat", voice_dir, key,
+           slot);
+}
+
+// Load every profile stored for key. profiles and slots hold
+// NOISESTORE_SLOTS entries; returns how many were loaded.
+static inline int noisestore_load(const char *voice_dir, const char *key,
+                                  NoiseProfile *profiles, int *slots) {
+  int count = 0;
+  char path[4096];
+  for (int slot = 0; slot < NOISESTORE_SLOTS; slot++) {
+    noisestore_path(voice_dir, key, slot, path, sizeof(path));
+    if (noiseprofile_load(path, &profiles[count]))
+      slots[count++] = slot;
+  }
+  return count;
+}
+
+// Save the gate's statistics in a free slot, or over the least recently
+// used profile. Returns the slot, or -1.
+static inline int noisestore_save(const char *voice_dir, const char *key,
+                                  const SpectralGate *sg) {
+  char path[4096];
+  snprintf(path, sizeof(path), "%s/" NOISESTORE_DIR, voice_dir);
+  mkdir(path, 0755);
+
+  int slot = 0;
+  time_t oldest = 0;
+  for (int i = 0; i < NOISESTORE_SLOTS; i++) {
+    struct stat st;
+    noisestore_path(voice_dir, key, i, path, sizeof(path));
+    if (stat(path, &st) != 0) {
+      slot = i;
+      break;
+    }
+    if (i == 0 || st.st_mtime < oldest) {
+      oldest = st.st_mtime;
+      slot = i;
+    }
+  }
+  noisestore_path(voice_dir, key, slot, path, sizeof(path));
+  return noiseprofile_save(path, sg) ? slot : -1;
+}
+
+// Mark a profile as used, so it is the last to be replaced
+static inline void noisestore_touch(const char *voice_dir, const char *key,
+                                    int slot) {
+  char path[4096];
+  noisestore_path(voice_dir, key, slot, path, sizeof(path));
+  utimensat(AT_FDCWD, path, NULL, 0);
+}
+
+#endif /* VOICETRAINER_NOISEPROFILE */
@@ -0,0 +1,167 @@
+#ifndef VOICETRAINER_PITCHTRACK
+#define VOICETRAINER_PITCHTRACK
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Per-hop analysis track written next to each take. The binary file is a
+// PitchTrackHeader followed by one fixed-size record per analysis hop.
+// frame_size is stored so that readers can skip fields they don't know about
+// and older tracks with fewer fields still load.
+
+#define PITCHTRACK_MAGIC "VTPT"
+#define PITCHTRACK_VERSION 3
+#define PITCHTRACK_EXT ".pitch"
+#define PITCHTRACK_CSV_EXT ".pitch.csv"
+
+typedef struct {
+  char magic[4];
+  uint32_t version;
+  uint32_t sample_rate;
+  uint32_t hop_size;
+  uint32_t frame_size; // sizeof(PitchFrame) of the writer
+} PitchTrackHeader;
+
+typedef struct {
+  float pitch;       // Raw detector output in Hz (0 when unvoiced)
+  float confidence;  // Detector confidence, 0..1
+  float rms;         // RMS level of the hop
+  float formants[3]; // F1-F3 in Hz (0 when not estimated), since version 2
+  // Since version 3
+  float jitter;      // Relative change between consecutive glottal periods
+  float shimmer;     // Relative change between consecutive period peaks
+  float hnr;         // Harmonics-to-noise ratio in dB (0 when unvoiced)
+  float cpp;         // Cepstral peak prominence in dB (0 when unvoiced)
+} PitchFrame;
+
+typedef struct {
+  FILE *bin;
+  FILE *csv;
+  PitchTrackHeader header;
+  size_t frames_written;
+} PitchTrack;
+
+// Replace the extension of audio_path (if any) with ext. Caller frees.
+static inline char *pitchtrack_path(const char *audio_path, const char *ext) {
+  const char *slash = strrchr(audio_path, '/');
+  const char *dot = strrchr(audio_path, '.');
+  size_t stem = (dot && (!slash || dot > slash)) ? (size_t)(dot - audio_path)
+                                                  : strlen(audio_path);
+  char *path = (char *)malloc(stem + strlen(ext) + 1);
+  if (!path)
+    return NULL;
+  memcpy(path, audio_path, stem);
+  strcpy(path + stem, ext);
+  return path;
+}
+
+static inline PitchTrack *pitchtrack_open(const char *audio_path,
+                                          uint32_t sample_rate,
+                                          uint32_t hop_size, bool csv) {
+  PitchTrack *pt = (PitchTrack *)calloc(1, sizeof(PitchTrack));
+  if (!pt)
+    return NULL;
+
+  char *bin_path = pitchtrack_path(audio_path, PITCHTRACK_EXT);
+  pt->bin = bin_path ? fopen(bin_path, "wb") : NULL;
+  free(bin_path);
+  if (!pt->bin) {
+    free(pt);
+    return NULL;
+  }
+
+  if (csv) {
+    char *csv_path = pitchtrack_path(audio_path, PITCHTRACK_CSV_EXT);
+    pt->csv = csv_path ? fopen(csv_path, "w") : NULL;
+    free(csv_path);
+    if (pt->csv)
+      fprintf(pt->csv, "time,pitch,confidence,rms,f1,f2,f3,"
+                       "jitter,shimmer,hnr,cpp\n");
+  }
+
+  memcpy(pt->header.magic, PITCHTRACK_MAGIC, 4);
+  pt->header.version = PITCHTRACK_VERSION;
+  pt->header.sample_rate = sample_rate;
+  pt->header.hop_size = hop_size;
+  pt->header.frame_size = sizeof(PitchFrame);
+  fwrite(&pt->header, sizeof(PitchTrackHeader), 1, pt->bin);
+  return pt;
+}
+
+static inline bool pitchtrack_write(PitchTrack *pt, const PitchFrame *frame) {
+  if (!pt)
+    return false;
+
+  if (pt->csv) {
+    double t = (double)pt->frames_written * pt->header.hop_size /
+               pt->header.sample_rate;
+    fprintf(pt->csv,
+            "%.4f,%.2f,%.3f,%.6f,%.0f,%.0f,%.0f,%.5f,%.5f,%.2f,%.2f\n", t,
+            frame->pitch, frame->confidence, frame->rms, frame->formants[0],
+            frame->formants[1], frame->formants[2], frame->jitter,
+            frame->shimmer, frame->hnr, frame->cpp);
+  }
+  pt->frames_written++;
+  return fwrite(frame, sizeof(PitchFrame), 1, pt->bin) == 1;
+}
+
+static inline void pitchtrack_close(PitchTrack *pt) {
+  if (!pt)
+    return;
+  fclose(pt->bin);
+  if (pt->csv)
+    fclose(pt->csv);
+  free(pt);
+}
+
+// Load a whole track. Returns a malloc'd array of *count frames, or NULL.
+static inline PitchFrame *pitchtrack_load(const char *path,
+                                          PitchTrackHeader *header,
+                                          size_t *count) {
+  FILE *f = fopen(path, "rb");
+  if (!f)
+    return NULL;
+
+  PitchTrackHeader hdr;
+  if (fread(&hdr, sizeof(hdr), 1, f) != 1 ||
+      memcmp(hdr.magic, PITCHTRACK_MAGIC, 4) != 0 || hdr.frame_size == 0) {
+    fclose(f);
+    return NULL;
+  }
+
+  fseek(f, 0, SEEK_END);
+  long end = ftell(f);
+  fseek(f, sizeof(hdr), SEEK_SET);
+  size_t n = (size_t)(end - (long)sizeof(hdr)) / hdr.frame_size;
+
+  PitchFrame *frames = (PitchFrame *)calloc(n ? n : 1, sizeof(PitchFrame));
+  char *record = (char *)malloc(hdr.frame_size);
+  if (!frames || !record) {
+    free(frames);
+    free(record);
+    fclose(f);
+    return NULL;
+  }
+
+  size_t keep =
+      hdr.frame_size < sizeof(PitchFrame) ? hdr.frame_size : sizeof(PitchFrame);
+  for (size_t i = 0; i < n; i++) {
+    if (fread(record, hdr.frame_size, 1, f) != 1) {
+      n = i;
+      break;
+    }
+    memcpy(&frames[i], record, keep);
+  }
+
+  free(record);
+  fclose(f);
+  if (header)
+    *header = hdr;
+  *count = n;
+  return frames;
+}
+
+#endif /* VOICETRAINER_PITCHTRACK */
@@ -0,0 +1,176 @@
+#ifndef VOICETRAINER_REALTIME
+#define VOICETRAINER_REALTIME
+
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <unistd.h>
+#if defined(__SSE__)
+#include <xmmintrin.h>
+#endif
+
+// Opt-in protection for a thread doing audio work, applied from the thread
+// itself: SCHED_FIFO, pinning to one core, denormals flushed to zero, and
+// its buffers faulted in and locked so the first touch of a page never
+// stalls a block. Each step may be refused without privileges; the status
+// records what was granted so it can be reported.
+//
+// SCHED_FIFO is requested directly. An unprivileged process may still get
+// it up to its RLIMIT_RTPRIO (e.g. "@audio - rtprio 95" in
+// /etc/security/limits.conf), so the soft limit is raised to the hard one
+// and the priority lowered to it if need be. Locking all memory faults in
+// every mapping, so it is only for processes without large reserved
+// buffers; it falls back to locking the given regions when RLIMIT_MEMLOCK
+// is too small.
+
+#define REALTIME_PRIORITY 70             // Default SCHED_FIFO priority
+#define REALTIME_STACK_BYTES (256 << 10) // Stack faulted in for the thread
+
+#ifndef MADV_POPULATE_WRITE
+#define MADV_POPULATE_WRITE 23
+#endif
+
+// Memory the thread will touch while running
+typedef struct {
+  void *data;
+  size_t bytes;
+} RealtimeRegion;
+
+typedef struct {
+  int priority;  // SCHED_FIFO priority asked for
+  int cpu;       // Core to pin the thread to, or -1
+  bool lock_all; // Lock all current memory, not just the regions
+} RealtimeConfig;
+
+typedef struct {
+  int priority; // Granted SCHED_FIFO priority, 0 if none
+  int sched_error;
+  bool locked_all;     // All current memory locked
+  size_t locked_bytes; // Otherwise, bytes of regions locked
+  int lock_error;
+  int cpu; // Core the thread is pinned to, or -1
+  int pin_error;
+  bool flush_denormals;
+} RealtimeStatus;
+
+// Make the given range resident and writable without changing its contents,
+// so other threads may already be using it. Returns whether it is also
+// locked.
+static inline bool realtime_prefault(void *data, size_t bytes) {
+  if (!data || !bytes)
+    return false;
+  size_t page = (size_t)sysconf(_SC_PAGESIZE);
+  uintptr_t start = (uintptr_t)data & ~(page - 1);
+  uintptr_t end = ((uintptr_t)data + bytes + page - 1) & ~(page - 1);
+  madvise((void *)start, end - start, MADV_POPULATE_WRITE);
+  return mlock((void *)start, end - start) == 0;
+}
+
+static __attribute__((noinline)) void realtime_prefault_stack(void) {
+  volatile char stack[REALTIME_STACK_BYTES];
+  for (size_t i = 0; i < sizeof(stack); i += 4096)
+    stack[i] = 0;
+}
+
+// Flush denormals to zero and treat denormal inputs as zero on this thread.
+// Decaying overlap-add tails and near-silent FFT bins otherwise hit the slow
+// path of every multiply.
+static inline bool realtime_flush_denormals(void) {
+#if defined(__SSE__)
+  _mm_setcsr(_mm_getcsr() | 0x8040); // FTZ | DAZ
+  return true;
+#elif defined(__aarch64__)
+  unsigned long fpcr;
+  __asm__ volatile("mrs %0, fpcr" : "=r"(fpcr));
+  __asm__ volatile("msr fpcr, %0" ::"r"(fpcr | (1UL << 24))); // FZ
+  return true;
+#else
+  return false;
+#endif
+}
+
+// Apply the configuration to the calling thread
+static inline void realtime_enter(const RealtimeConfig *config,
+                                  const RealtimeRegion *regions,
+                                  int num_regions, RealtimeStatus *status) {
+  memset(status, 0, sizeof(*status));
+  status->cpu = -1;
+  status->flush_denormals = realtime_flush_denormals();
+
+  if (config->cpu >= 0) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(config->cpu, &set);
+    status->pin_error =
+        pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    if (!status->pin_error)
+      status->cpu = config->cpu;
+  }
+
+  int priority = config->priority;
+  struct rlimit limit;
+  if (getrlimit(RLIMIT_RTPRIO, &limit) == 0 &&
+      limit.rlim_cur < limit.rlim_max) {
+    limit.rlim_cur = limit.rlim_max;
+    setrlimit(RLIMIT_RTPRIO, &limit);
+  }
+  struct sched_param param = {.sched_priority = priority};
+  status->sched_error =
+      pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+  if (status->sched_error == EPERM && getrlimit(RLIMIT_RTPRIO, &limit) == 0 &&
+      limit.rlim_cur > 0 && limit.rlim_cur < (rlim_t)priority) {
+    param.sched_priority = priority = (int)limit.rlim_cur;
+    status->sched_error =
+        pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+  }
+  if (!status->sched_error)
+    status->priority = priority;
+
+  realtime_prefault_stack();
+  if (config->lock_all) {
+    if (mlockall(MCL_CURRENT) == 0) {
+      status->locked_all = true;
+      return;
+    }
+    status->lock_error = errno;
+  }
+  for (int i = 0; i < num_regions; i++) {
+    if (realtime_prefault(regions[i].data, regions[i].bytes))
+      status->locked_bytes += regions[i].bytes;
+    else if (regions[i].data && !status->lock_error)
+      status->lock_error = errno;
+  }
+}
+
+static inline void realtime_print(const char *what,
+                                  const RealtimeStatus *status) {
+  printf("Real-time %s:\n", what);
+  if (status->priority)
+    printf("  SCHED_FIFO priority %d\n", status->priority);
+  else
+    printf("  SCHED_FIFO refused (%s); allow it with an rtprio limit\n",
+           strerror(status->sched_error));
+  if (status->locked_all)
+    printf("  All memory locked\n");
+  else if (status->lock_error)
+    printf("  Locking refused (%s); %zu KiB of buffers locked, the rest "
+           "faulted in\n",
+           strerror(status->lock_error), status->locked_bytes >> 10);
+  else
+    printf("  %zu KiB of buffers locked\n", status->locked_bytes >> 10);
+  if (status->cpu >= 0)
+    printf("  Pinned to CPU %d\n", status->cpu);
+  else if (status->pin_error)
+    printf("  Pinning refused (%s)\n", strerror(status->pin_error));
+  printf("  Denormals %s\n", status->flush_denormals
+                                  ? "flushed to zero"
+                                  : "not flushed (unsupported CPU)");
+}
+
+#endif /* VOICETRAINER_REALTIME */
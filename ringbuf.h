@@ -0,0 +1,102 @@
+#ifndef VOICETRAINER_RINGBUF
+#define VOICETRAINER_RINGBUF
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Single-producer, single-consumer ring of samples. The producer only moves
+// head and the consumer only moves tail, so neither side takes a lock or
+// waits for the other: a full ring makes the producer drop what doesn't fit
+// and an empty one hands the consumer less than it asked for. The capacity
+// is a power of two and the indices count samples forever, so wrapping is a
+// mask and full/empty are never ambiguous.
+
+typedef struct {
+  float *data;
+  size_t mask; // Capacity - 1
+  // On separate cache lines so the two threads don't share one
+  _Alignas(64) _Atomic size_t head; // Samples ever written
+  _Alignas(64) _Atomic size_t tail; // Samples ever read
+} RingBuf;
+
+// Room for at least min_capacity samples
+static inline bool ringbuf_init(RingBuf *rb, size_t min_capacity) {
+  size_t capacity = 1;
+  while (capacity < min_capacity)
+    capacity <<= 1;
+  rb->data = (float *)calloc(capacity, sizeof(float));
+  rb->mask = capacity - 1;
+  atomic_init(&rb->head, 0);
+  atomic_init(&rb->tail, 0);
+  return rb->data != NULL;
+}
+
+static inline void ringbuf_free(RingBuf *rb) {
+  free(rb->data);
+  rb->data = NULL;
+}
+
+// Samples ready for the consumer
+static inline size_t ringbuf_available(RingBuf *rb) {
+  return atomic_load_explicit(&rb->head, memory_order_acquire) -
+         atomic_load_explicit(&rb->tail, memory_order_relaxed);
+}
+
+// Producer: append up to count samples. Returns how many fit.
+static inline size_t ringbuf_write(RingBuf *rb, const float *src,
+                                   size_t count) {
+  size_t head = atomic_load_explicit(&rb->head, memory_order_relaxed);
+  size_t tail = atomic_load_explicit(&rb->tail, memory_order_acquire);
+  size_t space = rb->mask + 1 - (head - tail);
+  if (count > space)
+    count = space;
+
+  size_t pos = head & rb->mask;
+  size_t first = rb->mask + 1 - pos;
+  if (first > count)
+    first = count;
+  memcpy(rb->data + pos, src, first * sizeof(float));
+  memcpy(rb->data, src + first, (count - first) * sizeof(float));
+  atomic_store_explicit(&rb->head, head + count, memory_order_release);
+  return count;
+}
+
+// Consumer: take up to count samples. Returns how many there were.
+static inline size_t ringbuf_read(RingBuf *rb, float *dst, size_t count) {
+  size_t tail = atomic_load_explicit(&rb->tail, memory_order_relaxed);
+  size_t head = atomic_load_explicit(&rb->head, memory_order_acquire);
+  if (count > head - tail)
+    count = head - tail;
+
+  size_t pos = tail & rb->mask;
+  size_t first = rb->mask + 1 - pos;
+  if (first > count)
+    first = count;
+  memcpy(dst, rb->data + pos, first * sizeof(float));
+  memcpy(dst + first, rb->data, (count - first) * sizeof(float));
+  atomic_store_explicit(&rb->tail, tail + count, memory_order_release);
+  return count;
+}
+
+// Consumer: point at the samples up to the end of the buffer without taking
+// them, so they can be handed on in place. Returns how many there are.
+static inline size_t ringbuf_peek(RingBuf *rb, const float **data) {
+  size_t tail = atomic_load_explicit(&rb->tail, memory_order_relaxed);
+  size_t head = atomic_load_explicit(&rb->head, memory_order_acquire);
+  size_t pos = tail & rb->mask;
+  size_t count = head - tail;
+  if (count > rb->mask + 1 - pos)
+    count = rb->mask + 1 - pos;
+  *data = rb->data + pos;
+  return count;
+}
+
+// Consumer: take count samples that have been peeked or are being dropped
+static inline void ringbuf_consume(RingBuf *rb, size_t count) {
+  size_t tail = atomic_load_explicit(&rb->tail, memory_order_relaxed);
+  atomic_store_explicit(&rb->tail, tail + count, memory_order_release);
+}
+
+#endif /* VOICETRAINER_RINGBUF */
@@ -13,6 +13,13 @@
 #define DEFAULT_WIN_LENGTH 1024
 #define DEFAULT_N_STD_THRESH 1.5f
 #define DEFAULT_PROP_DECREASE 1.0f
+#define DEFAULT_QUIET_FRACTION 0.1f  // Share of frames taken as noise from a signal
+
+// A contiguous piece of a signal that may be stored in several pieces
+typedef struct {
+    const float *data;
+    size_t length;
+} AudioSpan;
 
 typedef struct {
     int n_fft;
@@ -26,7 +33,16 @@ typedef struct {
     // FFTW plans and buffers
     fftwf_plan forward_plan;
     fftwf_plan inverse_plan;
-    float *window;
+    float *window;            // Analysis window
+    float *synthesis_window;
+    float ola_gain;           // Overlap-add gain of the window pair
+    
+    // Offline frames can be gated two at a time: one frame in the real part
+    // and the next in the imaginary part of a single complex FFT
+    bool pack_frames;
+    fftwf_plan pair_forward_plan;
+    fftwf_plan pair_inverse_plan;
+    fftwf_complex *pair_buffer;    // n_fft complex samples, in place
     
     // Work buffers
     float *input_buffer;
@@ -36,6 +52,24 @@ typedef struct {
     
     // Noise profile
     float *noise_thresh;  // Frequency-domain threshold derived from noise
+    
+    // Running per-bin noise magnitude statistics (Welford), fed a block at a
+    // time by spectralgate_noise_push
+    size_t noise_frames;
+    double *noise_mean;
+    double *noise_m2;     // Sum of squared deviations from the mean
+    float *noise_pending; // Samples not yet consumed by a full frame
+    int noise_pending_length;
+    
+    // Streaming overlap-add state (spectralgate_stream). The accumulator and
+    // its weights cover the n_fft output samples due next whatever the hop,
+    // so the overlap can change mid-stream.
+    float *stream_input;   // Most recent n_fft input samples, then the hop being filled
+    float *stream_output;  // Overlap-add accumulator
+    float *stream_weight;  // Sum of analysis * synthesis window each sample has had
+    float *stream_ready;   // Finished output being handed out
+    int stream_fill;       // Input samples since the last frame
+    bool bypass;           // Window and overlap-add only, without gating
 } SpectralGate;
 
 // Create Hann window
@@ -47,20 +81,69 @@ static float* create_hann_window(int size) {
     return window;
 }
 
-SpectralGate* spectralgate_create(int sample_rate) {
+// Periodic sqrt-Hann window. Used for both analysis and synthesis, the pair
+// multiplies to a periodic Hann window, which sums to exactly 1 at 50% overlap.
+static float* create_sqrt_hann_window(int size) {
+    float *window = (float*)malloc(size * sizeof(float));
+    for (int i = 0; i < size; i++) {
+        window[i] = sinf(M_PI * i / size);
+    }
+    return window;
+}
+
+// Window pair for the current hop and the gain their overlap-add gives,
+// sum(analysis * synthesis) / hop
+static void build_windows(SpectralGate *sg) {
+    free(sg->window);
+    free(sg->synthesis_window);
+    if (sg->hop_length * 2 == sg->win_length) {
+        sg->window = create_sqrt_hann_window(sg->win_length);
+        sg->synthesis_window = create_sqrt_hann_window(sg->win_length);
+    } else {
+        sg->window = create_hann_window(sg->win_length);
+        sg->synthesis_window = create_hann_window(sg->win_length);
+    }
+    
+    double sum = 0.0;
+    for (int i = 0; i < sg->win_length; i++) {
+        sum += sg->window[i] * sg->synthesis_window[i];
+    }
+    sg->ola_gain = (float)(sum / sg->hop_length);
+}
+
+// Start a new stream: forget the input history and pending output. The
+// weights are those of the frames a silent past would have added, so the
+// stream fades in as its first frames arrive.
+void spectralgate_stream_reset(SpectralGate *sg) {
+    memset(sg->stream_input, 0, 2 * sg->n_fft * sizeof(float));
+    memset(sg->stream_output, 0, sg->n_fft * sizeof(float));
+    memset(sg->stream_ready, 0, sg->n_fft * sizeof(float));
+    for (int i = 0; i < sg->n_fft; i++) {
+        double sum = 0.0;
+        for (int k = i; k < sg->win_length; k += sg->hop_length) {
+            sum += sg->window[k] * sg->synthesis_window[k];
+        }
+        sg->stream_weight[i] = (float)sum;
+    }
+    sg->stream_fill = 0;
+}
+
+// A gate with an FFT size other than the default (a power of two), with the
+// window the same length and the default 75% overlap
+SpectralGate* spectralgate_create_sized(int sample_rate, int n_fft) {
     SpectralGate *sg = (SpectralGate*)calloc(1, sizeof(SpectralGate));
     
     // Initialize parameters with defaults
-    sg->n_fft = DEFAULT_N_FFT;
-    sg->hop_length = DEFAULT_HOP_LENGTH;
-    sg->win_length = DEFAULT_WIN_LENGTH;
+    sg->n_fft = n_fft;
+    sg->hop_length = n_fft * DEFAULT_HOP_LENGTH / DEFAULT_N_FFT;
+    sg->win_length = n_fft * DEFAULT_WIN_LENGTH / DEFAULT_N_FFT;
     sg->n_std_thresh = DEFAULT_N_STD_THRESH;
     sg->prop_decrease = DEFAULT_PROP_DECREASE;
     sg->sample_rate = sample_rate;
     sg->clip_noise = true;
     
-    // Create window function
-    sg->window = create_hann_window(sg->win_length);
+    // Create window functions
+    build_windows(sg);
     
     // Allocate work buffers
     sg->input_buffer = (float*)fftwf_malloc(sg->n_fft * sizeof(float));
@@ -68,25 +151,53 @@ SpectralGate* spectralgate_create(int sample_rate) {
     sg->magnitude_buffer = (float*)malloc((sg->n_fft/2 + 1) * sizeof(float));
     sg->phase_buffer = (float*)malloc((sg->n_fft/2 + 1) * sizeof(float));
     sg->noise_thresh = (float*)calloc(sg->n_fft/2 + 1, sizeof(float));
+    sg->noise_mean = (double*)calloc(sg->n_fft/2 + 1, sizeof(double));
+    sg->noise_m2 = (double*)calloc(sg->n_fft/2 + 1, sizeof(double));
+    sg->noise_pending = (float*)malloc(sg->n_fft * sizeof(float));
+    sg->stream_input = (float*)calloc(2 * sg->n_fft, sizeof(float));
+    sg->stream_output = (float*)calloc(sg->n_fft, sizeof(float));
+    sg->stream_weight = (float*)calloc(sg->n_fft, sizeof(float));
+    sg->stream_ready = (float*)calloc(sg->n_fft, sizeof(float));
     
     // Create FFTW plans
     sg->forward_plan = fftwf_plan_dft_r2c_1d(sg->n_fft, sg->input_buffer, sg->fft_buffer, FFTW_ESTIMATE);
     sg->inverse_plan = fftwf_plan_dft_c2r_1d(sg->n_fft, sg->fft_buffer, sg->input_buffer, FFTW_ESTIMATE);
+    sg->pair_buffer = (fftwf_complex*)fftwf_malloc(sg->n_fft * sizeof(fftwf_complex));
+    sg->pair_forward_plan = fftwf_plan_dft_1d(sg->n_fft, sg->pair_buffer, sg->pair_buffer,
+                                              FFTW_FORWARD, FFTW_ESTIMATE);
+    sg->pair_inverse_plan = fftwf_plan_dft_1d(sg->n_fft, sg->pair_buffer, sg->pair_buffer,
+                                              FFTW_BACKWARD, FFTW_ESTIMATE);
     
+    spectralgate_stream_reset(sg);
     return sg;
 }
 
+SpectralGate* spectralgate_create(int sample_rate) {
+    return spectralgate_create_sized(sample_rate, DEFAULT_N_FFT);
+}
+
 void spectralgate_destroy(SpectralGate *sg) {
     if (!sg) return;
     
     fftwf_destroy_plan(sg->forward_plan);
     fftwf_destroy_plan(sg->inverse_plan);
+    fftwf_destroy_plan(sg->pair_forward_plan);
+    fftwf_destroy_plan(sg->pair_inverse_plan);
+    fftwf_free(sg->pair_buffer);
     fftwf_free(sg->input_buffer);
     fftwf_free(sg->fft_buffer);
     free(sg->magnitude_buffer);
     free(sg->phase_buffer);
     free(sg->noise_thresh);
+    free(sg->noise_mean);
+    free(sg->noise_m2);
+    free(sg->noise_pending);
+    free(sg->stream_input);
+    free(sg->stream_output);
+    free(sg->stream_weight);
+    free(sg->stream_ready);
     free(sg->window);
+    free(sg->synthesis_window);
     free(sg);
 }
 
@@ -96,80 +207,360 @@ static void apply_window(float *buffer, const float *window, int size) {
     }
 }
 
+
+// Start a new noise estimate
+void spectralgate_noise_reset(SpectralGate *sg) {
+    sg->noise_frames = 0;
+    sg->noise_pending_length = 0;
+    memset(sg->noise_mean, 0, (sg->n_fft/2 + 1) * sizeof(double));
+    memset(sg->noise_m2, 0, (sg->n_fft/2 + 1) * sizeof(double));
+}
+
+// Choose the frame overlap, 75 or 50 percent. 75% uses Hann analysis and
+// synthesis windows; 50% uses a sqrt-Hann pair and needs half the FFTs per
+// second of audio, with somewhat different artifacts. The noise statistics
+// depend on the analysis window, so measure noise after this.
+bool spectralgate_set_overlap(SpectralGate *sg, int percent) {
+    if (percent != 50 && percent != 75) return false;
+    sg->hop_length = sg->win_length * (100 - percent) / 100;
+    build_windows(sg);
+    spectralgate_noise_reset(sg);
+    spectralgate_stream_reset(sg);
+    return true;
+}
+
+// Fold one windowed frame into the running statistics
+static void noise_accumulate_frame(SpectralGate *sg, const float *frame) {
+    memset(sg->input_buffer, 0, sg->n_fft * sizeof(float));
+    memcpy(sg->input_buffer, frame, sg->win_length * sizeof(float));
+    apply_window(sg->input_buffer, sg->window, sg->win_length);
+    
+    // Forward FFT
+    fftwf_execute(sg->forward_plan);
+    
+    // Welford update of the magnitude mean and squared deviations
+    sg->noise_frames++;
+    for (int i = 0; i < sg->n_fft/2 + 1; i++) {
+        double mag = cabsf(sg->fft_buffer[i]);
+        double delta = mag - sg->noise_mean[i];
+        sg->noise_mean[i] += delta / sg->noise_frames;
+        sg->noise_m2[i] += delta * (mag - sg->noise_mean[i]);
+    }
+}
+
+// Feed noise samples as they arrive. Frames are analyzed as soon as they are
+// complete, so only the last partial frame is ever kept.
+void spectralgate_noise_push(SpectralGate *sg, const float *samples, size_t count) {
+    while (count > 0) {
+        size_t n = sg->n_fft - sg->noise_pending_length;
+        if (n > count) n = count;
+        memcpy(sg->noise_pending + sg->noise_pending_length, samples, n * sizeof(float));
+        sg->noise_pending_length += n;
+        samples += n;
+        count -= n;
+        
+        if (sg->noise_pending_length == sg->n_fft) {
+            noise_accumulate_frame(sg, sg->noise_pending);
+            memmove(sg->noise_pending, sg->noise_pending + sg->hop_length,
+                    (sg->n_fft - sg->hop_length) * sizeof(float));
+            sg->noise_pending_length -= sg->hop_length;
+        }
+    }
+}
+
+// Turn the statistics into the threshold mean + n_std_thresh * std
+void spectralgate_noise_finish(SpectralGate *sg) {
+    for (int i = 0; i < sg->n_fft/2 + 1; i++) {
+        double var = sg->noise_frames ? sg->noise_m2[i] / sg->noise_frames : 0.0;
+        sg->noise_thresh[i] = (float)(sg->noise_mean[i] + sg->n_std_thresh * sqrt(var));
+    }
+}
+
+static double window_energy(const float *window, int size) {
+    double sum = 0.0;
+    for (int i = 0; i < size; i++) {
+        sum += window[i] * window[i];
+    }
+    return sum;
+}
+
+// Normalize the oldest hop of the accumulator, which has seen all its frames,
+// into the output handed out while the next hop of input arrives
+static void stream_finish_hop(SpectralGate *sg) {
+    for (int i = 0; i < sg->hop_length; i++) {
+        float weight = sg->stream_weight[i];
+        sg->stream_ready[i] = weight > 0.0f ? sg->stream_output[i] / weight : 0.0f;
+    }
+}
+
+// Change the overlap of a running stream, keeping its noise statistics. For
+// noise, bin magnitudes scale with the root of the analysis window's energy,
+// so the statistics are rescaled rather than measured again. Output samples
+// that frames of both hops overlap are normalized by the windows they
+// actually had, so the change leaves no seam. Only possible between frames:
+// returns false while the stream is part way through one, so try again after
+// the next block.
+bool spectralgate_stream_set_overlap(SpectralGate *sg, int percent) {
+    if ((percent != 50 && percent != 75) || sg->stream_fill != 0) return false;
+    int hop = sg->win_length * (100 - percent) / 100;
+    if (hop == sg->hop_length) return true;
+    
+    double old_energy = window_energy(sg->window, sg->win_length);
+    sg->hop_length = hop;
+    build_windows(sg);
+    double scale = sqrt(window_energy(sg->window, sg->win_length) / old_energy);
+    for (int i = 0; i < sg->n_fft/2 + 1; i++) {
+        sg->noise_mean[i] *= scale;
+        sg->noise_m2[i] *= scale * scale;
+    }
+    spectralgate_noise_finish(sg);
+    
+    // The next hop of output is due now; a longer one includes samples that
+    // will see no more frames
+    stream_finish_hop(sg);
+    return true;
+}
+
+// Take over another gate's noise statistics and rebuild the threshold with
+// this gate's n_std_thresh. A different FFT size is bridged by interpolating
+// each bin's mean and deviation at its frequency, rescaled like an overlap
+// change for the window's energy.
+void spectralgate_noise_copy(SpectralGate *dst, const SpectralGate *src) {
+    double scale = sqrt(window_energy(dst->window, dst->win_length) /
+                        window_energy(src->window, src->win_length));
+    int src_bins = src->n_fft/2 + 1;
+    dst->noise_frames = src->noise_frames;
+    for (int i = 0; i < dst->n_fft/2 + 1; i++) {
+        double x = (double)i * src->n_fft / dst->n_fft;
+        int k = (int)x;
+        if (k >= src_bins - 1) k = src_bins - 2;
+        double t = x - k;
+        double mean = src->noise_mean[k] + t * (src->noise_mean[k + 1] - src->noise_mean[k]);
+        double sd = sqrt(src->noise_m2[k]) + t * (sqrt(src->noise_m2[k + 1]) - sqrt(src->noise_m2[k]));
+        dst->noise_mean[i] = mean * scale;
+        dst->noise_m2[i] = sd * sd * scale * scale;
+    }
+    spectralgate_noise_finish(dst);
+}
+
+// Continue another gate's stream without a seam. Both must have the same
+// geometry and be between frames.
+void spectralgate_stream_copy(SpectralGate *dst, const SpectralGate *src) {
+    memcpy(dst->stream_input, src->stream_input, 2 * src->n_fft * sizeof(float));
+    memcpy(dst->stream_output, src->stream_output, src->n_fft * sizeof(float));
+    memcpy(dst->stream_weight, src->stream_weight, src->n_fft * sizeof(float));
+    memcpy(dst->stream_ready, src->stream_ready, src->n_fft * sizeof(float));
+    dst->stream_fill = src->stream_fill;
+}
+
 // Compute noise threshold from noise sample
 void spectralgate_compute_noise_thresh(SpectralGate *sg, float *noise_data, int noise_length) {
-    int num_frames = 1 + (noise_length - sg->n_fft) / sg->hop_length;
-    float *mean = (float*)calloc(sg->n_fft/2 + 1, sizeof(float));
-    float *sq_mean = (float*)calloc(sg->n_fft/2 + 1, sizeof(float));
+    spectralgate_noise_reset(sg);
+    spectralgate_noise_push(sg, noise_data, noise_length);
+    spectralgate_noise_finish(sg);
+}
+
+// Copy count samples starting at offset out of a list of spans
+static void gather_spans(const AudioSpan *spans, int num_spans, size_t offset,
+                         float *dst, size_t count) {
+    for (int s = 0; s < num_spans && count > 0; s++) {
+        if (offset >= spans[s].length) {
+            offset -= spans[s].length;
+            continue;
+        }
+        size_t n = spans[s].length - offset;
+        if (n > count) n = count;
+        memcpy(dst, spans[s].data + offset, n * sizeof(float));
+        dst += n;
+        count -= n;
+        offset = 0;
+    }
+}
+
+// k-th smallest of values[0..n), 0-based. Hoare's selection, expected O(n);
+// values is partially reordered so that values[0..k) <= values[k].
+static float select_kth(float *values, long n, long k) {
+    long lo = 0, hi = n - 1;
+    while (lo < hi) {
+        float pivot = values[lo + (hi - lo) / 2];
+        long i = lo, j = hi;
+        while (i <= j) {
+            while (values[i] < pivot) i++;
+            while (values[j] > pivot) j--;
+            if (i <= j) {
+                float t = values[i];
+                values[i++] = values[j];
+                values[j--] = t;
+            }
+        }
+        if (k <= j) hi = j;
+        else if (k >= i) lo = i;
+        else break;
+    }
+    return values[k];
+}
+
+// Measure the noise from the signal itself: the given fraction of frames with
+// the least energy go through the usual statistics. Frames of digital silence
+// are not noise and are skipped. By Parseval a frame's windowed energy ranks
+// it exactly as its spectrum would, so only the selected frames are
+// transformed. Returns the number of frames used.
+size_t spectralgate_noise_from_quietest(SpectralGate *sg, const AudioSpan *spans, int num_spans,
+                                        int input_size, float fraction) {
+    spectralgate_noise_reset(sg);
+    int num_frames = input_size >= sg->n_fft ? 1 + (input_size - sg->n_fft) / sg->hop_length : 0;
+    float *energy = (float*)malloc((num_frames + 1) * sizeof(float));
+    float *candidates = (float*)malloc((num_frames + 1) * sizeof(float));
+    long num_candidates = 0;
+    if (!energy || !candidates) num_frames = 0;
     
-    // Process noise frames
     for (int frame = 0; frame < num_frames; frame++) {
-        // Copy and window frame
-        memset(sg->input_buffer, 0, sg->n_fft * sizeof(float));
-        memcpy(sg->input_buffer, noise_data + frame * sg->hop_length, 
-               sg->win_length * sizeof(float));
-        apply_window(sg->input_buffer, sg->window, sg->win_length);
-        
-        // Forward FFT
-        fftwf_execute(sg->forward_plan);
+        gather_spans(spans, num_spans, (size_t)frame * sg->hop_length, sg->noise_pending, sg->win_length);
+        double sum = 0.0;
+        for (int i = 0; i < sg->win_length; i++) {
+            float x = sg->noise_pending[i] * sg->window[i];
+            sum += x * x;
+        }
+        energy[frame] = (float)sum;
+        if (sum > 0.0) candidates[num_candidates++] = (float)sum;
+    }
+    
+    size_t used = 0;
+    if (num_candidates > 0) {
+        long k = (long)(num_candidates * fraction);
+        if (k < 1) k = 1;
+        float cutoff = select_kth(candidates, num_candidates, k - 1);
+        // Frames tied with the cutoff fill whatever the quieter ones leave
+        long ties = k;
+        for (long i = 0; i < k; i++)
+            if (candidates[i] < cutoff) ties--;
         
-        // Accumulate magnitude statistics
-        for (int i = 0; i < sg->n_fft/2 + 1; i++) {
-            float mag = cabsf(sg->fft_buffer[i]);
-            mean[i] += mag;
-            sq_mean[i] += mag * mag;
+        for (int frame = 0; frame < num_frames; frame++) {
+            float e = energy[frame];
+            if (e <= 0.0f || e > cutoff || (e == cutoff && ties-- <= 0)) continue;
+            gather_spans(spans, num_spans, (size_t)frame * sg->hop_length, sg->noise_pending, sg->win_length);
+            noise_accumulate_frame(sg, sg->noise_pending);
+            used++;
         }
     }
     
-    // Compute threshold as mean + n_std_thresh * std
+    free(energy);
+    free(candidates);
+    spectralgate_noise_finish(sg);
+    return used;
+}
+
+// Gain for a bin of the given magnitude
+static inline float gate_mask(const SpectralGate *sg, float mag, int bin) {
+    float mask = (mag > sg->noise_thresh[bin]) ? 1.0f : sg->prop_decrease;
+    if (sg->clip_noise && mask < 1.0f) mask = 0.0f;
+    return mask;
+}
+
+// Gate the frame in input_buffer in place: analysis window, mask, inverse FFT
+// and synthesis window. The result is still scaled by n_fft.
+static void gate_frame(SpectralGate *sg) {
+    apply_window(sg->input_buffer, sg->window, sg->win_length);
+    
+    // Forward FFT
+    fftwf_execute(sg->forward_plan);
+    
+    // Apply spectral gating. The mask is real, so scaling the bin keeps its
+    // phase.
     for (int i = 0; i < sg->n_fft/2 + 1; i++) {
-        mean[i] /= num_frames;
-        sq_mean[i] /= num_frames;
-        float var = sq_mean[i] - mean[i] * mean[i];
-        float std = sqrtf(var > 0 ? var : 0);
-        sg->noise_thresh[i] = mean[i] + sg->n_std_thresh * std;
+        sg->fft_buffer[i] *= gate_mask(sg, cabsf(sg->fft_buffer[i]), i);
     }
     
-    free(mean);
-    free(sq_mean);
+    // Inverse FFT
+    fftwf_execute(sg->inverse_plan);
+    apply_window(sg->input_buffer, sg->synthesis_window, sg->win_length);
 }
 
-void spectralgate_process(SpectralGate *sg, float *input, float *output, int input_size) {
+// Gate two frames with one complex FFT each way. pair_buffer holds frame a
+// in the real part and frame b in the imaginary part (win_length samples,
+// zero-padded to n_fft). With Z the transform of a + ib, conjugate symmetry
+// of the real frames separates the spectra:
+//   A[k] = (Z[k] + conj(Z[N-k])) / 2,  B[k] = (Z[k] - conj(Z[N-k])) / 2i
+// Both are masked, and A' + iB' is rebuilt over all N bins so the inverse
+// returns the gated frames in the real and imaginary parts again. The result
+// is windowed and, like gate_frame's, still scaled by n_fft.
+static void gate_frame_pair(SpectralGate *sg) {
+    int n = sg->n_fft;
+    fftwf_complex *z = sg->pair_buffer;
+    for (int i = 0; i < sg->win_length; i++) {
+        z[i] *= sg->window[i];
+    }
+    fftwf_execute(sg->pair_forward_plan);
+    
+    // Written out in real arithmetic: complex products by I go through the
+    // slow, NaN-checking library multiply otherwise
+    for (int k = 0; k <= n/2; k++) {
+        float zr = crealf(z[k]), zi = cimagf(z[k]);
+        float cr = crealf(z[(n - k) % n]), ci = cimagf(z[(n - k) % n]);
+        float ar = 0.5f * (zr + cr), ai = 0.5f * (zi - ci);
+        float br = 0.5f * (zi + ci), bi = 0.5f * (cr - zr);
+        float ma = gate_mask(sg, sqrtf(ar * ar + ai * ai), k);
+        float mb = gate_mask(sg, sqrtf(br * br + bi * bi), k);
+        ar *= ma;
+        ai *= ma;
+        br *= mb;
+        bi *= mb;
+        z[k] = (ar - bi) + (ai + br) * I;
+        if (k > 0 && k < n/2) z[n - k] = (ar + bi) + (br - ai) * I;
+    }
+    
+    fftwf_execute(sg->pair_inverse_plan);
+    for (int i = 0; i < sg->win_length; i++) {
+        z[i] *= sg->synthesis_window[i];
+    }
+}
+
+// Like spectralgate_process, but the input is the concatenation of spans.
+// Frames are gathered straight into the FFT buffer, so the spans never need
+// to be joined into one buffer.
+void spectralgate_process_spans(SpectralGate *sg, const AudioSpan *spans, int num_spans,
+                                float *output, int input_size) {
     int num_frames = 1 + (input_size - sg->n_fft) / sg->hop_length;
     
     // Zero output buffer
     memset(output, 0, input_size * sizeof(float));
     
-    // Process frame by frame
+    // Process frame by frame, or two at a time when packing
     for (int frame = 0; frame < num_frames; frame++) {
         int frame_start = frame * sg->hop_length;
         
-        // Copy and window input frame
-        memset(sg->input_buffer, 0, sg->n_fft * sizeof(float));
-        memcpy(sg->input_buffer, input + frame_start, sg->win_length * sizeof(float));
-        apply_window(sg->input_buffer, sg->window, sg->win_length);
-        
-        // Forward FFT
-        fftwf_execute(sg->forward_plan);
-        
-        // Apply spectral gating
-        for (int i = 0; i < sg->n_fft/2 + 1; i++) {
-            float mag = cabsf(sg->fft_buffer[i]);
-            float phase = cargf(sg->fft_buffer[i]);
-            
-            // Apply threshold
-            float mask = (mag > sg->noise_thresh[i]) ? 1.0f : sg->prop_decrease;
-            if (sg->clip_noise && mask < 1.0f) mask = 0.0f;
+        if (sg->pack_frames && frame + 1 < num_frames) {
+            int next_start = frame_start + sg->hop_length;
+            memset(sg->input_buffer, 0, sg->n_fft * sizeof(float));
+            gather_spans(spans, num_spans, frame_start, sg->input_buffer, sg->win_length);
+            for (int i = 0; i < sg->n_fft; i++) {
+                sg->pair_buffer[i] = sg->input_buffer[i];
+            }
+            memset(sg->input_buffer, 0, sg->n_fft * sizeof(float));
+            gather_spans(spans, num_spans, next_start, sg->input_buffer, sg->win_length);
+            for (int i = 0; i < sg->win_length; i++) {
+                sg->pair_buffer[i] += sg->input_buffer[i] * I;
+            }
+            gate_frame_pair(sg);
             
-            // Apply mask and reconstruct complex spectrum
-            sg->fft_buffer[i] = (mag * mask) * (cosf(phase) + I * sinf(phase));
+            for (int i = 0; i < sg->n_fft; i++) {
+                if (frame_start + i < input_size) {
+                    output[frame_start + i] += crealf(sg->pair_buffer[i]) / sg->n_fft;
+                }
+                if (next_start + i < input_size) {
+                    output[next_start + i] += cimagf(sg->pair_buffer[i]) / sg->n_fft;
+                }
+            }
+            frame++;
+            continue;
         }
         
-        // Inverse FFT
-        fftwf_execute(sg->inverse_plan);
+        // Copy input frame and gate it
+        memset(sg->input_buffer, 0, sg->n_fft * sizeof(float));
+        gather_spans(spans, num_spans, frame_start, sg->input_buffer, sg->win_length);
+        gate_frame(sg);
         
-        // Apply window and accumulate output
-        apply_window(sg->input_buffer, sg->window, sg->win_length);
+        // Accumulate output
         for (int i = 0; i < sg->n_fft; i++) {
             if (frame_start + i < input_size) {
                 output[frame_start + i] += sg->input_buffer[i] / sg->n_fft;
@@ -178,9 +569,61 @@ void spectralgate_process(SpectralGate *sg, float *input, float *output, int inp
     }
     
     // Normalize for overlap-add
-    float normalization = (float)sg->n_fft / (float)sg->hop_length / 2.0f;
     for (int i = 0; i < input_size; i++) {
-        output[i] /= normalization;
+        output[i] /= sg->ola_gain;
+    }
+}
+
+void spectralgate_process(SpectralGate *sg, float *input, float *output, int input_size) {
+    AudioSpan span = {input, (size_t)input_size};
+    spectralgate_process_spans(sg, &span, 1, output, input_size);
+}
+
+// Gate a continuous stream block by block, for live audio. Blocks may be any
+// size; a frame is gated every hop_length samples. Output lags the input by
+// n_fft samples, and frames overlap across block boundaries.
+void spectralgate_stream(SpectralGate *sg, const float *input, float *output, int count) {
+    int hop = sg->hop_length, keep = sg->n_fft - hop;
+    while (count > 0) {
+        int n = hop - sg->stream_fill;
+        if (n > count) n = count;
+        memcpy(sg->stream_input + sg->n_fft + sg->stream_fill, input, n * sizeof(float));
+        memcpy(output, sg->stream_ready + sg->stream_fill, n * sizeof(float));
+        sg->stream_fill += n;
+        input += n;
+        output += n;
+        count -= n;
+        
+        if (sg->stream_fill == hop) {
+            memmove(sg->stream_input, sg->stream_input + hop, sg->n_fft * sizeof(float));
+            memcpy(sg->input_buffer, sg->stream_input, sg->win_length * sizeof(float));
+            memset(sg->input_buffer + sg->win_length, 0, (sg->n_fft - sg->win_length) * sizeof(float));
+            float scale = 1.0f / sg->n_fft;
+            if (sg->bypass) {
+                // The window pair alone rebuilds the input exactly, so
+                // bypassing costs no FFTs and switching fades over a window
+                apply_window(sg->input_buffer, sg->window, sg->win_length);
+                apply_window(sg->input_buffer, sg->synthesis_window, sg->win_length);
+                scale = 1.0f;
+            } else {
+                gate_frame(sg);
+            }
+            
+            // Slide the accumulator past the hop just handed out, then add
+            // the frame and the window weight it brings
+            memmove(sg->stream_output, sg->stream_output + hop, keep * sizeof(float));
+            memset(sg->stream_output + keep, 0, hop * sizeof(float));
+            memmove(sg->stream_weight, sg->stream_weight + hop, keep * sizeof(float));
+            memset(sg->stream_weight + keep, 0, hop * sizeof(float));
+            for (int i = 0; i < sg->n_fft; i++) {
+                sg->stream_output[i] += sg->input_buffer[i] * scale;
+            }
+            for (int i = 0; i < sg->win_length; i++) {
+                sg->stream_weight[i] += sg->window[i] * sg->synthesis_window[i];
+            }
+            stream_finish_hop(sg);
+            sg->stream_fill = 0;
+        }
     }
 }
 
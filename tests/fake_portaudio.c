@@ -0,0 +1,150 @@
+// A stand-in for libportaudio so voice can run without a sound card. Link it
+// instead of -lportaudio. There is one input and one output device; each
+// started stream calls its callback from its own thread at real-time pace.
+// Input is faint noise for the first second of a stream, then a 150 Hz tone
+// with the noise under it. Output is discarded.
+
+#include <math.h>
+#include <portaudio.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define FAKE_SAMPLE_RATE 44100
+#define FAKE_MAX_FRAMES 4096
+
+typedef struct {
+  PaStreamCallback *callback;
+  PaStreamFinishedCallback *finished;
+  void *userData;
+  unsigned long frames_per_buffer;
+  int input_channels;
+  int output_channels;
+  long position;
+  float input[FAKE_MAX_FRAMES];
+  float output[2 * FAKE_MAX_FRAMES];
+  pthread_t thread;
+  atomic_bool running;
+} FakeStream;
+
+static const PaDeviceInfo fake_devices[2] = {
+    {.structVersion = 2,
+     .name = "Fake Microphone",
+     .maxInputChannels = 1,
+     .defaultLowInputLatency = 0.01,
+     .defaultHighInputLatency = 0.1,
+     .defaultSampleRate = FAKE_SAMPLE_RATE},
+    {.structVersion = 2,
+     .name = "Fake Speaker",
+     .maxOutputChannels = 2,
+     .defaultLowOutputLatency = 0.01,
+     .defaultHighOutputLatency = 0.1,
+     .defaultSampleRate = FAKE_SAMPLE_RATE},
+};
+
+PaError Pa_Initialize(void) { return paNoError; }
+PaError Pa_Terminate(void) { return paNoError; }
+
+const char *Pa_GetErrorText(PaError errorCode) {
+  return errorCode == paNoError ? "Success" : "Fake PortAudio error";
+}
+
+PaDeviceIndex Pa_GetDefaultInputDevice(void) { return 0; }
+PaDeviceIndex Pa_GetDefaultOutputDevice(void) { return 1; }
+
+const PaDeviceInfo *Pa_GetDeviceInfo(PaDeviceIndex device) {
+  return device >= 0 && device < 2 ? &fake_devices[device] : NULL;
+}
+
+static void *fake_stream_thread(void *arg) {
+  FakeStream *s = (FakeStream *)arg;
+  unsigned int seed = 1;
+  PaStreamCallbackTimeInfo time_info = {0};
+  long period_ns = (long)(1e9 * s->frames_per_buffer / FAKE_SAMPLE_RATE);
+  struct timespec next;
+  clock_gettime(CLOCK_MONOTONIC, &next);
+
+  while (atomic_load(&s->running)) {
+    for (unsigned long i = 0; i < s->frames_per_buffer; i++) {
+      double t = (double)(s->position + i) / FAKE_SAMPLE_RATE;
+      float noise = 0.01f * ((float)rand_r(&seed) / RAND_MAX - 0.5f);
+      s->input[i] = noise + (t >= 1.0 ? 0.3f * sinf(2.0f * M_PI * 150.0f * t)
+                                   : 0.0f);
+    }
+    s->position += s->frames_per_buffer;
+    int result = s->callback(s->input_channels ? s->input : NULL,
+                             s->output_channels ? s->output : NULL,
+                             s->frames_per_buffer, &time_info, 0, s->userData);
+    if (result != paContinue)
+      break;
+
+    next.tv_nsec += period_ns;
+    while (next.tv_nsec >= 1000000000L) {
+      next.tv_nsec -= 1000000000L;
+      next.tv_sec++;
+    }
+    clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+  }
+
+  if (s->finished)
+    s->finished(s->userData);
+  return NULL;
+}
+
+PaError Pa_OpenStream(PaStream **stream,
+                      const PaStreamParameters *inputParameters,
+                      const PaStreamParameters *outputParameters,
+                      double sampleRate, unsigned long framesPerBuffer,
+                      PaStreamFlags streamFlags,
+                      PaStreamCallback *streamCallback, void *userData) {
+  (void)sampleRate;
+  (void)streamFlags;
+  if (!streamCallback || framesPerBuffer > FAKE_MAX_FRAMES)
+    return paInvalidFlag;
+  FakeStream *s = (FakeStream *)calloc(1, sizeof(FakeStream));
+  if (!s)
+    return paInsufficientMemory;
+  s->callback = streamCallback;
+  s->userData = userData;
+  s->frames_per_buffer = framesPerBuffer ? framesPerBuffer : 512;
+  s->input_channels = inputParameters ? inputParameters->channelCount : 0;
+  s->output_channels = outputParameters ? outputParameters->channelCount : 0;
+  *stream = s;
+  return paNoError;
+}
+
+PaError Pa_SetStreamFinishedCallback(
+    PaStream *stream, PaStreamFinishedCallback *streamFinishedCallback) {
+  ((FakeStream *)stream)->finished = streamFinishedCallback;
+  return paNoError;
+}
+
+PaError Pa_StartStream(PaStream *stream) {
+  FakeStream *s = (FakeStream *)stream;
+  if (atomic_exchange(&s->running, true))
+    return paStreamIsNotStopped;
+  if (pthread_create(&s->thread, NULL, fake_stream_thread, s) != 0) {
+    atomic_store(&s->running, false);
+    return paInternalError;
+  }
+  return paNoError;
+}
+
+// Like PortAudio, the finished callback has run by the time this returns
+PaError Pa_StopStream(PaStream *stream) {
+  FakeStream *s = (FakeStream *)stream;
+  if (!atomic_exchange(&s->running, false))
+    return paStreamIsStopped;
+  pthread_join(s->thread, NULL);
+  return paNoError;
+}
+
+PaError Pa_AbortStream(PaStream *stream) { return Pa_StopStream(stream); }
+
+PaError Pa_CloseStream(PaStream *stream) {
+  Pa_StopStream(stream);
+  free(stream);
+  return paNoError;
+}
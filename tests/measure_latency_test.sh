@@ -0,0 +1,44 @@
+#!/bin/sh
+# Run the headless latency measurement and check that every chirp comes
+# through the gate exactly n_fft samples late. The loopback backend plays its
+# test signal in memory, so no sound card or sound server is needed.
+
+CFLAGS=${CFLAGS:-"-O2"}
+LIBS=${LIBS:-"-lpulse -lportaudio -lsndfile -lfftw3f -lm -pthread"}
+TRIALS=5
+N_FFT=1024
+SAMPLE_RATE=44100
+
+cd "$(dirname "$0")/.." || exit 1
+tmp=$(mktemp -d)
+trap 'rm -rf "$tmp"' EXIT
+
+gcc noise_cancel.c -o "$tmp/noise_cancel" $CFLAGS $LIBS || exit 1
+
+HOME="$tmp" "$tmp/noise_cancel" --measure-latency --trials $TRIALS \
+    >"$tmp/log" 2>&1
+status=$?
+if [ $status -ne 0 ]; then
+    echo "FAIL: noise_cancel exited with status $status"
+    cat "$tmp/log"
+    exit 1
+fi
+
+if ! grep -q "^Latency over $TRIALS of $TRIALS chirps" "$tmp/log"; then
+    echo "FAIL: not every chirp was found"
+    cat "$tmp/log"
+    exit 1
+fi
+
+# The report rounds to 0.1 ms, so min, p50, p95 and max must all print as
+# n_fft at the sample rate
+expected=$(awk "BEGIN { printf \"%.1f\", 1000.0 * $N_FFT / $SAMPLE_RATE }")
+if ! awk -v want="$expected" '
+        $1 == "algorithmic" { row = 1
+            for (i = 2; i <= 5; i++) if ($i != want) bad = 1 }
+        END { exit !(row && !bad) }' "$tmp/log"; then
+    echo "FAIL: algorithmic latency is not $expected ms"
+    cat "$tmp/log"
+    exit 1
+fi
+echo "PASS: $TRIALS chirps delayed by $expected ms ($N_FFT samples)"
@@ -0,0 +1,72 @@
+#!/bin/sh
+# Record three takes in one session against a fake sound card and check that
+# each take is saved with audio in it. Every take after the first used to end
+# the moment it started.
+
+CFLAGS=${CFLAGS:-"-O2"}
+LIBS=${LIBS:-"-laubio -lsndfile -lfftw3f -lm -pthread"}
+
+cd "$(dirname "$0")/.." || exit 1
+tmp=$(mktemp -d)
+trap 'rm -rf "$tmp"' EXIT
+
+gcc voice.c tests/fake_portaudio.c -o "$tmp/voice" $CFLAGS $LIBS || exit 1
+
+# Enter starts and stops each take; the pauses after a take leave time to
+# gate, save and play it back. A session exits with status 1 if any take
+# could not be saved.
+session() {
+    expect=$1
+    pause=$2
+    shift 2
+    (
+        sleep 3
+        for take in 1 2 3; do
+            printf '\n'
+            sleep 2
+            printf '\n'
+            sleep "$pause"
+        done
+        printf 'q'
+    ) | HOME="$tmp" "$tmp/voice" --session --preroll 0 "$@" >"$tmp/log" 2>&1
+    status=$?
+    if [ $status -ne "$expect" ]; then
+        echo "FAIL: voice exited with status $status, expected $expect"
+        cat "$tmp/log"
+        exit 1
+    fi
+}
+
+session 0 3 -n "$tmp/take"
+
+# Two seconds of 44.1 kHz audio is far more than a header
+for take in 01 02 03; do
+    size=$(wc -c <"$tmp/take-$take.wav" 2>/dev/null || echo 0)
+    if [ "$size" -lt 44100 ]; then
+        echo "FAIL: take $take is $size bytes"
+        cat "$tmp/log"
+        exit 1
+    fi
+done
+echo "PASS: session saved 3 takes"
+
+# Playing a take back hides the host API's chatter on stderr; it has to come
+# back afterwards. The second take is saved through a link into a missing
+# directory, and that error must still be reported after the first take was
+# played.
+ln -s "$tmp/missing/take.wav" "$tmp/played-02.wav"
+session 1 6 "$tmp/played"
+if ! grep -q "Error opening output file" "$tmp/log"; then
+    echo "FAIL: error after playback was not reported"
+    cat "$tmp/log"
+    exit 1
+fi
+for take in 01 03; do
+    size=$(wc -c <"$tmp/played-$take.wav" 2>/dev/null || echo 0)
+    if [ "$size" -lt 44100 ]; then
+        echo "FAIL: played take $take is $size bytes"
+        cat "$tmp/log"
+        exit 1
+    fi
+done
+echo "PASS: stderr is back after playback"
@@ -1,19 +1,35 @@
+#define _GNU_SOURCE // CPU_SET, pthread_setaffinity_np
 #include <aubio/aubio.h>
+#include <errno.h>
 #include <fcntl.h>
+#include <math.h>
+#include <poll.h>
 #include <portaudio.h>
+#include <pthread.h>
+#include <semaphore.h>
 #include <signal.h>
 #include <sndfile.h>
+#include <stdarg.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
 #include <sys/stat.h>
 #include <termios.h>
 #include <time.h>
 #include <unistd.h>
 
 #include "argparse.h"
+#include "dtw.h"
+#include "formant.h"
+#include "noiseprofile.h"
+#include "pitchtrack.h"
+#include "realtime.h"
 #include "spectralgate.h"
+#include "voicequality.h"
 
 #define SAMPLE_RATE 44100
 #define FRAMES_PER_BUFFER 512
@@ -22,29 +38,86 @@
 #define AUBIO_BUFFER_SIZE 2048
 #define MAX_PITCH_HISTORY 256
 #define NOISE_SAMPLE_DURATION 1.0 // Duration in seconds to sample noise
+#define NOISE_RING_SIZE 16384     // Capture ring between callback and gate
+#define NOISE_SNAPSHOT_DURATION 0.25 // Ambient sample matched against profiles
+#define PREFAULT_SECONDS 2 // Take buffer kept faulted in ahead of the callback
 
+// Per-hop analysis, shared by live recording and `voice analyze`
 typedef struct {
-  float *recorded_data;
-  size_t frames_count;
-  size_t max_frames;
-  // Pitch detection state
   aubio_pitch_t *pitch_detector;
   fvec_t *input_buffer;
   fvec_t *pitch_output;
+  FormantTracker *formant_tracker;
+  VoiceQuality *voice_quality;
+  PitchTrack *pitch_track;
+} HopAnalyzer;
+
+typedef struct {
+  float *recorded_data;
+  _Atomic size_t frames_count; // Published by the callback, read by the worker
+  size_t max_frames;
+  // Pre-roll ring. The callback fills it from the moment the stream opens
+  // until the take officially starts, then freezes it in place as the first
+  // two spans of the take (oldest part first). Nothing is copied out of it.
+  float *preroll;
+  size_t preroll_size;
+  size_t preroll_pos; // Next write position
+  size_t preroll_filled;
+  AudioSpan preroll_spans[2];
+  atomic_bool take_started;   // Set by main when the take officially starts
+  atomic_bool preroll_frozen; // Set once preroll_spans are valid
+  // Analysis worker. The callback only copies audio and posts frames_ready;
+  // pitch detection, display and track export run on the worker thread.
+  // The worker lives for the whole process: after each take it drains,
+  // posts analysis_drained and parks on take_ready until main has rewound
+  // the state for the next take (or set worker_exit).
+  sem_t frames_ready;
+  sem_t analysis_drained;
+  sem_t take_ready;
+  atomic_bool analysis_done;
+  atomic_bool worker_exit;
+  HopAnalyzer analyzer;
+  // Display state
+  bool display; // Draw the live pitch bar
   float pitch_history[MAX_PITCH_HISTORY];
   int pitch_history_count;
   size_t samples_processed;
   size_t last_display_update;
+  int finished_fd; // eventfd, signalled when the stream completes
+  // Real-time mode (--rt). The callback raises its own thread on its first
+  // block after each stream start, as PortAudio may run every start on a
+  // new thread; the worker reports what was granted. The take buffer is too
+  // big to lock up front, so the worker faults it in PREFAULT_SECONDS ahead
+  // of the callback instead.
+  bool realtime;
+  int rt_cpu;
+  bool rt_entered;          // Callback thread raised since the stream started
+  RealtimeStatus rt_status; // What the callback thread was granted
+  atomic_bool rt_ready;     // rt_status is filled in, for the worker to print
+  bool rt_reported;         // Printed (worker)
+  size_t prefaulted;        // Frames of recorded_data faulted in (worker)
 } RecordingState;
 
+// Noise capture. The callback writes into a small ring that the gate's
+// startup task folds into its running statistics as blocks arrive, so the
+// capture is never held in full and the threshold is ready when it ends.
 typedef struct {
-  float *noise_data;
-  size_t frames_count;
+  float *ring;                 // NOISE_RING_SIZE samples
+  _Atomic size_t frames_count; // Total frames written by the callback
   size_t max_frames;
+  sem_t frames_ready;
+  atomic_bool capture_done; // No more frames will arrive
+  atomic_bool stop;         // Set by the consumer when it has enough
+  int finished_fd;
 } NoiseState;
 
 static volatile bool should_stop = false;
 
+// SIGINT is blocked in every thread and read from this signalfd by
+// sigint_thread, so ^C cancels whatever is running: startup waits,
+// recording, gating, saving or playback.
+static int sigint_fd = -1;
+
 void handle_sigint(int signum) {
   printf("\033[?25h\n");
   struct termios term;
@@ -55,7 +128,46 @@ void handle_sigint(int signum) {
   exit(1);
 }
 
-void draw_pitch_bar(float avg_pitch) {
+static void *sigint_thread(void *userData) {
+  (void)userData;
+  struct signalfd_siginfo info;
+  ssize_t n;
+  while ((n = read(sigint_fd, &info, sizeof(info))) < 0 && errno == EINTR)
+    ;
+  if (n == sizeof(info))
+    handle_sigint(SIGINT);
+  return NULL;
+}
+
+// Stream-finished callbacks. PortAudio calls these outside the audio
+// callback once a stream has completed, so they can make a syscall.
+static void signal_finished(int fd) { eventfd_write(fd, 1); }
+
+static void recording_finished(void *userData) {
+  signal_finished(((RecordingState *)userData)->finished_fd);
+}
+
+static void noise_finished(void *userData) {
+  signal_finished(((NoiseState *)userData)->finished_fd);
+}
+
+// Sleep until finished_fd is signalled or timeout_ms passes (-1 waits
+// forever). Returns true if the stream finished.
+static bool wait_finished(int finished_fd, int timeout_ms) {
+  struct pollfd fds[1] = {{.fd = finished_fd, .events = POLLIN}};
+  for (;;) {
+    int ready = poll(fds, 1, timeout_ms);
+    if (ready < 0 && errno == EINTR)
+      continue;
+    if (ready <= 0)
+      return false;
+    eventfd_t value;
+    eventfd_read(finished_fd, &value);
+    return true;
+  }
+}
+
+void draw_pitch_bar(float avg_pitch, const float *formants) {
   float max_pitch = 300.0f;
   int full_bar_len = 40;
   int bar_length = (int)((float)full_bar_len * (avg_pitch / max_pitch));
@@ -69,7 +181,11 @@ void draw_pitch_bar(float avg_pitch) {
     printf("█");
   for (int i = bar_length; i < full_bar_len; i++)
     printf("▒");
-  printf(" %.1f Hz\033[K", avg_pitch);
+  printf(" %.1f Hz", avg_pitch);
+  if (formants && formants[0] > 0.0f)
+    printf("  F1 %4.0f  F2 %4.0f  F3 %4.0f", formants[0], formants[1],
+           formants[2]);
+  printf("\033[K");
   fflush(stdout);
 }
 
@@ -78,18 +194,75 @@ static int noise_callback(const void *input, void *output,
                           const PaStreamCallbackTimeInfo *timeInfo,
                           PaStreamCallbackFlags statusFlags, void *userData) {
   NoiseState *state = (NoiseState *)userData;
+  const float *in = (const float *)input;
 
-  size_t remaining_space = state->max_frames - state->frames_count;
+  size_t count =
+      atomic_load_explicit(&state->frames_count, memory_order_relaxed);
+  size_t remaining_space = state->max_frames - count;
   size_t frames_to_copy =
       remaining_space < frameCount ? remaining_space : frameCount;
 
-  if (frames_to_copy > 0) {
-    memcpy(state->noise_data + state->frames_count, (const float *)input,
-           frames_to_copy * sizeof(float));
-    state->frames_count += frames_to_copy;
+  for (size_t done = 0; done < frames_to_copy;) {
+    size_t pos = (count + done) % NOISE_RING_SIZE;
+    size_t n = NOISE_RING_SIZE - pos;
+    if (n > frames_to_copy - done)
+      n = frames_to_copy - done;
+    memcpy(state->ring + pos, in + done, n * sizeof(float));
+    done += n;
+  }
+  count += frames_to_copy;
+  atomic_store_explicit(&state->frames_count, count, memory_order_release);
+  sem_post(&state->frames_ready);
+
+  return (count >= state->max_frames || atomic_load(&state->stop))
+             ? paComplete
+             : paContinue;
+}
+
+static void fill_preroll(RecordingState *state, const float *in,
+                         unsigned long frameCount) {
+  if (state->preroll_size == 0)
+    return;
+  // Only the newest preroll_size frames can survive
+  if (frameCount > state->preroll_size) {
+    in += frameCount - state->preroll_size;
+    frameCount = state->preroll_size;
   }
+  size_t first = state->preroll_size - state->preroll_pos;
+  if (first > frameCount)
+    first = frameCount;
+  memcpy(state->preroll + state->preroll_pos, in, first * sizeof(float));
+  memcpy(state->preroll, in + first, (frameCount - first) * sizeof(float));
+  state->preroll_pos = (state->preroll_pos + frameCount) % state->preroll_size;
+  state->preroll_filled += frameCount;
+  if (state->preroll_filled > state->preroll_size)
+    state->preroll_filled = state->preroll_size;
+}
 
-  return (state->frames_count >= state->max_frames) ? paComplete : paContinue;
+// Turn the ring into the spans that start the take. Called by the callback
+// on its first call after the take starts, or by main once the stream has
+// stopped if that call never happened.
+static void freeze_preroll(RecordingState *state) {
+  size_t oldest = state->preroll_filled < state->preroll_size
+                      ? 0
+                      : state->preroll_pos;
+  size_t tail = state->preroll_filled < state->preroll_size
+                    ? state->preroll_filled
+                    : state->preroll_size - oldest;
+  state->preroll_spans[0] = (AudioSpan){state->preroll + oldest, tail};
+  state->preroll_spans[1] =
+      (AudioSpan){state->preroll, state->preroll_filled - tail};
+  atomic_store_explicit(&state->preroll_frozen, true, memory_order_release);
+}
+
+// The take as spans: the frozen pre-roll followed by the recorded buffer
+static size_t take_spans(RecordingState *state, AudioSpan spans[3]) {
+  spans[0] = state->preroll_spans[0];
+  spans[1] = state->preroll_spans[1];
+  spans[2] = (AudioSpan){
+      state->recorded_data,
+      atomic_load_explicit(&state->frames_count, memory_order_acquire)};
+  return spans[0].length + spans[1].length + spans[2].length;
 }
 
 static int recording_callback(const void *input, void *output,
@@ -100,65 +273,313 @@ static int recording_callback(const void *input, void *output,
   RecordingState *state = (RecordingState *)userData;
   const float *in = (const float *)input;
 
-  // Expand buffer if needed
-  if (state->frames_count + frameCount > state->max_frames) {
-    size_t new_size = state->max_frames * 2;
-    float *new_data = realloc(state->recorded_data, new_size * sizeof(float));
-    if (!new_data)
-      return paAbort;
-    state->recorded_data = new_data;
-    state->max_frames = new_size;
-  }
-
-  // Copy input data
-  memcpy(state->recorded_data + state->frames_count, in,
-         frameCount * sizeof(float));
-  state->frames_count += frameCount;
-
-  // Process pitch detection
-  for (size_t i = 0; i < frameCount; i++) {
-    state->input_buffer->data[state->samples_processed % AUBIO_HOP_SIZE] =
-        in[i];
-    state->samples_processed++;
-
-    if (state->samples_processed % AUBIO_HOP_SIZE == 0) {
-      aubio_pitch_do(state->pitch_detector, state->input_buffer,
-                     state->pitch_output);
-      float pitch = state->pitch_output->data[0];
-      float confidence = aubio_pitch_get_confidence(state->pitch_detector);
-
-      if (confidence > 0.8f && pitch >= 50.0f && pitch <= 2000.0f) {
-        if (state->pitch_history_count < MAX_PITCH_HISTORY) {
-          state->pitch_history[state->pitch_history_count++] = pitch;
-        } else {
-          memmove(state->pitch_history, state->pitch_history + 1,
-                  (MAX_PITCH_HISTORY - 1) * sizeof(float));
-          state->pitch_history[MAX_PITCH_HISTORY - 1] = pitch;
-        }
-
-        if (state->samples_processed - state->last_display_update >=
-            SAMPLE_RATE / 16) {
-          state->last_display_update = state->samples_processed;
-          float avg_pitch = 0;
-          for (int j = 0; j < state->pitch_history_count; j++) {
-            avg_pitch += state->pitch_history[j];
-          }
-          avg_pitch /= state->pitch_history_count;
-          draw_pitch_bar(avg_pitch);
-        }
+  if (state->realtime && !state->rt_entered) {
+    RealtimeConfig config = {REALTIME_PRIORITY, state->rt_cpu, false};
+    RealtimeRegion regions[] = {
+        {state->preroll, state->preroll_size * sizeof(float)}};
+    realtime_enter(&config, regions, 1, &state->rt_status);
+    state->rt_entered = true;
+    atomic_store_explicit(&state->rt_ready, true, memory_order_release);
+    sem_post(&state->frames_ready);
+  }
+
+  if (!atomic_load_explicit(&state->take_started, memory_order_acquire)) {
+    fill_preroll(state, in, frameCount);
+    return paContinue;
+  }
+  if (!atomic_load_explicit(&state->preroll_frozen, memory_order_relaxed))
+    freeze_preroll(state);
+
+  // Copy input data. The buffer is preallocated for the maximum take length;
+  // growing it here would move memory out from under the analysis worker.
+  size_t count =
+      atomic_load_explicit(&state->frames_count, memory_order_relaxed);
+  size_t remaining_space = state->max_frames - count;
+  size_t frames_to_copy =
+      remaining_space < frameCount ? remaining_space : frameCount;
+  memcpy(state->recorded_data + count, in, frames_to_copy * sizeof(float));
+  atomic_store_explicit(&state->frames_count, count + frames_to_copy,
+                        memory_order_release);
+  sem_post(&state->frames_ready);
+
+  if (frames_to_copy < frameCount)
+    should_stop = true; // Maximum take length reached
+
+  return should_stop ? paComplete : paContinue;
+}
+
+static bool analyzer_init(HopAnalyzer *an, int sample_rate) {
+  memset(an, 0, sizeof(*an));
+  an->pitch_detector =
+      new_aubio_pitch("yin", AUBIO_BUFFER_SIZE, AUBIO_HOP_SIZE, sample_rate);
+  an->input_buffer = new_fvec(AUBIO_HOP_SIZE);
+  an->pitch_output = new_fvec(1);
+  an->formant_tracker = formant_tracker_create(sample_rate, AUBIO_HOP_SIZE);
+  an->voice_quality = vq_create(sample_rate, AUBIO_HOP_SIZE);
+  return an->pitch_detector && an->input_buffer && an->pitch_output &&
+         an->formant_tracker && an->voice_quality;
+}
+
+static void analyzer_free(HopAnalyzer *an) {
+  if (an->pitch_detector)
+    del_aubio_pitch(an->pitch_detector);
+  if (an->input_buffer)
+    del_fvec(an->input_buffer);
+  if (an->pitch_output)
+    del_fvec(an->pitch_output);
+  formant_tracker_destroy(an->formant_tracker);
+  vq_destroy(an->voice_quality);
+  pitchtrack_close(an->pitch_track);
+  memset(an, 0, sizeof(*an));
+}
+
+static bool is_voiced(const PitchFrame *frame) {
+  return frame->confidence > 0.8f && frame->pitch >= 50.0f &&
+         frame->pitch <= 2000.0f;
+}
+
+static void analyzer_do(HopAnalyzer *an, const float *hop, PitchFrame *frame) {
+  memcpy(an->input_buffer->data, hop, AUBIO_HOP_SIZE * sizeof(float));
+  aubio_pitch_do(an->pitch_detector, an->input_buffer, an->pitch_output);
+
+  memset(frame, 0, sizeof(*frame));
+  frame->pitch = an->pitch_output->data[0];
+  frame->confidence = aubio_pitch_get_confidence(an->pitch_detector);
+  float sum_sq = 0.0f;
+  for (int i = 0; i < AUBIO_HOP_SIZE; i++)
+    sum_sq += hop[i] * hop[i];
+  frame->rms = sqrtf(sum_sq / AUBIO_HOP_SIZE);
+  if (formant_tracker_do(an->formant_tracker, hop))
+    memcpy(frame->formants, an->formant_tracker->formants,
+           sizeof(frame->formants));
+
+  VoiceQualityFrame vq;
+  vq_do(an->voice_quality, hop, frame->pitch, is_voiced(frame), &vq);
+  frame->jitter = vq.jitter;
+  frame->shimmer = vq.shimmer;
+  frame->hnr = vq.hnr;
+  frame->cpp = vq.cpp;
+
+  pitchtrack_write(an->pitch_track, frame);
+}
+
+static void analyzer_report(const HopAnalyzer *an) {
+  const FormantTracker *ft = an->formant_tracker;
+  if (ft->hops) {
+    printf("Formant tracker: %.1f us/hop mean, %.1f us max, budget %.0f us, "
+           "%zu of %zu hops analyzed\n",
+           ft->total_us / ft->hops, ft->max_us, ft->budget_us, ft->analyzed,
+           ft->hops);
+  }
+
+  VoiceQualityFrame summary;
+  vq_summary(an->voice_quality, &summary);
+  if (an->voice_quality->voiced_hops) {
+    printf("Voice quality over %zu voiced hops: jitter %.2f%%, shimmer "
+           "%.2f%%, HNR %.1f dB, CPP %.1f dB\n",
+           an->voice_quality->voiced_hops, summary.jitter * 100.0f,
+           summary.shimmer * 100.0f, summary.hnr, summary.cpp);
+  }
+}
+
+static void analyze_hop(RecordingState *state, const float *hop) {
+  PitchFrame frame;
+  analyzer_do(&state->analyzer, hop, &frame);
+  state->samples_processed += AUBIO_HOP_SIZE;
+
+  if (is_voiced(&frame)) {
+    float pitch = frame.pitch;
+    if (state->pitch_history_count < MAX_PITCH_HISTORY) {
+      state->pitch_history[state->pitch_history_count++] = pitch;
+    } else {
+      memmove(state->pitch_history, state->pitch_history + 1,
+              (MAX_PITCH_HISTORY - 1) * sizeof(float));
+      state->pitch_history[MAX_PITCH_HISTORY - 1] = pitch;
+    }
+
+    if (state->display && state->samples_processed -
+                                  state->last_display_update >=
+                              SAMPLE_RATE / 16) {
+      state->last_display_update = state->samples_processed;
+      float avg_pitch = 0;
+      for (int j = 0; j < state->pitch_history_count; j++) {
+        avg_pitch += state->pitch_history[j];
       }
+      avg_pitch /= state->pitch_history_count;
+      draw_pitch_bar(avg_pitch, state->analyzer.formant_tracker->formants);
     }
   }
+}
 
-  return should_stop ? paComplete : paContinue;
+// Keep the part of the take buffer the callback is about to write resident,
+// so it never stalls on a first touch. Worker, in real-time mode.
+static void prefault_take(RecordingState *state) {
+  size_t want =
+      atomic_load_explicit(&state->frames_count, memory_order_relaxed) +
+      PREFAULT_SECONDS * SAMPLE_RATE;
+  if (want > state->max_frames)
+    want = state->max_frames;
+  if (want <= state->prefaulted)
+    return;
+  realtime_prefault(state->recorded_data + state->prefaulted,
+                    (want - state->prefaulted) * sizeof(float));
+  state->prefaulted = want;
+}
+
+// Non-real-time side of the recording. Wakes whenever the callback has
+// published new audio and analyzes every complete hop.
+static void *analysis_worker(void *userData) {
+  RecordingState *state = (RecordingState *)userData;
+
+  float scratch[AUBIO_HOP_SIZE];
+  if (state->realtime)
+    prefault_take(state);
+  for (;;) {
+    sem_wait(&state->frames_ready);
+    if (state->realtime) {
+      prefault_take(state);
+      if (!state->rt_reported &&
+          atomic_load_explicit(&state->rt_ready, memory_order_acquire)) {
+        state->rt_reported = true;
+        realtime_print("audio callback", &state->rt_status);
+        printf("  Take buffer faulted in %d s ahead of the recording\n",
+               PREFAULT_SECONDS);
+      }
+    }
+    bool done = atomic_exchange(&state->analysis_done, false);
+    if (!atomic_load_explicit(&state->preroll_frozen, memory_order_acquire)) {
+      if (done)
+        goto drained;
+      continue;
+    }
+
+    AudioSpan spans[3];
+    size_t available = take_spans(state, spans);
+    while (state->samples_processed + AUBIO_HOP_SIZE <= available) {
+      // Hops that straddle two spans are gathered; the rest are used in place
+      size_t offset = state->samples_processed;
+      int s = 0;
+      while (offset >= spans[s].length)
+        offset -= spans[s++].length;
+      const float *hop = spans[s].data + offset;
+      if (offset + AUBIO_HOP_SIZE > spans[s].length) {
+        gather_spans(spans, 3, state->samples_processed, scratch,
+                     AUBIO_HOP_SIZE);
+        hop = scratch;
+      }
+      analyze_hop(state, hop);
+    }
+    if (!done)
+      continue;
+
+  drained:
+    sem_post(&state->analysis_drained);
+    sem_wait(&state->take_ready);
+    if (atomic_load(&state->worker_exit))
+      break;
+  }
+  return NULL;
+}
+
+// Called by main once the stream has stopped: analyze what is left of the
+// take and wait until the worker has parked
+static void drain_analysis(RecordingState *state) {
+  atomic_store(&state->analysis_done, true);
+  sem_post(&state->frames_ready);
+  sem_wait(&state->analysis_drained);
+}
+
+static void stop_analysis_worker(RecordingState *state, pthread_t worker) {
+  atomic_store(&state->worker_exit, true);
+  atomic_store(&state->analysis_done, true);
+  sem_post(&state->frames_ready);
+  sem_post(&state->take_ready);
+  pthread_join(worker, NULL);
+}
+
+// Rewind everything for the next take while the stream is stopped and the
+// worker is parked. Nothing is allocated or freed.
+static void rewind_take(RecordingState *state) {
+  // Stopping the stream signalled finished_fd; left set, it would end the
+  // next take as soon as it starts
+  wait_finished(state->finished_fd, 0);
+  atomic_store(&state->take_started, false);
+  atomic_store(&state->preroll_frozen, false);
+  atomic_store(&state->frames_count, 0);
+  state->rt_entered = false; // The restarted stream may use a new thread
+  state->preroll_pos = 0;
+  state->preroll_filled = 0;
+  state->samples_processed = 0;
+  state->last_display_update = 0;
+  state->pitch_history_count = 0;
+  formant_tracker_reset(state->analyzer.formant_tracker);
+  vq_reset(state->analyzer.voice_quality);
+  sem_post(&state->take_ready);
+}
+
+// PortAudio's host APIs print their probing noise on stderr while devices
+// are opened, so it goes to /dev/null meanwhile. The startup tasks are
+// already running then; their messages, and aubio's, go through say_error
+// and are held until stderr is back.
+static struct {
+  pthread_mutex_t lock;
+  int saved_fd; // The real stderr while it is quieted, else -1
+  char held[4096];
+  size_t length;
+} quiet = {PTHREAD_MUTEX_INITIALIZER, -1};
+
+static void quiet_stderr(void) {
+  pthread_mutex_lock(&quiet.lock);
+  fflush(stderr);
+  quiet.saved_fd = dup(STDERR_FILENO);
+  freopen("/dev/null", "w", stderr);
+  pthread_mutex_unlock(&quiet.lock);
+}
+
+static void restore_stderr(void) {
+  pthread_mutex_lock(&quiet.lock);
+  fflush(stderr);
+  dup2(quiet.saved_fd, STDERR_FILENO);
+  close(quiet.saved_fd);
+  quiet.saved_fd = -1;
+  fwrite(quiet.held, 1, quiet.length, stderr);
+  quiet.length = 0;
+  pthread_mutex_unlock(&quiet.lock);
+}
+
+static void say_error(const char *format, ...) {
+  va_list ap;
+  va_start(ap, format);
+  pthread_mutex_lock(&quiet.lock);
+  if (quiet.saved_fd < 0) {
+    vfprintf(stderr, format, ap);
+  } else {
+    size_t space = sizeof(quiet.held) - quiet.length;
+    int n = vsnprintf(quiet.held + quiet.length, space, format, ap);
+    if (n > 0)
+      quiet.length += (size_t)n < space ? (size_t)n : space - 1;
+  }
+  pthread_mutex_unlock(&quiet.lock);
+  va_end(ap);
+}
+
+static void aubio_message(sint_t level, const char_t *message, void *data) {
+  (void)level;
+  (void)data;
+  say_error("%s", message);
 }
 
 typedef struct {
   size_t total_frames;
   float *audio_data;
   size_t position;
+  int finished_fd;
 } PlaybackData;
 
+static void playback_finished(void *userData) {
+  signal_finished(((PlaybackData *)userData)->finished_fd);
+}
+
 static int playback_callback(const void *input, void *output,
                              unsigned long frameCount,
                              const PaStreamCallbackTimeInfo *timeInfo,
@@ -182,64 +603,7 @@ static int playback_callback(const void *input, void *output,
   return paContinue;
 }
 
-bool save_noise_profile(const char *voice_dir, float *noise_data,
-                        size_t frames) {
-  char filepath[4096];
-  snprintf(filepath, sizeof(filepath), "%s/.noise_profile.dat", voice_dir);
-
-  FILE *f = fopen(filepath, "wb");
-  if (!f)
-    return false;
-
-  // Write number of frames first
-  if (fwrite(&frames, sizeof(size_t), 1, f) != 1) {
-    fclose(f);
-    return false;
-  }
-
-  // Write noise data
-  if (fwrite(noise_data, sizeof(float), frames, f) != frames) {
-    fclose(f);
-    return false;
-  }
-
-  fclose(f);
-  return true;
-}
-
-bool load_noise_profile(const char *voice_dir, float **noise_data,
-                        size_t *frames) {
-  char filepath[4096];
-  snprintf(filepath, sizeof(filepath), "%s/.noise_profile.dat", voice_dir);
-
-  FILE *f = fopen(filepath, "rb");
-  if (!f)
-    return false;
-
-  // Read number of frames
-  if (fread(frames, sizeof(size_t), 1, f) != 1) {
-    fclose(f);
-    return false;
-  }
-
-  // Allocate and read noise data
-  *noise_data = malloc(*frames * sizeof(float));
-  if (!*noise_data) {
-    fclose(f);
-    return false;
-  }
-
-  if (fread(*noise_data, sizeof(float), *frames, f) != *frames) {
-    free(*noise_data);
-    fclose(f);
-    return false;
-  }
-
-  fclose(f);
-  return true;
-}
-
-void save_recording(const char *filename, float *data, size_t frames) {
+bool save_recording(const char *filename, float *data, size_t frames) {
   SF_INFO sfinfo = {.samplerate = SAMPLE_RATE,
                     .channels = CHANNELS,
                     .format = SF_FORMAT_WAV | SF_FORMAT_FLOAT};
@@ -247,18 +611,15 @@ void save_recording(const char *filename, float *data, size_t frames) {
   SNDFILE *file = sf_open(filename, SFM_WRITE, &sfinfo);
   if (!file) {
     fprintf(stderr, "Error opening output file: %s\n", sf_strerror(NULL));
-    return;
+    return false;
   }
 
   sf_write_float(file, data, frames);
   sf_close(file);
+  return true;
 }
 
 void play_audio(float *data, size_t frames) {
-  // Save and redirect stderr
-  int stderr_fd = dup(STDERR_FILENO);
-  freopen("/dev/null", "w", stderr);
-
   PlaybackData *pb_data = malloc(sizeof(PlaybackData));
   if (!pb_data) {
     fprintf(stderr, "Failed to allocate playback data\n");
@@ -268,6 +629,7 @@ void play_audio(float *data, size_t frames) {
   pb_data->total_frames = frames;
   pb_data->audio_data = data;
   pb_data->position = 0;
+  pb_data->finished_fd = eventfd(0, EFD_CLOEXEC);
 
   PaStream *playback_stream;
   PaError err;
@@ -280,44 +642,49 @@ void play_audio(float *data, size_t frames) {
                               ->defaultLowOutputLatency,
       .hostApiSpecificStreamInfo = NULL};
 
+  // Sessions play every take, so stderr must be back before anything is
+  // printed
+  quiet_stderr();
+
+  const char *failed = NULL;
   err = Pa_OpenStream(&playback_stream, NULL, &outputParameters, SAMPLE_RATE,
                       FRAMES_PER_BUFFER, paClipOff, playback_callback, pb_data);
-
   if (err != paNoError) {
-    fprintf(stderr, "Error opening playback stream: %s\n",
-            Pa_GetErrorText(err));
-    free(pb_data);
-    return;
+    failed = "Error opening playback stream";
+  } else {
+    Pa_SetStreamFinishedCallback(playback_stream, playback_finished);
+    err = Pa_StartStream(playback_stream);
+    if (err != paNoError) {
+      failed = "Error starting playback";
+      Pa_CloseStream(playback_stream);
+    }
   }
 
-  printf("Playing back recording...\n");
-  err = Pa_StartStream(playback_stream);
-  if (err != paNoError) {
-    fprintf(stderr, "Error starting playback: %s\n", Pa_GetErrorText(err));
+  restore_stderr();
+
+  if (failed) {
+    fprintf(stderr, "%s: %s\n", failed, Pa_GetErrorText(err));
+    close(pb_data->finished_fd);
     free(pb_data);
     return;
   }
 
-  while (Pa_IsStreamActive(playback_stream)) {
-    Pa_Sleep(100);
-  }
+  printf("Playing back recording...\n");
+  wait_finished(pb_data->finished_fd, -1);
 
   Pa_StopStream(playback_stream);
   Pa_CloseStream(playback_stream);
+  close(pb_data->finished_fd);
   free(pb_data);
 }
 
-float *capture_noise_profile(size_t *noise_frames) {
+// Record up to NOISE_SAMPLE_DURATION seconds into ns. Returns true if
+// (nearly) all of it arrived or the consumer stopped the capture early. Either
+// way, ns is marked done so its consumer stops. With matching, only a short
+// snapshot may be needed.
+bool capture_noise_profile(NoiseState *ns, bool matching) {
   PaStream *noise_stream;
-  NoiseState noise_state = {
-      .noise_data = malloc(SAMPLE_RATE * NOISE_SAMPLE_DURATION * sizeof(float)),
-      .frames_count = 0,
-      .max_frames = SAMPLE_RATE * NOISE_SAMPLE_DURATION};
-
-  if (!noise_state.noise_data) {
-    fprintf(stderr, "Failed to allocate noise buffer\n");
-    return NULL;
-  }
+  bool ok = false;
 
   PaStreamParameters inputParameters = {
       .device = Pa_GetDefaultInputDevice(),
@@ -329,81 +696,825 @@ float *capture_noise_profile(size_t *noise_frames) {
 
   PaError err =
       Pa_OpenStream(&noise_stream, &inputParameters, NULL, SAMPLE_RATE,
-                    FRAMES_PER_BUFFER, paClipOff, noise_callback, &noise_state);
+                    FRAMES_PER_BUFFER, paClipOff, noise_callback, ns);
 
   if (err != paNoError) {
     fprintf(stderr, "Error opening noise capture stream: %s\n",
             Pa_GetErrorText(err));
-    free(noise_state.noise_data);
-    return NULL;
+    goto done;
   }
+  Pa_SetStreamFinishedCallback(noise_stream, noise_finished);
 
-  printf("Please be quiet for %.1f seconds to capture noise profile...\n",
-         NOISE_SAMPLE_DURATION);
+  if (matching)
+    printf("Please be quiet for a moment while the room noise is sampled...\n");
+  else
+    printf("Please be quiet for %.1f seconds to capture noise profile...\n",
+           NOISE_SAMPLE_DURATION);
   err = Pa_StartStream(noise_stream);
   if (err != paNoError) {
     fprintf(stderr, "Error starting noise capture: %s\n", Pa_GetErrorText(err));
-    free(noise_state.noise_data);
     Pa_CloseStream(noise_stream);
-    return NULL;
+    goto done;
   }
 
-  // Wait for the full duration plus a small buffer
-  Pa_Sleep((int)(NOISE_SAMPLE_DURATION * 1000) + 100);
+  // The callback completes the stream once enough frames arrived. The
+  // timeout only guards against a stalled device.
+  wait_finished(ns->finished_fd, (int)(NOISE_SAMPLE_DURATION * 1000) + 2000);
 
   Pa_StopStream(noise_stream);
   Pa_CloseStream(noise_stream);
 
   // Check if we got enough frames
-  if (noise_state.frames_count < (SAMPLE_RATE * NOISE_SAMPLE_DURATION *
-                                  0.9)) { // Allow for small variations
+  size_t frames = atomic_load(&ns->frames_count);
+  if (atomic_load(&ns->stop)) {
+    ok = true; // Matched a stored profile
+  } else if (frames < (SAMPLE_RATE * NOISE_SAMPLE_DURATION *
+                       0.9)) { // Allow for small variations
     fprintf(stderr, "Incomplete noise capture (got %zu frames, expected %zu)\n",
-            noise_state.frames_count,
-            (size_t)(SAMPLE_RATE * NOISE_SAMPLE_DURATION));
-    free(noise_state.noise_data);
-    return NULL;
+            frames, (size_t)(SAMPLE_RATE * NOISE_SAMPLE_DURATION));
+  } else {
+    ok = true;
   }
 
-  *noise_frames = noise_state.frames_count;
-  return noise_state.noise_data;
+done:
+  atomic_store(&ns->capture_done, true);
+  sem_post(&ns->frames_ready);
+  return ok;
 }
 
-int main(int argc, char **argv) {
-  VoiceTrainerArgs args = voicetrainer_argparse(argc, argv);
+// Fold the live noise capture into the gate's statistics block by block
+// until at least `until` frames are in or the capture is over. *consumed
+// carries the position between calls.
+static void consume_noise_capture(NoiseState *ns, SpectralGate *sg,
+                                  size_t *consumed_frames, size_t until) {
+  size_t consumed = *consumed_frames;
+  while (consumed < until) {
+    sem_wait(&ns->frames_ready);
+    bool done = atomic_load(&ns->capture_done);
+    size_t written =
+        atomic_load_explicit(&ns->frames_count, memory_order_acquire);
+    // The ring covers ~370 ms; falling that far behind drops the oldest
+    if (written - consumed > NOISE_RING_SIZE)
+      consumed = written - NOISE_RING_SIZE;
+    while (consumed < written) {
+      size_t pos = consumed % NOISE_RING_SIZE;
+      size_t n = NOISE_RING_SIZE - pos;
+      if (n > written - consumed)
+        n = written - consumed;
+      spectralgate_noise_push(sg, ns->ring + pos, n);
+      consumed += n;
+    }
+    if (done)
+      break;
+  }
+  *consumed_frames = consumed;
+}
 
-  mkdir(args.voice_dir, 0755);
+// Profile saved by earlier versions, before the per-device store
+static void legacy_profile_path(const char *voice_dir, char *path,
+                                size_t size) {
+  snprintf(path, size, "%s/.noise_profile.dat", voice_dir);
+}
 
-  int stderr_fd = dup(STDERR_FILENO); // Save original stderr
-  freopen("/dev/null", "w", stderr);  // Redirect stderr to /dev/null
+// Headless input: push a file (or raw PCM on stdin) through
+// recording_callback in FRAMES_PER_BUFFER blocks, exactly as the device
+// would, but without waiting for real time. Returns the number of frames fed,
+// or -1 if the input can't be read.
+static long feed_input(RecordingState *state, const VoiceTrainerArgs *args) {
+  bool from_stdin = !strcmp(args->input_file, "-");
+  SF_INFO sfinfo = {0};
+  if (args->raw_format) {
+    sfinfo.samplerate = SAMPLE_RATE;
+    sfinfo.channels = CHANNELS;
+    sfinfo.format = SF_FORMAT_RAW | (strcmp(args->raw_format, "s16")
+                                         ? SF_FORMAT_FLOAT
+                                         : SF_FORMAT_PCM_16);
+  }
+  SNDFILE *file = from_stdin ? sf_open_fd(STDIN_FILENO, SFM_READ, &sfinfo, 0)
+                             : sf_open(args->input_file, SFM_READ, &sfinfo);
+  if (!file) {
+    fprintf(stderr, "Error opening %s: %s\n", args->input_file,
+            sf_strerror(NULL));
+    return -1;
+  }
+  if (sfinfo.samplerate != SAMPLE_RATE) {
+    fprintf(stderr, "Error: %s is %d Hz, expected %d Hz\n", args->input_file,
+            sfinfo.samplerate, SAMPLE_RATE);
+    sf_close(file);
+    return -1;
+  }
 
-  PaError err = Pa_Initialize();
-  if (err != paNoError)
-    goto error;
+  float *block = malloc(FRAMES_PER_BUFFER * sfinfo.channels * sizeof(float));
+  float mono[FRAMES_PER_BUFFER];
+  if (!block) {
+    sf_close(file);
+    return -1;
+  }
 
-  fflush(stderr); // restore stderr
-  dup2(stderr_fd, STDERR_FILENO);
-  close(stderr_fd);
-
-  // First, try to load existing noise profile
-  float *noise_data = NULL;
-  size_t noise_frames = 0;
-  bool load_success =
-      load_noise_profile(args.voice_dir, &noise_data, &noise_frames);
-
-  // If no existing profile, capture a new one
-  if (!load_success) {
-    printf("No existing noise profile found. Need to capture one.\n");
-    noise_data = capture_noise_profile(&noise_frames);
-    if (!noise_data) {
-      fprintf(stderr, "Failed to capture noise profile\n");
-      goto cleanup;
+  long fed = 0;
+  sf_count_t got;
+  while (!should_stop &&
+         (got = sf_readf_float(file, block, FRAMES_PER_BUFFER)) > 0) {
+    // Downmix to mono
+    for (sf_count_t i = 0; i < got; i++) {
+      float sum = 0.0f;
+      for (int c = 0; c < sfinfo.channels; c++)
+        sum += block[i * sfinfo.channels + c];
+      mono[i] = sum / sfinfo.channels;
+    }
+    recording_callback(mono, NULL, got, NULL, 0, state);
+    fed += got;
+  }
+  if (should_stop && sf_readf_float(file, block, 1) > 0)
+    fprintf(stderr, "Warning: input truncated to the maximum take length\n");
+
+  free(block);
+  sf_close(file);
+  return fed;
+}
+
+// Trim the last 30 ms off the take, gate it with the startup threshold (or
+// one measured from the take itself), apply gain, save it to path and play it
+// back. cleaned_audio must hold the whole take. Returns whether it was saved.
+static bool process_take(RecordingState *state, SpectralGate *sg,
+                         const VoiceTrainerArgs *args, const char *path,
+                         float *cleaned_audio) {
+  AudioSpan take[3];
+  size_t take_frames = take_spans(state, take);
+  size_t trim_samples = (SAMPLE_RATE * 30) / 1000; // 30ms worth of samples
+  size_t final_frames = take_frames > trim_samples ? take_frames - trim_samples
+                                                   : take_frames;
+
+  if (args->noise_from_take) {
+    size_t quiet = spectralgate_noise_from_quietest(sg, take, 3, final_frames,
+                                                    DEFAULT_QUIET_FRACTION);
+    if (quiet)
+      printf("Measured noise from the quietest %.1f s of the take.\n",
+             (double)quiet * sg->hop_length / SAMPLE_RATE);
+    else
+      fprintf(stderr, "Warning: Take has no quiet frames to measure noise "
+                      "from; not gating\n");
+  }
+  spectralgate_process_spans(sg, take, 3, cleaned_audio, final_frames);
+
+  // Apply gain (amplification)
+  for (size_t i = 0; i < final_frames; i++) {
+    cleaned_audio[i] *= args->gain;
+  }
+
+  // Save the file
+  bool saved = save_recording(path, cleaned_audio, final_frames);
+  if (saved)
+    printf("\nSaved cleaned audio to: %s\n", path);
+
+  // Play back the cleaned audio
+  if (!args->no_playback) {
+    play_audio(cleaned_audio, final_frames);
+  }
+  return saved;
+}
+
+// Sleep until a key is pressed or finished_fd (if >= 0) is signalled.
+// Returns the key ('\r' is reported as '\n'), EOF when stdin is closed, or 0
+// when finished_fd fired.
+static int wait_for_key(int finished_fd) {
+  struct pollfd fds[2] = {{.fd = STDIN_FILENO, .events = POLLIN},
+                          {.fd = finished_fd, .events = POLLIN}};
+  for (;;) {
+    if (poll(fds, finished_fd >= 0 ? 2 : 1, -1) < 0) {
+      if (errno == EINTR)
+        continue;
+      return EOF;
+    }
+    if (finished_fd >= 0 && (fds[1].revents & POLLIN)) {
+      eventfd_t value;
+      eventfd_read(finished_fd, &value);
+      return 0;
+    }
+    if (fds[0].revents & (POLLIN | POLLHUP)) {
+      char c;
+      ssize_t n = read(STDIN_FILENO, &c, 1);
+      if (n == 0)
+        return EOF;
+      if (n == 1)
+        return c == '\r' ? '\n' : c;
+    }
+  }
+}
+
+// Session takes are saved as <output stem>-NN.wav, skipping names that are
+// already taken. path must hold strlen(base) + 16 bytes.
+static void session_take_path(const char *base, int *take_number,
+                              char *path) {
+  size_t stem = strlen(base);
+  if (stem >= 4 && !strcmp(base + stem - 4, ".wav"))
+    stem -= 4;
+  do {
+    (*take_number)++;
+    sprintf(path, "%.*s-%02d.wav", (int)stem, base, *take_number);
+  } while (access(path, F_OK) == 0);
+}
+
+// Offline batch mode: run the live analysis over saved takes and write their
+// pitch tracks.
+int analyze_takes(const VoiceTrainerArgs *args) {
+  int failures = 0;
+  for (int f = 0; f < args->num_inputs; f++) {
+    const char *path = args->inputs[f];
+    SF_INFO sfinfo = {0};
+    SNDFILE *file = sf_open(path, SFM_READ, &sfinfo);
+    if (!file) {
+      fprintf(stderr, "Error opening %s: %s\n", path, sf_strerror(NULL));
+      failures++;
+      continue;
+    }
+
+    HopAnalyzer an = {0};
+    float *block = malloc(AUBIO_HOP_SIZE * sfinfo.channels * sizeof(float));
+    float hop[AUBIO_HOP_SIZE];
+    if (!block || !analyzer_init(&an, sfinfo.samplerate)) {
+      fprintf(stderr, "Failed to allocate resources\n");
+      free(block);
+      analyzer_free(&an);
+      sf_close(file);
+      return 1;
+    }
+    an.pitch_track = pitchtrack_open(path, sfinfo.samplerate, AUBIO_HOP_SIZE,
+                                     args->pitch_csv);
+    if (!an.pitch_track)
+      fprintf(stderr, "Warning: Failed to open pitch track for %s\n", path);
+
+    // Downmix to mono, one hop at a time
+    size_t hops = 0;
+    while (sf_readf_float(file, block, AUBIO_HOP_SIZE) == AUBIO_HOP_SIZE) {
+      for (int i = 0; i < AUBIO_HOP_SIZE; i++) {
+        float sum = 0.0f;
+        for (int c = 0; c < sfinfo.channels; c++)
+          sum += block[i * sfinfo.channels + c];
+        hop[i] = sum / sfinfo.channels;
+      }
+      PitchFrame frame;
+      analyzer_do(&an, hop, &frame);
+      hops++;
+    }
+
+    printf("%s: %zu hops (%.1f s)\n", path, hops,
+           (double)hops * AUBIO_HOP_SIZE / sfinfo.samplerate);
+    analyzer_report(&an);
+    analyzer_free(&an);
+    free(block);
+    sf_close(file);
+  }
+  return failures ? 1 : 0;
+}
+
+// Voiced frames of a pitch track, in cents above 55 Hz
+typedef struct {
+  float *cents;
+  size_t *hop; // Hop index of each voiced frame in the original track
+  size_t count;
+  PitchTrackHeader header;
+} PitchContour;
+
+static void free_contour(PitchContour *contour) {
+  free(contour->cents);
+  free(contour->hop);
+  memset(contour, 0, sizeof(*contour));
+}
+
+static bool load_contour(const char *path, PitchContour *contour) {
+  memset(contour, 0, sizeof(*contour));
+  size_t len = strlen(path), ext_len = strlen(PITCHTRACK_EXT);
+  bool is_track =
+      len >= ext_len && !strcmp(path + len - ext_len, PITCHTRACK_EXT);
+  char *track_path =
+      is_track ? strdup(path) : pitchtrack_path(path, PITCHTRACK_EXT);
+
+  size_t frames = 0;
+  PitchFrame *track = pitchtrack_load(track_path, &contour->header, &frames);
+  if (!track) {
+    fprintf(stderr,
+            "Error: no pitch track at %s (run 'voice analyze' on the take)\n",
+            track_path);
+    free(track_path);
+    return false;
+  }
+  free(track_path);
+  if (contour->header.sample_rate == 0 || contour->header.hop_size == 0) {
+    fprintf(stderr, "Error: %s has an invalid pitch track header\n", path);
+    free(track);
+    return false;
+  }
+
+  contour->cents = malloc((frames ? frames : 1) * sizeof(float));
+  contour->hop = malloc((frames ? frames : 1) * sizeof(size_t));
+  if (!contour->cents || !contour->hop) {
+    free(track);
+    free_contour(contour);
+    return false;
+  }
+  for (size_t i = 0; i < frames; i++) {
+    if (!is_voiced(&track[i]))
+      continue;
+    contour->cents[contour->count] = 1200.0f * log2f(track[i].pitch / 55.0f);
+    contour->hop[contour->count] = i;
+    contour->count++;
+  }
+  free(track);
+  return true;
+}
+
+static double elapsed_ms(const struct timespec *start) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - start->tv_sec) * 1e3 +
+         (now.tv_nsec - start->tv_nsec) / 1e6;
+}
+
+// Align the take's pitch contour against each reference with banded DTW and
+// report the deviation per voiced segment of the take. With --locate, each
+// reference is first found inside the take with subsequence DTW and only
+// that stretch is aligned.
+int compare_takes(const VoiceTrainerArgs *args) {
+  PitchContour take;
+  if (!load_contour(args->inputs[0], &take))
+    return 1;
+  if (take.count == 0) {
+    fprintf(stderr, "Error: %s has no voiced frames\n", args->inputs[0]);
+    free_contour(&take);
+    return 1;
+  }
+  // Only voiced frames are aligned, so the band counts voiced hops: pauses
+  // in either contour don't widen it
+  double hop_seconds =
+      (double)take.header.hop_size / take.header.sample_rate;
+  size_t band = (size_t)(args->band_seconds / hop_seconds);
+
+  const char *best_ref = NULL;
+  float best_deviation = INFINITY;
+  struct timespec total_start;
+  clock_gettime(CLOCK_MONOTONIC, &total_start);
+
+  for (int r = 1; r < args->num_inputs; r++) {
+    PitchContour ref;
+    if (!load_contour(args->inputs[r], &ref))
+      continue;
+    if (ref.count == 0) {
+      fprintf(stderr, "Skipping %s: no voiced frames\n", args->inputs[r]);
+      free_contour(&ref);
+      continue;
+    }
+    // Frames are compared one to one, so both must be on the same time grid
+    if (ref.header.sample_rate != take.header.sample_rate ||
+        ref.header.hop_size != take.header.hop_size) {
+      fprintf(stderr,
+              "Skipping %s: %u Hz with hop %u, but the take is %u Hz with "
+              "hop %u (re-analyze both at the same rate)\n",
+              args->inputs[r], ref.header.sample_rate, ref.header.hop_size,
+              take.header.sample_rate, take.header.hop_size);
+      free_contour(&ref);
+      continue;
+    }
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    size_t first = 0, last = take.count - 1;
+    float located_cost = 0.0f;
+    if (args->locate && dtw_subsequence(take.cents, take.count, ref.cents,
+                                        ref.count, &first, &last,
+                                        &located_cost) != 0) {
+      fprintf(stderr, "Failed to locate %s\n", args->inputs[r]);
+      free_contour(&ref);
+      continue;
+    }
+    DtwPath path;
+    if (dtw_banded(take.cents + first, last - first + 1, ref.cents, ref.count,
+                   band, &path) != 0) {
+      fprintf(stderr, "Failed to align against %s\n", args->inputs[r]);
+      free_contour(&ref);
+      continue;
     }
+    for (size_t k = 0; k < path.length; k++)
+      path.take_index[k] += first;
+    double align_ms = elapsed_ms(&start);
+
+    float mean_abs = path.cost / path.length;
+    printf("\n%s: %zu x %zu voiced frames, band %zu, aligned in %.1f ms\n",
+           args->inputs[r], last - first + 1, ref.count, band, align_ms);
+    if (args->locate)
+      printf("  Found at %.2fs - %.2fs of the take\n",
+             take.hop[first] * hop_seconds, (take.hop[last] + 1) * hop_seconds);
+    printf("  Mean |deviation| %.1f cents\n", mean_abs);
+    printf("  %7s %8s %8s %9s %9s\n", "segment", "start", "end", "mean",
+           "|mean|");
+
+    // A segment is a run of consecutive voiced hops in the take
+    size_t segment = 0, steps = 0, first_hop = 0;
+    double signed_sum = 0.0, abs_sum = 0.0;
+    for (size_t k = 0; k <= path.length; k++) {
+      size_t i = k < path.length ? path.take_index[k] : 0;
+      bool boundary = k == path.length ||
+                      (k > 0 && i != path.take_index[k - 1] &&
+                       take.hop[i] != take.hop[path.take_index[k - 1]] + 1);
+      if (boundary && steps) {
+        size_t last_hop = take.hop[path.take_index[k - 1]];
+        printf("  %7zu %7.2fs %7.2fs %+9.1f %9.1f\n", ++segment,
+               first_hop * hop_seconds, (last_hop + 1) * hop_seconds,
+               signed_sum / steps, abs_sum / steps);
+        steps = 0;
+        signed_sum = abs_sum = 0.0;
+      }
+      if (k == path.length)
+        break;
+      if (steps == 0)
+        first_hop = take.hop[i];
+      float deviation = take.cents[i] - ref.cents[path.ref_index[k]];
+      signed_sum += deviation;
+      abs_sum += fabsf(deviation);
+      steps++;
+    }
+
+    if (mean_abs < best_deviation) {
+      best_deviation = mean_abs;
+      best_ref = args->inputs[r];
+    }
+    dtw_path_free(&path);
+    free_contour(&ref);
+  }
+
+  if (args->num_inputs > 2 && best_ref)
+    printf("\nClosest reference: %s (mean |deviation| %.1f cents)\n",
+           best_ref, best_deviation);
+  printf("Compared against %d reference(s) in %.1f ms\n", args->num_inputs - 1,
+         elapsed_ms(&total_start));
 
-    // Save the new noise profile
-    if (!save_noise_profile(args.voice_dir, noise_data, noise_frames)) {
-      fprintf(stderr, "Warning: Failed to save noise profile for future use\n");
+  free_contour(&take);
+  return best_ref ? 0 : 1;
+}
+
+#define BENCH_RUNS 9
+#define BENCH_SECONDS 60 // Synthetic audio when no takes are given
+
+// Load the takes as one mono signal at SAMPLE_RATE. Returns its length, or 0.
+static size_t load_bench_audio(const VoiceTrainerArgs *args, float **audio) {
+  size_t length = 0;
+  *audio = NULL;
+  for (int f = 0; f < args->num_inputs; f++) {
+    SF_INFO sfinfo = {0};
+    SNDFILE *file = sf_open(args->inputs[f], SFM_READ, &sfinfo);
+    if (!file) {
+      fprintf(stderr, "Error opening %s: %s\n", args->inputs[f],
+              sf_strerror(NULL));
+      continue;
+    }
+    float *grown = NULL;
+    float *block = malloc(sfinfo.frames * sfinfo.channels * sizeof(float));
+    if (sfinfo.samplerate != SAMPLE_RATE)
+      fprintf(stderr, "Skipping %s: %d Hz, expected %d Hz\n", args->inputs[f],
+              sfinfo.samplerate, SAMPLE_RATE);
+    else if (block)
+      grown = realloc(*audio, (length + sfinfo.frames) * sizeof(float));
+    if (grown) {
+      *audio = grown;
+      sf_count_t got = sf_readf_float(file, block, sfinfo.frames);
+      for (sf_count_t i = 0; i < got; i++) {
+        float sum = 0.0f;
+        for (int c = 0; c < sfinfo.channels; c++)
+          sum += block[i * sfinfo.channels + c];
+        (*audio)[length++] = sum / sfinfo.channels;
+      }
+    }
+    free(block);
+    sf_close(file);
+  }
+  return length;
+}
+
+// Time the spectral gate's plain engine (one real FFT each way per frame)
+// against the packed one (two frames per complex FFT) over the same audio, and
+// check that they agree. Uses the given takes, or a synthetic voice-like tone
+// in noise.
+int bench_gate(const VoiceTrainerArgs *args) {
+  float *audio = NULL;
+  size_t length = 0;
+  if (args->num_inputs) {
+    length = load_bench_audio(args, &audio);
+  } else if ((audio = malloc(SAMPLE_RATE * BENCH_SECONDS * sizeof(float)))) {
+    length = SAMPLE_RATE * BENCH_SECONDS;
+    srand(1);
+    for (size_t i = 0; i < length; i++) {
+      double t = (double)i / SAMPLE_RATE;
+      bool voiced = fmod(t, 2.0) < 1.2;
+      audio[i] = 0.01f * (rand() / (float)RAND_MAX - 0.5f) +
+                 (voiced ? 0.3f * sinf(2.0f * M_PI * 150.0f * t) +
+                               0.1f * sinf(2.0f * M_PI * 450.0f * t)
+                         : 0.0f);
+    }
+  }
+
+  SpectralGate *sg = spectralgate_create(SAMPLE_RATE);
+  float *plain = malloc(length * sizeof(float));
+  float *packed = malloc(length * sizeof(float));
+  if (!sg || !plain || !packed || length < (size_t)DEFAULT_N_FFT) {
+    fprintf(stderr, length < DEFAULT_N_FFT ? "Not enough audio to benchmark\n"
+                                           : "Failed to allocate resources\n");
+    spectralgate_destroy(sg);
+    free(plain);
+    free(packed);
+    free(audio);
+    return 1;
+  }
+  sg->prop_decrease = 0.0;
+  sg->n_std_thresh = 2.5;
+  spectralgate_set_overlap(sg, args->overlap);
+  AudioSpan span = {audio, length};
+  spectralgate_noise_from_quietest(sg, &span, 1, length,
+                                   DEFAULT_QUIET_FRACTION);
+
+  size_t frames = 1 + (length - sg->n_fft) / sg->hop_length;
+  printf("Gating %.1f s of audio, %zu frames at %d%% overlap (best of %d "
+         "runs):\n",
+         (double)length / SAMPLE_RATE, frames, args->overlap, BENCH_RUNS);
+  // The engines alternate within each run, so drift in machine load hits
+  // both alike
+  double best_ms[2] = {INFINITY, INFINITY};
+  for (int run = 0; run < BENCH_RUNS; run++) {
+    for (int mode = 0; mode < 2; mode++) {
+      sg->pack_frames = mode == 1;
+      struct timespec start;
+      clock_gettime(CLOCK_MONOTONIC, &start);
+      spectralgate_process_spans(sg, &span, 1, mode ? packed : plain, length);
+      double ms = elapsed_ms(&start);
+      if (ms < best_ms[mode])
+        best_ms[mode] = ms;
     }
   }
+  for (int mode = 0; mode < 2; mode++) {
+    size_t transforms = 2 * (mode ? (frames + 1) / 2 : frames);
+    printf("  %-7s %7zu transforms %9.1f ms  (%.0fx real time)\n",
+           mode ? "packed" : "plain", transforms, best_ms[mode],
+           length * 1000.0 / SAMPLE_RATE / best_ms[mode]);
+  }
+
+  float max_diff = 0.0f;
+  for (size_t i = 0; i < length; i++)
+    if (fabsf(plain[i] - packed[i]) > max_diff)
+      max_diff = fabsf(plain[i] - packed[i]);
+  printf("Packed is %.2fx the speed of plain; outputs differ by at most "
+         "%.1e\n",
+         best_ms[0] / best_ms[1], max_diff);
+
+  spectralgate_destroy(sg);
+  free(plain);
+  free(packed);
+  free(audio);
+  return 0;
+}
+
+// Startup runs as concurrent tasks: PortAudio device enumeration on the main
+// thread, noise profile loading, spectral gate planning and detector setup in
+// the background. Tasks signal completion through a shared bit mask so any
+// thread can wait for what it depends on.
+enum {
+  STARTUP_DEVICES = 1 << 0,   // Pa_Initialize
+  STARTUP_PROFILE = 1 << 1,   // Noise profile loaded from disk (or not)
+  STARTUP_NOISE = 1 << 2,     // Noise samples available (loaded or captured)
+  STARTUP_GATE = 1 << 3,      // Spectral gate and its FFTW plans
+  STARTUP_THRESHOLD = 1 << 4, // Noise threshold computed
+  STARTUP_DETECTOR = 1 << 5,  // Pitch/formant/quality analyzer and track
+  STARTUP_TASKS = 6,
+};
+
+static const char *startup_task_names[STARTUP_TASKS] = {
+    "device init", "profile load", "noise ready",
+    "gate plans",  "threshold",    "detector setup"};
+
+typedef struct {
+  pthread_mutex_t lock;
+  pthread_cond_t changed;
+  unsigned done;
+  struct timespec t0;
+  double start_ms[STARTUP_TASKS];
+  double end_ms[STARTUP_TASKS];
+
+  const VoiceTrainerArgs *args;
+  char device_key[256]; // Noise store key of the input device
+  NoiseProfile profiles[NOISESTORE_SLOTS]; // Stored candidates for the device
+  int profile_slots[NOISESTORE_SLOTS];     // Store slot of each, -1 = legacy
+  int num_profiles;
+  int matched; // Index of the profile in use, or -1
+  NoiseState noise;         // Live capture, when there is no usable profile
+  bool noise_ok;            // Capture completed
+  const float *noise_data;  // Headless: leading samples of the input
+  size_t noise_frames;
+  SpectralGate *sg;
+  RecordingState *state;
+  bool detector_ok;
+} Startup;
+
+// FFTW's planner is not thread-safe, and both the gate and the analyzer plan
+static pthread_mutex_t fftw_planner_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int startup_index(unsigned task) { return __builtin_ctz(task); }
+
+static void startup_begin(Startup *s, unsigned task) {
+  s->start_ms[startup_index(task)] = elapsed_ms(&s->t0);
+}
+
+static void startup_finish(Startup *s, unsigned task) {
+  pthread_mutex_lock(&s->lock);
+  if (!(s->done & task)) {
+    s->end_ms[startup_index(task)] = elapsed_ms(&s->t0);
+    s->done |= task;
+  }
+  pthread_cond_broadcast(&s->changed);
+  pthread_mutex_unlock(&s->lock);
+}
+
+static void startup_wait(Startup *s, unsigned tasks) {
+  pthread_mutex_lock(&s->lock);
+  while ((s->done & tasks) != tasks)
+    pthread_cond_wait(&s->changed, &s->lock);
+  pthread_mutex_unlock(&s->lock);
+}
+
+static void *startup_profile_task(void *userData) {
+  Startup *s = (Startup *)userData;
+  // Headless runs always measure noise from their input, so results don't
+  // depend on this machine's store
+  if (s->args->input_file || s->args->noise_from_take) {
+    startup_finish(s, STARTUP_PROFILE);
+    return NULL;
+  }
+
+  // The store is keyed by the input device, known once PortAudio is up
+  startup_wait(s, STARTUP_DEVICES | STARTUP_GATE);
+  startup_begin(s, STARTUP_PROFILE);
+  if (s->sg && s->device_key[0]) {
+    s->num_profiles = noisestore_load(s->args->voice_dir, s->device_key,
+                                      s->profiles, s->profile_slots);
+
+    // Before the store, there was a single profile for every device. Offer
+    // it as a candidate until this device has profiles of its own.
+    char path[4096];
+    legacy_profile_path(s->args->voice_dir, path, sizeof(path));
+    NoiseProfile *legacy = &s->profiles[s->num_profiles];
+    if (s->num_profiles == 0 && noiseprofile_load(path, legacy)) {
+      if (legacy->samples) {
+        noiseprofile_apply(legacy, s->sg);
+        noiseprofile_from_gate(legacy, s->sg);
+      }
+      if (noiseprofile_matches(legacy, s->sg))
+        s->profile_slots[s->num_profiles++] = -1;
+      else
+        noiseprofile_free(legacy);
+    }
+
+    // Statistics are only valid for the gate's analysis geometry
+    int kept = 0;
+    for (int i = 0; i < s->num_profiles; i++) {
+      if (noiseprofile_matches(&s->profiles[i], s->sg)) {
+        s->profiles[kept] = s->profiles[i];
+        s->profile_slots[kept++] = s->profile_slots[i];
+      } else {
+        noiseprofile_free(&s->profiles[i]);
+      }
+    }
+    s->num_profiles = kept;
+  }
+  startup_finish(s, STARTUP_PROFILE);
+  return NULL;
+}
+
+// Compare the ambient snapshot in the gate's statistics against the stored
+// profiles and switch to the nearest one if it is close enough
+static bool match_noise_profile(Startup *s) {
+  int best = -1;
+  double best_distance = INFINITY;
+  for (int i = 0; i < s->num_profiles; i++) {
+    double distance = noiseprofile_distance(&s->profiles[i], s->sg);
+    if (distance < best_distance) {
+      best_distance = distance;
+      best = i;
+    }
+  }
+  if (best < 0 || best_distance > NOISESTORE_MATCH_DB) {
+    if (best >= 0)
+      printf("No stored noise profile matches this room (nearest %.1f dB "
+             "away); capturing a new one.\n",
+             best_distance);
+    return false;
+  }
+
+  s->matched = best;
+  noiseprofile_apply(&s->profiles[best], s->sg);
+  if (s->profile_slots[best] >= 0)
+    noisestore_touch(s->args->voice_dir, s->device_key,
+                     s->profile_slots[best]);
+  else if (noisestore_save(s->args->voice_dir, s->device_key, s->sg) < 0)
+    say_error("Warning: Failed to save noise profile for future use\n");
+  printf("Using stored noise profile (%.1f dB from the room).\n",
+         best_distance);
+  return true;
+}
+
+static void *startup_gate_task(void *userData) {
+  Startup *s = (Startup *)userData;
+  startup_begin(s, STARTUP_GATE);
+  pthread_mutex_lock(&fftw_planner_lock);
+  s->sg = spectralgate_create(SAMPLE_RATE);
+  pthread_mutex_unlock(&fftw_planner_lock);
+  if (s->sg) {
+    s->sg->prop_decrease = 0.0;
+    s->sg->n_std_thresh = 2.5;
+    spectralgate_set_overlap(s->sg, s->args->overlap);
+    s->sg->pack_frames = true; // Takes are gated offline, whole
+  }
+  startup_finish(s, STARTUP_GATE);
+
+  startup_wait(s, STARTUP_PROFILE);
+  startup_begin(s, STARTUP_THRESHOLD);
+  if (!s->sg || s->args->noise_from_take) {
+    // Nothing to compute: main reports a missing gate, and takes that
+    // measure their own noise do it when they are processed
+  } else if (s->args->input_file) {
+    // Headless: main hands over the start of the input once it is read
+    startup_wait(s, STARTUP_NOISE);
+    if (s->noise_data)
+      spectralgate_compute_noise_thresh(s->sg, (float *)s->noise_data,
+                                        s->noise_frames);
+  } else {
+    // The statistics grow while the capture runs. The first quarter second
+    // is compared with the stored profiles; only without a match does the
+    // capture run to the end and become a new profile.
+    spectralgate_noise_reset(s->sg);
+    size_t consumed = 0;
+    bool matched = false;
+    if (s->num_profiles) {
+      consume_noise_capture(&s->noise, s->sg, &consumed,
+                            SAMPLE_RATE * NOISE_SNAPSHOT_DURATION);
+      if (consumed >= SAMPLE_RATE * NOISE_SNAPSHOT_DURATION &&
+          match_noise_profile(s)) {
+        atomic_store(&s->noise.stop, true);
+        matched = true;
+      }
+    }
+    if (!matched) {
+      consume_noise_capture(&s->noise, s->sg, &consumed, SIZE_MAX);
+      startup_wait(s, STARTUP_NOISE);
+      if (s->noise_ok) {
+        spectralgate_noise_finish(s->sg);
+        if (noisestore_save(s->args->voice_dir, s->device_key, s->sg) < 0)
+          say_error("Warning: Failed to save noise profile for future use\n");
+      }
+    }
+  }
+  startup_finish(s, STARTUP_THRESHOLD);
+  return NULL;
+}
+
+static void *startup_detector_task(void *userData) {
+  Startup *s = (Startup *)userData;
+  startup_begin(s, STARTUP_DETECTOR);
+  pthread_mutex_lock(&fftw_planner_lock);
+  s->detector_ok = analyzer_init(&s->state->analyzer, SAMPLE_RATE);
+  pthread_mutex_unlock(&fftw_planner_lock);
+  // Session takes open their own track when they start
+  if (s->detector_ok && !s->args->session) {
+    s->state->analyzer.pitch_track = pitchtrack_open(
+        s->args->output_file, SAMPLE_RATE, AUBIO_HOP_SIZE, s->args->pitch_csv);
+    if (!s->state->analyzer.pitch_track)
+      say_error("Warning: Failed to open pitch track for writing\n");
+  }
+  startup_finish(s, STARTUP_DETECTOR);
+  return NULL;
+}
+
+static void print_startup_timing(const Startup *s, double recording_ms) {
+  printf("\nStartup timing (ms since launch):\n");
+  for (int i = 0; i < STARTUP_TASKS; i++) {
+    if (!(s->done & (1u << i)))
+      continue;
+    printf("  %-15s %8.1f -> %8.1f  (%.1f)\n", startup_task_names[i],
+           s->start_ms[i], s->end_ms[i], s->end_ms[i] - s->start_ms[i]);
+  }
+  if (recording_ms >= 0.0)
+    printf("  %-15s %8.1f\n", "recording", recording_ms);
+}
+
+int main(int argc, char **argv) {
+  VoiceTrainerArgs args = voicetrainer_argparse(argc, argv);
+  if (args.command != VOICE_CMD_RECORD) {
+    int status = args.command == VOICE_CMD_ANALYZE   ? analyze_takes(&args)
+                 : args.command == VOICE_CMD_COMPARE ? compare_takes(&args)
+                                                     : bench_gate(&args);
+    free(args.inputs);
+    return status;
+  }
+
+  // With --input the same pipeline runs headless: no devices, no terminal,
+  // no pre-roll and no playback
+  bool headless = args.input_file != NULL;
 
   // Initialize recording state
   size_t max_time_seconds = 60 * 30; // 30 minutes is ~10 MB of audio
@@ -411,22 +1522,120 @@ int main(int argc, char **argv) {
       .recorded_data = malloc(SAMPLE_RATE * max_time_seconds * sizeof(float)),
       .frames_count = 0,
       .max_frames = SAMPLE_RATE * max_time_seconds,
-      .pitch_detector = new_aubio_pitch("yin", AUBIO_BUFFER_SIZE,
-                                        AUBIO_HOP_SIZE, SAMPLE_RATE),
-      .input_buffer = new_fvec(AUBIO_HOP_SIZE),
-      .pitch_output = new_fvec(1),
+      .preroll_size =
+          headless ? 0 : (size_t)(args.preroll_seconds * SAMPLE_RATE),
+      .display = !headless,
       .pitch_history_count = 0,
       .samples_processed = 0,
-      .last_display_update = 0};
+      .last_display_update = 0,
+      .finished_fd = eventfd(0, EFD_CLOEXEC),
+      .realtime = args.realtime,
+      .rt_cpu = args.rt_cpu};
+  sem_init(&state.frames_ready, 0, 0);
+  sem_init(&state.analysis_drained, 0, 0);
+  sem_init(&state.take_ready, 0, 0);
+  if (state.preroll_size)
+    state.preroll = calloc(state.preroll_size, sizeof(float));
+
+  // Threads inherit the floating-point mode, so this covers the gate, the
+  // analysis worker and PortAudio's callback thread alike
+  if (args.realtime)
+    realtime_flush_denormals();
+
+  // Block SIGINT before any thread exists so it is only ever seen through
+  // sigint_fd
+  sigset_t sigint_set;
+  sigemptyset(&sigint_set);
+  sigaddset(&sigint_set, SIGINT);
+  pthread_sigmask(SIG_BLOCK, &sigint_set, NULL);
+  sigint_fd = signalfd(-1, &sigint_set, SFD_CLOEXEC);
+  pthread_t sigint_watcher;
+  if (sigint_fd < 0 ||
+      pthread_create(&sigint_watcher, NULL, sigint_thread, NULL) != 0) {
+    // Without a reader ^C would be lost; fall back to the default action
+    pthread_sigmask(SIG_UNBLOCK, &sigint_set, NULL);
+  } else {
+    pthread_detach(sigint_watcher);
+  }
+
+  Startup startup = {
+      .lock = PTHREAD_MUTEX_INITIALIZER,
+      .changed = PTHREAD_COND_INITIALIZER,
+      .args = &args,
+      .matched = -1,
+      .noise = {.ring = malloc(NOISE_RING_SIZE * sizeof(float)),
+                .max_frames = SAMPLE_RATE * NOISE_SAMPLE_DURATION,
+                .finished_fd = eventfd(0, EFD_CLOEXEC)},
+      .state = &state};
+  sem_init(&startup.noise.frames_ready, 0, 0);
+  clock_gettime(CLOCK_MONOTONIC, &startup.t0);
+
+  mkdir(args.voice_dir, 0755);
+
+  // aubio writes its own errors to stderr, possibly while it is quieted
+  aubio_log_set_level_function(AUBIO_LOG_ERR, aubio_message, NULL);
+  aubio_log_set_level_function(AUBIO_LOG_WRN, aubio_message, NULL);
+
+  pthread_t profile_thread, gate_thread, detector_thread;
+  pthread_create(&profile_thread, NULL, startup_profile_task, &startup);
+  pthread_create(&gate_thread, NULL, startup_gate_task, &startup);
+  pthread_create(&detector_thread, NULL, startup_detector_task, &startup);
+
+  PaStream *recording_stream = NULL;
+  pthread_t worker;
+  bool worker_started = false;
+  float *cleaned_audio = NULL;
+  char *session_path = NULL;
+  bool terminal_raw = false;
+  double recording_ms = -1.0;
+  int exit_status = 0;
+
+  PaError err = paNoError;
+  if (headless)
+    goto take;
+
+  startup_begin(&startup, STARTUP_DEVICES);
+  quiet_stderr();
+  err = Pa_Initialize();
+  restore_stderr();
+  if (err == paNoError) {
+    const PaDeviceInfo *device = Pa_GetDeviceInfo(Pa_GetDefaultInputDevice());
+    if (device)
+      noisestore_key(device->name, SAMPLE_RATE, startup.device_key,
+                     sizeof(startup.device_key));
+  }
+  startup_finish(&startup, STARTUP_DEVICES);
+  if (err != paNoError)
+    goto error;
 
-  if (!state.recorded_data || !state.pitch_detector || !state.input_buffer ||
-      !state.pitch_output) {
+  // Sample the room. The gate task either matches the start of it against
+  // this device's stored profiles and ends it early, or keeps the whole
+  // capture as a new profile.
+  if (!args.noise_from_take) {
+    startup_wait(&startup, STARTUP_PROFILE);
+    if (!startup.num_profiles)
+      printf("No noise profile for this device yet. Need to capture one.\n");
+    startup_begin(&startup, STARTUP_NOISE);
+    startup.noise_ok = startup.noise.ring &&
+                       capture_noise_profile(&startup.noise,
+                                             startup.num_profiles > 0);
+    startup_finish(&startup, STARTUP_NOISE);
+    if (!startup.noise_ok) {
+      fprintf(stderr, "Failed to capture noise profile\n");
+      exit_status = 1;
+      goto cleanup;
+    }
+  }
+
+  if (!state.recorded_data || (state.preroll_size && !state.preroll)) {
     fprintf(stderr, "Failed to allocate resources\n");
+    exit_status = 1;
     goto cleanup;
   }
 
-  // Start recording audio
-  PaStream *recording_stream;
+  // Open the input as soon as the device is up. Until the take officially
+  // starts the callback only fills the pre-roll ring, so speech that begins
+  // while we finish initializing is kept.
   PaStreamParameters inputParameters = {
       .device = Pa_GetDefaultInputDevice(),
       .channelCount = CHANNELS,
@@ -439,103 +1648,211 @@ int main(int argc, char **argv) {
                       FRAMES_PER_BUFFER, paClipOff, recording_callback, &state);
   if (err != paNoError)
     goto error;
-
-  // Wait for user input to stop or cancel recording.
-  signal(SIGINT, handle_sigint);
-
-  printf("\033[?25l"); // Hide cursor
-  printf("\nRecording started. Press Enter to stop, or ^C to cancel.\n\n");
-  draw_pitch_bar(0.0f);
+  Pa_SetStreamFinishedCallback(recording_stream, recording_finished);
 
   err = Pa_StartStream(recording_stream);
   if (err != paNoError)
     goto error;
 
-  struct termios old_term, new_term;
-  tcgetattr(STDIN_FILENO, &old_term);
-  new_term = old_term;
-  new_term.c_lflag &= ~(ICANON | ECHO);
-  tcsetattr(STDIN_FILENO, TCSANOW, &new_term);
-  int flags = fcntl(STDIN_FILENO, F_GETFL, 0);
-  fcntl(STDIN_FILENO, F_SETFL, flags | O_NONBLOCK);
-
-  fflush(stdout);
-
-  should_stop = false;
-  char c;
-  while (!should_stop) {
-    if (read(STDIN_FILENO, &c, 1) == 1) {
-      if (c == '\n' || c == '\r') {
-        should_stop = true;
-      }
-    }
-    Pa_Sleep(10);
+take:
+  startup_wait(&startup, STARTUP_DETECTOR);
+  if (!startup.detector_ok) {
+    fprintf(stderr, "Failed to allocate resources\n");
+    exit_status = 1;
+    goto cleanup;
   }
+  pthread_create(&worker, NULL, analysis_worker, &state);
+  worker_started = true;
 
-  tcsetattr(STDIN_FILENO, TCSANOW, &old_term);
-  fcntl(STDIN_FILENO, F_SETFL, flags);
-
-  Pa_StopStream(recording_stream);
-  Pa_CloseStream(recording_stream);
-  printf("\033[?25h"); // Show cursor
-
-  // Trim last 30ms and apply noise reduction
-  size_t trim_samples = (SAMPLE_RATE * 30) / 1000; // 30ms worth of samples
-  size_t final_frames = state.frames_count > trim_samples
-                            ? state.frames_count - trim_samples
-                            : state.frames_count;
-
-  float *cleaned_audio = malloc(final_frames * sizeof(float));
+  // Sized for the longest take so no take needs an allocation of its own
+  cleaned_audio = malloc((state.max_frames + state.preroll_size) *
+                         sizeof(float));
   if (!cleaned_audio) {
     fprintf(stderr, "Failed to allocate memory for cleaned audio\n");
+    exit_status = 1;
     goto cleanup;
   }
 
-  // Compute noise threshold and process the trimmed audio
-  SpectralGate *sg = spectralgate_create(SAMPLE_RATE);
-  if (!sg) {
-    fprintf(stderr, "Failed to create spectral gate\n");
-    goto cleanup;
+  struct termios old_term, new_term;
+  int flags = 0;
+  if (!headless) {
+    tcgetattr(STDIN_FILENO, &old_term);
+    new_term = old_term;
+    new_term.c_lflag &= ~(ICANON | ECHO);
+    tcsetattr(STDIN_FILENO, TCSANOW, &new_term);
+    flags = fcntl(STDIN_FILENO, F_GETFL, 0);
+    fcntl(STDIN_FILENO, F_SETFL, flags | O_NONBLOCK);
+    terminal_raw = true;
   }
-  sg->prop_decrease = 0.0;
-  sg->n_std_thresh = 2.5;
-
-  spectralgate_compute_noise_thresh(sg, noise_data, noise_frames);
-  spectralgate_process(sg, state.recorded_data, cleaned_audio, final_frames);
 
-  // Apply gain (amplification)
-  for (size_t i = 0; i < final_frames; i++) {
-    cleaned_audio[i] *= args.gain;
+  // A session keeps the stream, gate, analyzer and buffers warm between
+  // takes; otherwise this loop runs once
+  int take_number = 0;
+  const char *take_path = args.output_file;
+  if (args.session) {
+    session_path = malloc(strlen(args.output_file) + 16);
+    if (!session_path) {
+      fprintf(stderr, "Failed to allocate resources\n");
+      exit_status = 1;
+      goto restore_terminal;
+    }
+    take_path = session_path;
+    printf("\nSession started. Press Enter to start and stop each take, q to "
+           "quit.\n");
   }
 
-  // Save the file
-  save_recording(args.output_file, cleaned_audio, final_frames);
-  printf("\nSaved cleaned audio to: %s\n", args.output_file);
+  for (bool last_take = false; !last_take;) {
+    if (args.session) {
+      int key;
+      printf("\nReady for take %d.\n", take_number + 1);
+      fflush(stdout);
+      while ((key = wait_for_key(-1)) != '\n' && key != 'q' && key != EOF)
+        ;
+      if (key != '\n')
+        break;
+      session_take_path(args.output_file, &take_number, session_path);
+      state.analyzer.pitch_track = pitchtrack_open(
+          session_path, SAMPLE_RATE, AUBIO_HOP_SIZE, args.pitch_csv);
+      if (!state.analyzer.pitch_track)
+        fprintf(stderr, "Warning: Failed to open pitch track for writing\n");
+    }
 
-  // Play back the cleaned audio
-  if (!args.no_playback) {
-    play_audio(cleaned_audio, final_frames);
+    atomic_store_explicit(&state.take_started, true, memory_order_release);
+    if (recording_ms < 0.0)
+      recording_ms = elapsed_ms(&startup.t0);
+    if (headless) {
+      long fed = feed_input(&state, &args);
+      if (fed < 0) {
+        exit_status = 1;
+        goto restore_terminal;
+      }
+      double feed_ms = elapsed_ms(&startup.t0) - recording_ms;
+      printf("Processed %.1f s of audio in %.0f ms (%.0fx real time)\n",
+             (double)fed / SAMPLE_RATE, feed_ms,
+             feed_ms > 0 ? fed * 1000.0 / SAMPLE_RATE / feed_ms : 0.0);
+
+      // The leading second of the input is the noise sample. It describes
+      // that recording, not this machine, so it is not saved.
+      startup_begin(&startup, STARTUP_NOISE);
+      size_t count = atomic_load(&state.frames_count);
+      size_t noise_frames = SAMPLE_RATE * NOISE_SAMPLE_DURATION;
+      startup.noise_frames = count < noise_frames ? count : noise_frames;
+      startup.noise_data = state.recorded_data;
+      startup_finish(&startup, STARTUP_NOISE);
+      if (startup.noise_frames < DEFAULT_N_FFT && !args.noise_from_take) {
+        fprintf(stderr, "Input too short for a noise profile\n");
+        exit_status = 1;
+        goto restore_terminal;
+      }
+      last_take = true;
+    } else {
+      printf("\033[?25l"); // Hide cursor
+      if (args.session)
+        printf("\nRecording take %d. Press Enter to stop, or ^C to quit.\n\n",
+               take_number);
+      else
+        printf("\nRecording started. Press Enter to stop, or ^C to "
+               "cancel.\n\n");
+      draw_pitch_bar(0.0f, NULL);
+      fflush(stdout);
+
+      // Sleep until Enter, ^C, or the stream completes on its own (maximum
+      // take length). A closed stdin ends the take and the session.
+      int key;
+      while ((key = wait_for_key(state.finished_fd)) != '\n' && key != 0 &&
+             key != EOF)
+        ;
+      if (key == EOF)
+        last_take = true;
+      should_stop = true;
+
+      Pa_StopStream(recording_stream);
+    }
+    if (!atomic_load(&state.preroll_frozen))
+      freeze_preroll(&state);
+
+    // Let the worker finish the take's hops and its track
+    drain_analysis(&state);
+    if (!headless)
+      printf("\033[?25h\n"); // Show cursor
+    pitchtrack_close(state.analyzer.pitch_track);
+    state.analyzer.pitch_track = NULL;
+    analyzer_report(&state.analyzer);
+    if (args.timing && take_number <= 1)
+      print_startup_timing(&startup, recording_ms);
+
+    // The threshold was computed in the background during startup
+    startup_wait(&startup, STARTUP_THRESHOLD);
+    if (!startup.sg) {
+      fprintf(stderr, "Failed to create spectral gate\n");
+      exit_status = 1;
+      goto restore_terminal;
+    }
+    if (!process_take(&state, startup.sg, &args, take_path, cleaned_audio))
+      exit_status = 1;
+
+    if (!args.session)
+      break;
+
+    // Back to pre-roll mode for the next take
+    rewind_take(&state);
+    should_stop = false;
+    err = Pa_StartStream(recording_stream);
+    if (err != paNoError) {
+      fprintf(stderr, "PortAudio error: %s\n", Pa_GetErrorText(err));
+      exit_status = 1;
+      break;
+    }
+  }
+
+restore_terminal:
+  if (terminal_raw) {
+    tcsetattr(STDIN_FILENO, TCSANOW, &old_term);
+    fcntl(STDIN_FILENO, F_SETFL, flags);
   }
 
 cleanup:
   // Clean up resources
-  spectralgate_destroy(sg);
+  if (recording_stream) {
+    Pa_AbortStream(recording_stream);
+    Pa_CloseStream(recording_stream);
+  }
+  if (worker_started)
+    stop_analysis_worker(&state, worker);
+  // Unblock the startup tasks if we never got devices or noise samples
+  startup_finish(&startup, STARTUP_DEVICES);
+  atomic_store(&startup.noise.capture_done, true);
+  sem_post(&startup.noise.frames_ready);
+  startup_finish(&startup, STARTUP_NOISE);
+  pthread_join(profile_thread, NULL);
+  pthread_join(gate_thread, NULL);
+  pthread_join(detector_thread, NULL);
+
+  spectralgate_destroy(startup.sg);
   free(args.voice_dir);
   free(args.output_file);
+  free(session_path);
   free(cleaned_audio);
-  free(noise_data);
+  for (int i = 0; i < startup.num_profiles; i++)
+    noiseprofile_free(&startup.profiles[i]);
+  free(startup.noise.ring);
+  sem_destroy(&startup.noise.frames_ready);
+  close(startup.noise.finished_fd);
   if (state.recorded_data)
     free(state.recorded_data);
-  if (state.pitch_detector)
-    del_aubio_pitch(state.pitch_detector);
-  if (state.input_buffer)
-    del_fvec(state.input_buffer);
-  if (state.pitch_output)
-    del_fvec(state.pitch_output);
+  free(state.preroll);
+  sem_destroy(&state.frames_ready);
+  sem_destroy(&state.analysis_drained);
+  sem_destroy(&state.take_ready);
+  close(state.finished_fd);
+  if (sigint_fd >= 0)
+    close(sigint_fd);
+  analyzer_free(&state.analyzer);
   Pa_Terminate();
-  return 0;
+  return exit_status;
 
 error:
   fprintf(stderr, "PortAudio error: %s\n", Pa_GetErrorText(err));
+  exit_status = 1;
   goto cleanup;
 }
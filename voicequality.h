@@ -0,0 +1,377 @@
+#ifndef VOICETRAINER_VOICEQUALITY
+#define VOICETRAINER_VOICEQUALITY
+
+#include <complex.h>
+#include <fftw3.h>
+#include <math.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Streaming voice quality metrics, updated once per hop from the detected f0:
+//   jitter  - mean absolute difference of consecutive glottal periods over
+//             the mean period (Praat's "local" jitter)
+//   shimmer - the same for the peak amplitude of consecutive periods
+//   HNR     - harmonics-to-noise ratio from the normalized autocorrelation
+//             at the pitch period (Boersma's window correction)
+//   CPP     - cepstral peak prominence above the cepstrum's regression line
+// HNR and CPP share one forward FFT per voiced hop: the power spectrum gives
+// the autocorrelation and the log spectrum gives the cepstrum. Take-level
+// summaries are kept as running sums, so state does not grow with the take.
+//
+// Glottal periods are marked on the waveform itself: the next mark is the
+// lag within 0.8-1.2 detected periods at which the waveform best repeats
+// the period starting at the previous mark (normalized cross-correlation,
+// refined to a fraction of a sample by a parabola). The first mark is the
+// largest sample of a period, so marks sit on the main peaks and each
+// period's amplitude is the largest absolute sample within a quarter period
+// of its mark. Marks carry across hops and restart after every unvoiced hop.
+
+#define VQ_MIN_FRAME 2048 // Smallest analysis frame, matches the aubio buffer
+#define VQ_MIN_F0 60.0f
+#define VQ_MAX_F0 880.0f
+#define VQ_MARK_LO 0.8f // Period mark search window, in detected periods
+#define VQ_MARK_HI 1.2f
+
+typedef struct {
+  float jitter;  // Relative period perturbation (0 if no period ended)
+  float shimmer; // Relative amplitude perturbation (0 if no period ended)
+  float hnr;     // dB
+  float cpp;     // dB
+} VoiceQualityFrame;
+
+typedef struct {
+  int sample_rate;
+  int hop_size;
+  int frame; // Analysis frame, holds two of the longest lags HNR searches
+  int fft;   // Zero-padded to twice the frame so autocorrelation is linear
+  int length; // History length, at least the frame; the frame is its end
+
+  float *history; // Most recent length input samples
+  float *window;
+  float *window_acf; // Normalized autocorrelation of the window
+
+  fftwf_plan forward_plan;
+  fftwf_plan inverse_plan;
+  float *time_buffer;
+  fftwf_complex *spectrum;
+  fftwf_complex *work;
+
+  // Glottal period marks, for jitter and shimmer. Positions count samples
+  // since the take started.
+  double samples;
+  bool marking; // last_mark is valid
+  double last_mark;
+  float last_amplitude;
+  float prev_period; // Period ending at last_mark (0 if none yet)
+
+  // Running take summary
+  size_t voiced_hops;
+  size_t periods;          // Consecutive period pairs compared
+  double period_sum;       // Sum of the later period of each pair
+  double period_diff_sum;  // Sum of |period difference|
+  double amplitude_sum;
+  double amplitude_diff_sum;
+  double hnr_sum;
+  double cpp_sum;
+} VoiceQuality;
+
+static inline void vq_destroy(VoiceQuality *vq) {
+  if (!vq)
+    return;
+  if (vq->forward_plan)
+    fftwf_destroy_plan(vq->forward_plan);
+  if (vq->inverse_plan)
+    fftwf_destroy_plan(vq->inverse_plan);
+  fftwf_free(vq->time_buffer);
+  fftwf_free(vq->spectrum);
+  fftwf_free(vq->work);
+  free(vq->history);
+  free(vq->window);
+  free(vq->window_acf);
+  free(vq);
+}
+
+static inline VoiceQuality *vq_create(int sample_rate, int hop_size) {
+  VoiceQuality *vq = (VoiceQuality *)calloc(1, sizeof(VoiceQuality));
+  if (!vq)
+    return NULL;
+  vq->sample_rate = sample_rate;
+  vq->hop_size = hop_size;
+
+  // The Boersma correction divides by the window's autocorrelation, which is
+  // only usable up to half the frame, so the longest lag HNR searches
+  // (1.1 periods of VQ_MIN_F0) must fit there. At 44.1 and 48 kHz that is
+  // the aubio buffer; higher rates get a longer frame.
+  int longest_lag = (int)(1.1f * sample_rate / VQ_MIN_F0) + 1;
+  vq->frame = VQ_MIN_FRAME;
+  while (vq->frame / 2 <= longest_lag || vq->frame < hop_size)
+    vq->frame *= 2;
+  vq->fft = 2 * vq->frame;
+  // Marking reaches up to VQ_MARK_HI + 1 of the longest periods past a mark
+  // that may sit up to a hop before the newest samples
+  int longest_period = (int)(sample_rate / VQ_MIN_F0) + 1;
+  vq->length = (int)((VQ_MARK_HI + 2.0f) * longest_period) + hop_size + 2;
+  if (vq->length < vq->frame)
+    vq->length = vq->frame;
+
+  vq->history = (float *)calloc(vq->length, sizeof(float));
+  vq->window = (float *)malloc(vq->frame * sizeof(float));
+  vq->time_buffer = (float *)fftwf_malloc(vq->fft * sizeof(float));
+  vq->spectrum =
+      (fftwf_complex *)fftwf_malloc((vq->fft / 2 + 1) * sizeof(fftwf_complex));
+  vq->work =
+      (fftwf_complex *)fftwf_malloc((vq->fft / 2 + 1) * sizeof(fftwf_complex));
+  vq->window_acf = (float *)malloc(vq->frame * sizeof(float));
+  if (!vq->history || !vq->window || !vq->time_buffer || !vq->spectrum ||
+      !vq->work || !vq->window_acf) {
+    vq_destroy(vq);
+    return NULL;
+  }
+
+  vq->forward_plan = fftwf_plan_dft_r2c_1d(vq->fft, vq->time_buffer,
+                                           vq->spectrum, FFTW_ESTIMATE);
+  vq->inverse_plan = fftwf_plan_dft_c2r_1d(vq->fft, vq->work, vq->time_buffer,
+                                           FFTW_ESTIMATE);
+
+  for (int i = 0; i < vq->frame; i++)
+    vq->window[i] = 0.5f * (1.0f - cosf(2.0f * M_PI * i / (vq->frame - 1)));
+
+  // Window autocorrelation, computed once
+  for (int lag = 0; lag < vq->frame; lag++) {
+    double acc = 0.0;
+    for (int i = lag; i < vq->frame; i++)
+      acc += vq->window[i] * vq->window[i - lag];
+    vq->window_acf[lag] = (float)acc;
+  }
+  for (int lag = vq->frame - 1; lag >= 0; lag--)
+    vq->window_acf[lag] /= vq->window_acf[0];
+
+  return vq;
+}
+
+// Start a new take: clear the history and the running summary
+static inline void vq_reset(VoiceQuality *vq) {
+  memset(vq->history, 0, vq->length * sizeof(float));
+  vq->samples = 0.0;
+  vq->marking = false;
+  vq->last_amplitude = vq->prev_period = 0.0f;
+  vq->voiced_hops = vq->periods = 0;
+  vq->period_sum = vq->period_diff_sum = 0.0;
+  vq->amplitude_sum = vq->amplitude_diff_sum = 0.0;
+  vq->hnr_sum = vq->cpp_sum = 0.0;
+}
+
+// Largest absolute sample within a quarter period of history[at]
+static inline float vq_amplitude(const VoiceQuality *vq, int at, float period) {
+  int reach = (int)(0.25f * period);
+  int lo = at - reach > 0 ? at - reach : 0;
+  int hi = at + reach < vq->length ? at + reach : vq->length - 1;
+  float amplitude = 0.0f;
+  for (int i = lo; i <= hi; i++)
+    if (fabsf(vq->history[i]) > amplitude)
+      amplitude = fabsf(vq->history[i]);
+  return amplitude;
+}
+
+// Normalized cross-correlation of history[from, from + len) with the same
+// span lag samples later
+static inline float vq_similarity(const VoiceQuality *vq, int from, int lag,
+                                  int len) {
+  const float *x = vq->history + from, *y = x + lag;
+  float xy = 0.0f, xx = 0.0f, yy = 0.0f;
+  for (int k = 0; k < len; k++) {
+    xy += x[k] * y[k];
+    xx += x[k] * x[k];
+    yy += y[k] * y[k];
+  }
+  return xx > 0.0f && yy > 0.0f ? xy / sqrtf(xx * yy) : 0.0f;
+}
+
+// Mark the glottal periods that ended in the latest hop. Returns the number
+// of consecutive period pairs compared and adds their differences to *dp
+// and *da (and the later period and amplitude to *sp and *sa).
+static inline int vq_mark_periods(VoiceQuality *vq, float period, double *dp,
+                                  double *sp, double *da, double *sa) {
+  double start = vq->samples - vq->length; // Position of history[0]
+  int len = (int)period;
+  if (!vq->marking || vq->last_mark < start) {
+    // Start at the largest sample of the first period of this hop
+    int lo = vq->length - vq->hop_size;
+    if (lo + len > vq->length)
+      lo = vq->length - len;
+    int best = lo;
+    for (int i = lo + 1; i < lo + len; i++)
+      if (vq->history[i] > vq->history[best])
+        best = i;
+    vq->last_mark = start + best;
+    vq->last_amplitude = vq_amplitude(vq, best, period);
+    vq->prev_period = 0.0f;
+    vq->marking = true;
+  }
+
+  int pairs = 0;
+  for (;;) {
+    int from = (int)lround(vq->last_mark - start);
+    int lo = (int)ceilf(VQ_MARK_LO * period);
+    int hi = (int)(VQ_MARK_HI * period);
+    if (from + hi + 1 + len > vq->length) // Not fully received yet
+      break;
+
+    int best = lo;
+    float best_r = -1.0f, before = 0.0f, after = 0.0f, last_r = 0.0f;
+    for (int lag = lo; lag <= hi + 1; lag++) {
+      float r = vq_similarity(vq, from, lag, len);
+      if (lag <= hi && r > best_r) {
+        best_r = r;
+        best = lag;
+        before = last_r;
+      }
+      if (lag == best + 1)
+        after = r;
+      last_r = r;
+    }
+    if (best == lo)
+      before = vq_similarity(vq, from, lo - 1, len);
+    float denom = before - 2.0f * best_r + after;
+    float offset = denom < 0.0f ? 0.5f * (before - after) / denom : 0.0f;
+    float this_period = best + offset;
+
+    float amplitude =
+        vq_amplitude(vq, (int)lround(vq->last_mark + this_period - start),
+                     period);
+
+    if (vq->prev_period > 0.0f) {
+      *dp += fabsf(this_period - vq->prev_period);
+      *sp += this_period;
+      *da += fabsf(amplitude - vq->last_amplitude);
+      *sa += amplitude;
+      pairs++;
+    }
+    vq->prev_period = this_period;
+    vq->last_amplitude = amplitude;
+    vq->last_mark += this_period;
+  }
+  return pairs;
+}
+
+// Harmonics-to-noise ratio from the power spectrum in vq->spectrum
+static inline float vq_hnr(VoiceQuality *vq, float period) {
+  for (int k = 0; k <= vq->fft / 2; k++) {
+    float mag = cabsf(vq->spectrum[k]);
+    vq->work[k] = mag * mag;
+  }
+  fftwf_execute(vq->inverse_plan);
+  const float *acf = vq->time_buffer;
+  if (acf[0] <= 0.0f)
+    return 0.0f;
+
+  // vq_create sized the frame so this stays below half of it
+  int lo = (int)(period * 0.9f), hi = (int)(period * 1.1f) + 1;
+  float best = 0.0f;
+  for (int lag = lo; lag <= hi; lag++) {
+    float r = acf[lag] / acf[0] / vq->window_acf[lag];
+    if (r > best)
+      best = r;
+  }
+  if (best >= 0.9999f)
+    best = 0.9999f;
+  if (best <= 1e-4f)
+    return -40.0f;
+  return 10.0f * log10f(best / (1.0f - best));
+}
+
+// Cepstral peak prominence from the log spectrum of vq->spectrum
+static inline float vq_cpp(VoiceQuality *vq) {
+  for (int k = 0; k <= vq->fft / 2; k++) {
+    float mag = cabsf(vq->spectrum[k]);
+    vq->work[k] = 10.0f * log10f(mag * mag + 1e-12f);
+  }
+  fftwf_execute(vq->inverse_plan);
+  const float *cep = vq->time_buffer;
+
+  int q_lo = (int)(vq->sample_rate / VQ_MAX_F0);
+  int q_hi = (int)(vq->sample_rate / VQ_MIN_F0);
+  if (q_hi >= vq->fft / 2)
+    q_hi = vq->fft / 2 - 1;
+
+  // Least-squares line through the cepstrum (in dB) over the search range
+  double sx = 0, sy = 0, sxx = 0, sxy = 0;
+  int n = q_hi - q_lo + 1;
+  int peak_q = q_lo;
+  float peak_db = -INFINITY;
+  for (int q = q_lo; q <= q_hi; q++) {
+    float db = 20.0f * log10f(fabsf(cep[q]) / vq->fft + 1e-12f);
+    sx += q;
+    sy += db;
+    sxx += (double)q * q;
+    sxy += q * db;
+    if (db > peak_db) {
+      peak_db = db;
+      peak_q = q;
+    }
+  }
+  double slope = (n * sxy - sx * sy) / (n * sxx - sx * sx);
+  double intercept = (sy - slope * sx) / n;
+  return peak_db - (float)(slope * peak_q + intercept);
+}
+
+// Feed one hop. f0 is the detected pitch (0 or below VQ_MIN_F0 when unvoiced).
+static inline void vq_do(VoiceQuality *vq, const float *hop, float f0,
+                         bool voiced, VoiceQualityFrame *out) {
+  memmove(vq->history, vq->history + vq->hop_size,
+          (vq->length - vq->hop_size) * sizeof(float));
+  memcpy(vq->history + vq->length - vq->hop_size, hop,
+         vq->hop_size * sizeof(float));
+  vq->samples += vq->hop_size;
+  memset(out, 0, sizeof(*out));
+
+  if (!voiced || f0 < VQ_MIN_F0 || f0 > VQ_MAX_F0) {
+    vq->marking = false;
+    return;
+  }
+
+  // Jitter and shimmer over the periods that ended in this hop
+  float period = vq->sample_rate / f0;
+  double dp = 0.0, sp = 0.0, da = 0.0, sa = 0.0;
+  int pairs = vq_mark_periods(vq, period, &dp, &sp, &da, &sa);
+  if (pairs) {
+    out->jitter = (float)(dp / sp);
+    if (sa > 0.0)
+      out->shimmer = (float)(da / sa);
+    vq->period_diff_sum += dp;
+    vq->period_sum += sp;
+    vq->amplitude_diff_sum += da;
+    vq->amplitude_sum += sa;
+    vq->periods += pairs;
+  }
+
+  // One forward FFT shared by HNR and CPP
+  const float *frame = vq->history + vq->length - vq->frame;
+  for (int i = 0; i < vq->frame; i++)
+    vq->time_buffer[i] = frame[i] * vq->window[i];
+  memset(vq->time_buffer + vq->frame, 0,
+         (vq->fft - vq->frame) * sizeof(float));
+  fftwf_execute(vq->forward_plan);
+
+  out->hnr = vq_hnr(vq, period);
+  out->cpp = vq_cpp(vq);
+  vq->hnr_sum += out->hnr;
+  vq->cpp_sum += out->cpp;
+  vq->voiced_hops++;
+}
+
+static inline void vq_summary(const VoiceQuality *vq,
+                              VoiceQualityFrame *summary) {
+  memset(summary, 0, sizeof(*summary));
+  if (vq->period_sum > 0.0)
+    summary->jitter = vq->period_diff_sum / vq->period_sum;
+  if (vq->amplitude_sum > 0.0)
+    summary->shimmer = vq->amplitude_diff_sum / vq->amplitude_sum;
+  if (vq->voiced_hops) {
+    summary->hnr = vq->hnr_sum / vq->voiced_hops;
+    summary->cpp = vq->cpp_sum / vq->voiced_hops;
+  }
+}
+
+#endif /* VOICETRAINER_VOICEQUALITY */